@@ -0,0 +1,441 @@
+/*
+ * blit.h — Shared XRGB8888 glyph blitter for opalterm and drm_canvas.
+ *
+ * Header-only so each single-file program keeps its one-line build.
+ * Blends an 8-bit coverage bitmap between a foreground and background
+ * color: out = (fg * a + bg * (255 - a)) / 255, with the division done
+ * as (x + 1 + (x >> 8)) >> 8, which is exact for every x <= 255 * 255.
+ * Pixels with zero coverage are left untouched.
+ *
+ * No kernel ever loads from the destination: the render target is
+ * usually a write-combined dumb buffer, where reads are uncached and
+ * stall on the pending writes. Vectors that mix covered and uncovered
+ * pixels are stored with a lane mask (AVX2) or a lane at a time.
+ *
+ * Also provides blit_fill(), a clipped solid rectangle fill with wide
+ * (optionally non-temporal) stores, and blit_preblend()/blit_copy_glyph()
+ * for glyphs blended once up front: the X byte of each pre-blended
+ * pixel is 0xFF where coverage was nonzero and 0 where the destination
+ * must be kept, so the copy matches blit_glyph() bit for bit.
+ *
+ * The row kernels are picked once at runtime: AVX2 or SSE2 on x86-64,
+ * NEON on aarch64, scalar everywhere else.
+ */
+
+#ifndef OPALTERM_BLIT_H
+#define OPALTERM_BLIT_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define BLIT_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define BLIT_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef void (*blit_row_fn)(uint32_t *dst, const uint8_t *cov, int n,
+                            uint32_t fg, uint32_t bg);
+typedef void (*blit_fill_fn)(uint32_t *dst, int n, uint32_t color, int nt);
+typedef void (*blit_copy_fn)(uint32_t *dst, const uint32_t *src, int n);
+
+/* Rows shorter than this never use non-temporal stores. */
+#define BLIT_NT_MIN_PX 64
+
+static inline uint32_t blit_div255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+static inline uint32_t blit_blend_px(uint32_t fg, uint32_t bg, uint32_t a) {
+  uint32_t ia = 255 - a;
+  uint32_t r = blit_div255(((fg >> 16) & 0xFF) * a + ((bg >> 16) & 0xFF) * ia);
+  uint32_t g = blit_div255(((fg >> 8) & 0xFF) * a + ((bg >> 8) & 0xFF) * ia);
+  uint32_t b = blit_div255((fg & 0xFF) * a + (bg & 0xFF) * ia);
+  return (r << 16) | (g << 8) | b;
+}
+
+static void blit_row_scalar(uint32_t *dst, const uint8_t *cov, int n,
+                            uint32_t fg, uint32_t bg) {
+  for (int i = 0; i < n; i++) {
+    uint32_t a = cov[i];
+    if (a == 255)
+      dst[i] = fg;
+    else if (a)
+      dst[i] = blit_blend_px(fg, bg, a);
+  }
+}
+
+static void blit_copy_scalar(uint32_t *dst, const uint32_t *src, int n) {
+  for (int i = 0; i < n; i++)
+    if (src[i] >> 24)
+      dst[i] = src[i] & 0x00FFFFFFu;
+}
+
+static void blit_fill_scalar(uint32_t *dst, int n, uint32_t color, int nt) {
+  (void)nt;
+  for (int i = 0; i < n; i++)
+    dst[i] = color;
+}
+
+#ifdef BLIT_X86
+
+static void blit_fill_sse2(uint32_t *dst, int n, uint32_t color, int nt) {
+  const __m128i v = _mm_set1_epi32((int)color);
+  int i = 0;
+  if (nt && n >= BLIT_NT_MIN_PX) {
+    for (; ((uintptr_t)(dst + i) & 15) != 0; i++)
+      dst[i] = color;
+    for (; i + 4 <= n; i += 4)
+      _mm_stream_si128((__m128i *)(dst + i), v);
+  } else {
+    for (; i + 4 <= n; i += 4)
+      _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+  blit_fill_scalar(dst + i, n - i, color, 0);
+}
+
+__attribute__((target("avx2"))) static void
+blit_fill_avx2(uint32_t *dst, int n, uint32_t color, int nt) {
+  const __m256i v = _mm256_set1_epi32((int)color);
+  int i = 0;
+  if (nt && n >= BLIT_NT_MIN_PX) {
+    for (; ((uintptr_t)(dst + i) & 31) != 0; i++)
+      dst[i] = color;
+    for (; i + 8 <= n; i += 8)
+      _mm256_stream_si256((__m256i *)(dst + i), v);
+  } else {
+    for (; i + 8 <= n; i += 8)
+      _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+  blit_fill_scalar(dst + i, n - i, color, 0);
+}
+
+/* The X byte's sign bit is the mask: all-set vectors are stored whole,
+ * mixed ones a pixel at a time. */
+static void blit_copy_sse2(uint32_t *dst, const uint32_t *src, int n) {
+  const __m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    int m = _mm_movemask_ps(_mm_castsi128_ps(s));
+    if (m == 0xF)
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_and_si128(s, rgb));
+    else if (m)
+      blit_copy_scalar(dst + i, src + i, 4);
+  }
+  blit_copy_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+blit_copy_avx2(uint32_t *dst, const uint32_t *src, int n) {
+  const __m256i rgb = _mm256_set1_epi32(0x00FFFFFF);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    int m = _mm256_movemask_ps(_mm256_castsi256_ps(s));
+    if (m == 0xFF)
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_and_si256(s, rgb));
+    else if (m)
+      _mm256_maskstore_epi32((int *)(dst + i), s, _mm256_and_si256(s, rgb));
+  }
+  blit_copy_sse2(dst + i, src + i, n - i);
+}
+
+/* 4 pixels per step: each coverage byte is spread over its pixel's four
+ * channels, widened to 16 bits and blended two pixels per register. */
+static void blit_row_sse2(uint32_t *dst, const uint8_t *cov, int n,
+                          uint32_t fg, uint32_t bg) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i fg16 = _mm_unpacklo_epi8(_mm_set1_epi32((int)fg), zero);
+  const __m128i bg16 = _mm_unpacklo_epi8(_mm_set1_epi32((int)bg), zero);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32_t c4;
+    memcpy(&c4, cov + i, 4);
+    if (c4 == 0)
+      continue;
+    __m128i a = _mm_cvtsi32_si128((int)c4);
+    a = _mm_unpacklo_epi8(a, a);
+    a = _mm_unpacklo_epi16(a, a);
+    __m128i alo = _mm_unpacklo_epi8(a, zero);
+    __m128i ahi = _mm_unpackhi_epi8(a, zero);
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(fg16, alo),
+                               _mm_mullo_epi16(bg16, _mm_sub_epi16(full, alo)));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(fg16, ahi),
+                               _mm_mullo_epi16(bg16, _mm_sub_epi16(full, ahi)));
+    lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one),
+                                      _mm_srli_epi16(lo, 8)),
+                        8);
+    hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one),
+                                      _mm_srli_epi16(hi, 8)),
+                        8);
+    __m128i px = _mm_packus_epi16(lo, hi);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0) {
+      _mm_storeu_si128((__m128i *)(dst + i), px);
+    } else {
+      uint32_t out[4];
+      _mm_storeu_si128((__m128i *)out, px);
+      for (int k = 0; k < 4; k++)
+        if (cov[i + k])
+          dst[i + k] = out[k];
+    }
+  }
+  blit_row_scalar(dst + i, cov + i, n - i, fg, bg);
+}
+
+/* 8 pixels per step; unpacks stay within 128-bit lanes, so packing the
+ * lo/hi halves back together restores pixel order. */
+__attribute__((target("avx2"))) static void
+blit_row_avx2(uint32_t *dst, const uint8_t *cov, int n, uint32_t fg,
+              uint32_t bg) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi16(1);
+  const __m256i full = _mm256_set1_epi16(255);
+  const __m256i spread = _mm256_set1_epi32(0x01010101);
+  const __m256i ones = _mm256_set1_epi32(-1);
+  const __m256i fg16 = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)fg), zero);
+  const __m256i bg16 = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)bg), zero);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t c8;
+    memcpy(&c8, cov + i, 8);
+    if (c8 == 0)
+      continue;
+    __m256i a =
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(cov + i)));
+    a = _mm256_mullo_epi32(a, spread);
+    __m256i alo = _mm256_unpacklo_epi8(a, zero);
+    __m256i ahi = _mm256_unpackhi_epi8(a, zero);
+    __m256i lo = _mm256_add_epi16(
+        _mm256_mullo_epi16(fg16, alo),
+        _mm256_mullo_epi16(bg16, _mm256_sub_epi16(full, alo)));
+    __m256i hi = _mm256_add_epi16(
+        _mm256_mullo_epi16(fg16, ahi),
+        _mm256_mullo_epi16(bg16, _mm256_sub_epi16(full, ahi)));
+    lo = _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_add_epi16(lo, one), _mm256_srli_epi16(lo, 8)),
+        8);
+    hi = _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_add_epi16(hi, one), _mm256_srli_epi16(hi, 8)),
+        8);
+    __m256i px = _mm256_packus_epi16(lo, hi);
+    __m256i keep = _mm256_cmpeq_epi32(a, zero);
+    if (_mm256_movemask_epi8(keep) == 0)
+      _mm256_storeu_si256((__m256i *)(dst + i), px);
+    else
+      _mm256_maskstore_epi32((int *)(dst + i), _mm256_xor_si256(keep, ones),
+                             px);
+  }
+  blit_row_sse2(dst + i, cov + i, n - i, fg, bg);
+}
+
+#endif /* BLIT_X86 */
+
+#ifdef BLIT_NEON
+
+static void blit_fill_neon(uint32_t *dst, int n, uint32_t color, int nt) {
+  (void)nt;
+  const uint32x4_t v = vdupq_n_u32(color);
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_u32(dst + i, v);
+  blit_fill_scalar(dst + i, n - i, color, 0);
+}
+
+static void blit_copy_neon(uint32_t *dst, const uint32_t *src, int n) {
+  const uint32x4_t rgb = vdupq_n_u32(0x00FFFFFF);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t s = vld1q_u32(src + i);
+    uint32x4_t m =
+        vreinterpretq_u32_s32(vshrq_n_s32(vreinterpretq_s32_u32(s), 31));
+    if (vminvq_u32(m))
+      vst1q_u32(dst + i, vandq_u32(s, rgb));
+    else if (vmaxvq_u32(m))
+      blit_copy_scalar(dst + i, src + i, 4);
+  }
+  blit_copy_scalar(dst + i, src + i, n - i);
+}
+
+/* 8 pixels per step, blended per B/G/R plane and interleaved by vst4. */
+static void blit_row_neon(uint32_t *dst, const uint8_t *cov, int n,
+                          uint32_t fg, uint32_t bg) {
+  const uint8x8_t fb = vdup_n_u8(fg & 0xFF), fgg = vdup_n_u8((fg >> 8) & 0xFF),
+                  fr = vdup_n_u8((fg >> 16) & 0xFF);
+  const uint8x8_t bb = vdup_n_u8(bg & 0xFF), bgg = vdup_n_u8((bg >> 8) & 0xFF),
+                  br = vdup_n_u8((bg >> 16) & 0xFF);
+  const uint16x8_t one = vdupq_n_u16(1);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint8x8_t a = vld1_u8(cov + i);
+    if (vget_lane_u64(vreinterpret_u64_u8(a), 0) == 0)
+      continue;
+    uint8x8_t ia = vmvn_u8(a);
+    uint8x8x4_t px;
+#define BLIT_NEON_CH(f, b, out)                                               \
+  do {                                                                         \
+    uint16x8_t x = vmlal_u8(vmull_u8(f, a), b, ia);                            \
+    out = vshrn_n_u16(vaddq_u16(vaddq_u16(x, one), vshrq_n_u16(x, 8)), 8);     \
+  } while (0)
+    BLIT_NEON_CH(fb, bb, px.val[0]);
+    BLIT_NEON_CH(fgg, bgg, px.val[1]);
+    BLIT_NEON_CH(fr, br, px.val[2]);
+#undef BLIT_NEON_CH
+    px.val[3] = vdup_n_u8(0);
+    if (vminv_u8(a)) {
+      vst4_u8((uint8_t *)(dst + i), px);
+    } else {
+      uint32_t out[8];
+      vst4_u8((uint8_t *)out, px);
+      for (int k = 0; k < 8; k++)
+        if (cov[i + k])
+          dst[i + k] = out[k];
+    }
+  }
+  blit_row_scalar(dst + i, cov + i, n - i, fg, bg);
+}
+
+#endif /* BLIT_NEON */
+
+static blit_row_fn blit_row_impl;
+static blit_fill_fn blit_fill_impl;
+static blit_copy_fn blit_copy_impl;
+
+static void blit_select(void) {
+#if defined(BLIT_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    blit_row_impl = blit_row_avx2;
+    blit_fill_impl = blit_fill_avx2;
+    blit_copy_impl = blit_copy_avx2;
+  } else {
+    blit_row_impl = blit_row_sse2;
+    blit_fill_impl = blit_fill_sse2;
+    blit_copy_impl = blit_copy_sse2;
+  }
+#elif defined(BLIT_NEON)
+  blit_row_impl = blit_row_neon;
+  blit_fill_impl = blit_fill_neon;
+  blit_copy_impl = blit_copy_neon;
+#else
+  blit_row_impl = blit_row_scalar;
+  blit_fill_impl = blit_fill_scalar;
+  blit_copy_impl = blit_copy_scalar;
+#endif
+}
+
+/*
+ * blit_glyph — blend a coverage bitmap into an XRGB8888 surface.
+ *
+ * The glyph rectangle is clipped against the surface once; each
+ * surviving row is then handed to the row kernel in one call.
+ */
+static void blit_glyph(const uint8_t *cov, int cov_w, int cov_h, int pitch,
+                       uint8_t *fb, uint32_t stride, uint32_t scr_w,
+                       uint32_t scr_h, int pen_x, int pen_y, uint32_t fg,
+                       uint32_t bg) {
+  int x0 = pen_x < 0 ? -pen_x : 0;
+  int y0 = pen_y < 0 ? -pen_y : 0;
+  int x1 = cov_w, y1 = cov_h;
+  if (pen_x + x1 > (int)scr_w)
+    x1 = (int)scr_w - pen_x;
+  if (pen_y + y1 > (int)scr_h)
+    y1 = (int)scr_h - pen_y;
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  if (!blit_row_impl)
+    blit_select();
+
+  for (int row = y0; row < y1; row++) {
+    uint32_t *dst = (uint32_t *)(fb + (size_t)(pen_y + row) * stride) + pen_x;
+    blit_row_impl(dst + x0, cov + (size_t)row * (size_t)pitch + x0, x1 - x0,
+                  fg, bg);
+  }
+}
+
+/*
+ * blit_fill — fill a solid rectangle of an XRGB8888 surface.
+ *
+ * Clipped once, then filled a row at a time with wide stores. Set @nt
+ * when the surface is write-combined scanout memory that won't be
+ * read back soon: long rows then use streaming stores that bypass the
+ * cache.
+ */
+static void blit_fill(uint8_t *fb, uint32_t stride, uint32_t scr_w,
+                      uint32_t scr_h, int x, int y, int w, int h,
+                      uint32_t color, int nt) {
+  int x1 = x + w, y1 = y + h;
+  if (x < 0)
+    x = 0;
+  if (y < 0)
+    y = 0;
+  if (x1 > (int)scr_w)
+    x1 = (int)scr_w;
+  if (y1 > (int)scr_h)
+    y1 = (int)scr_h;
+  if (x >= x1 || y >= y1)
+    return;
+
+  if (!blit_fill_impl)
+    blit_select();
+
+  for (int row = y; row < y1; row++)
+    blit_fill_impl((uint32_t *)(fb + (size_t)row * stride) + x, x1 - x, color,
+                   nt);
+#ifdef BLIT_X86
+  if (nt && x1 - x >= BLIT_NT_MIN_PX)
+    _mm_sfence();
+#endif
+}
+
+/*
+ * blit_preblend — blend a coverage bitmap once into packed (pitch
+ * @cov_w) pixels for blit_copy_glyph(). Runs on cache misses only.
+ */
+static inline void blit_preblend(const uint8_t *cov, int cov_w, int cov_h,
+                                 int pitch, uint32_t *out, uint32_t fg,
+                                 uint32_t bg) {
+  fg &= 0x00FFFFFFu;
+  bg &= 0x00FFFFFFu;
+  for (int row = 0; row < cov_h; row++)
+    for (int i = 0; i < cov_w; i++) {
+      uint32_t a = cov[(size_t)row * (size_t)pitch + i];
+      *out++ = a == 0     ? 0
+               : a == 255 ? 0xFF000000u | fg
+                          : 0xFF000000u | blit_blend_px(fg, bg, a);
+    }
+}
+
+/*
+ * blit_copy_glyph — draw a blit_preblend() result. Clipped like
+ * blit_glyph(); each row is one masked copy.
+ */
+static inline void blit_copy_glyph(const uint32_t *src, int w, int h,
+                                   uint8_t *fb, uint32_t stride,
+                                   uint32_t scr_w, uint32_t scr_h, int pen_x,
+                                   int pen_y) {
+  int x0 = pen_x < 0 ? -pen_x : 0;
+  int y0 = pen_y < 0 ? -pen_y : 0;
+  int x1 = w, y1 = h;
+  if (pen_x + x1 > (int)scr_w)
+    x1 = (int)scr_w - pen_x;
+  if (pen_y + y1 > (int)scr_h)
+    y1 = (int)scr_h - pen_y;
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  if (!blit_copy_impl)
+    blit_select();
+
+  for (int row = y0; row < y1; row++) {
+    uint32_t *dst = (uint32_t *)(fb + (size_t)(pen_y + row) * stride) + pen_x;
+    blit_copy_impl(dst + x0, src + (size_t)row * (size_t)w + x0, x1 - x0);
+  }
+}
+
+#endif /* OPALTERM_BLIT_H */
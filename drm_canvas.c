@@ -31,6 +31,8 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#include "blit.h" /* blit_glyph(), shared with opalterm */
+
 /* ── Configuration ──────────────────────────────────────────────── */
 
 /* Font path — change this to any monospace TTF on your system      */
@@ -63,46 +65,14 @@ static void die(const char *msg) {
  * @pen_y:  top-left Y on screen where the glyph starts
  *
  * The DRM buffer is XRGB8888.  FreeType gives us an 8-bit coverage
- * map (0 = transparent, 255 = fully opaque).  We do a simple alpha
- * blend between BG_COLOR and FG_COLOR based on that coverage value.
+ * map (0 = transparent, 255 = fully opaque).  blit_glyph() clips the
+ * glyph once and alpha-blends BG_COLOR -> FG_COLOR a row at a time
+ * with the same SIMD kernel opalterm uses.
  */
 static void draw_bitmap(const FT_Bitmap *bmp, uint8_t *fb, uint32_t stride,
                         uint32_t scr_w, uint32_t scr_h, int pen_x, int pen_y) {
-  /* Decompose foreground and background into RGB channels once */
-  uint32_t fg_r = (FG_COLOR >> 16) & 0xFF;
-  uint32_t fg_g = (FG_COLOR >> 8) & 0xFF;
-  uint32_t fg_b = (FG_COLOR) & 0xFF;
-
-  uint32_t bg_r = (BG_COLOR >> 16) & 0xFF;
-  uint32_t bg_g = (BG_COLOR >> 8) & 0xFF;
-  uint32_t bg_b = (BG_COLOR) & 0xFF;
-
-  for (unsigned int row = 0; row < bmp->rows; row++) {
-    for (unsigned int col = 0; col < bmp->width; col++) {
-
-      int sx = pen_x + (int)col; /* screen X */
-      int sy = pen_y + (int)row; /* screen Y */
-
-      /* Clip to screen bounds */
-      if (sx < 0 || sy < 0 || (uint32_t)sx >= scr_w || (uint32_t)sy >= scr_h)
-        continue;
-
-      /* FreeType coverage: 0..255 */
-      uint8_t alpha = bmp->buffer[row * (unsigned int)bmp->pitch + col];
-      if (alpha == 0)
-        continue; /* fully transparent — skip */
-
-      /* Alpha blend: out = fg * a + bg * (1 - a)  */
-      uint32_t r = (fg_r * alpha + bg_r * (255 - alpha)) / 255;
-      uint32_t g = (fg_g * alpha + bg_g * (255 - alpha)) / 255;
-      uint32_t b = (fg_b * alpha + bg_b * (255 - alpha)) / 255;
-
-      /* Write the blended pixel into the framebuffer */
-      uint32_t *pixel =
-          (uint32_t *)(fb + (uint32_t)sy * stride + (uint32_t)sx * 4);
-      *pixel = (r << 16) | (g << 8) | b;
-    }
-  }
+  blit_glyph(bmp->buffer, (int)bmp->width, (int)bmp->rows, bmp->pitch, fb,
+             stride, scr_w, scr_h, pen_x, pen_y, FG_COLOR, BG_COLOR);
 }
 
 /*
@@ -292,12 +262,8 @@ int main(void) {
     die("mmap");
 
   /* ── Fill the screen with the background color ─────────────── */
-  for (uint32_t y = 0; y < height; y++) {
-    uint32_t *row = (uint32_t *)(framebuffer + y * stride);
-    for (uint32_t x = 0; x < width; x++) {
-      row[x] = BG_COLOR;
-    }
-  }
+  blit_fill(framebuffer, stride, width, height, 0, 0, (int)width, (int)height,
+            BG_COLOR, 1);
 
   fprintf(stderr, "[drm_canvas] Background filled.\n");
 
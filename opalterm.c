@@ -2,9 +2,13 @@
 /*
  * opalterm.c — Bare-metal DRM terminal emulator.
  *
- * Single-file C program: DRM framebuffer, FreeType glyph rendering,
- * libvterm terminal emulation, tabbed sessions with vertical splits,
- * shadow-buffered two-pass rendering, and Unix socket IPC.
+ * Single-file C program: FreeType glyph rendering and libvterm
+ * terminal emulation on DRM/KMS, with every connected monitor driven
+ * at once. Each output shows its own tabs, each tab a tree of
+ * vertical and horizontal splits. Frames are drawn two-pass into a
+ * heap shadow copied to scanout, or into off-screen dumb buffers that
+ * are page-flipped. PTYs are served by an I/O thread, and a Unix
+ * socket takes IPC commands.
  *
  * Compile: make
  * Run:     sudo ./opalterm
@@ -13,18 +17,26 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <linux/netlink.h>
 #include <linux/vt.h>
 #include <poll.h>
+#include <pthread.h>
 #include <pty.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
@@ -38,12 +50,36 @@
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_SYNTHESIS_H
 
 #include <vterm.h>
 
+#ifdef OPALTERM_IO_URING
+#include <liburing.h>
+#endif
+
+#ifdef OPALTERM_EVDEV
+#include <dirent.h>
+#include <libevdev/libevdev.h>
+#include <xkbcommon/xkbcommon.h>
+#endif
+
+#include "blit.h"
+
 /* -- Constants ---------------------------------------------------- */
 
-#define IPC_READ_TIMEOUT_MS 200
+#define IPC_REPLY_TIMEOUT_MS 2000
+#define IPC_MAX_CLIENTS 16
+#define IPC_MSG_MAX 4096
+#define IPC_CMD_MAX 64
+#define IPC_READS_PER_WAKE 8
+#define IPC_REPLY_MAX (4 * 1024 * 1024)
+#define ECHO_FASTPATH_MS 50
+#define HEADLESS_PARSE_MS 10
+#define PTY_RBUF_MIN 4096
+#define PTY_RBUF_MAX (256 * 1024)
+#define PTY_RBUF_SHRINK_AFTER 64
+#define PTY_TX_PEND_MAX (4 * 1024 * 1024)
 
 static void get_socket_path(char *buf, size_t size) {
   snprintf(buf, size, "/tmp/opalterm_%d.sock", getuid());
@@ -52,41 +88,241 @@ static void get_socket_path(char *buf, size_t size) {
 /* -- Logging ------------------------------------------------------ */
 
 #define LOG_PATH "/tmp/opalterm.log"
+#define LOG_RING_SLOTS 1024 /* power of two */
+#define LOG_RECORD_MAX 240
+#define LOG_FLUSH_MS 100
+
+enum { LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_FATAL };
+
+static const char *const log_level_names[] = {"DEBUG", "INFO", "WARN",
+                                              "FATAL"};
+
+/* Records below this level are dropped before they are formatted. */
+static _Atomic int g_log_level = LOG_LEVEL_INFO;
+
+/* A record is formatted in place by whichever thread logs and written
+ * out later, with its timestamp, by the log writer thread. seq runs
+ * ahead of the slot index the way Vyukov's bounded queue does it: a
+ * producer owns the slot while seq equals its claimed position, and
+ * the writer while seq is one past it. */
+typedef struct {
+  _Atomic size_t seq;
+  time_t sec;
+  uint16_t len;
+  uint8_t level;
+  char text[LOG_RECORD_MAX];
+} LogRecord;
+
+typedef struct {
+  LogRecord slots[LOG_RING_SLOTS];
+  _Atomic size_t tail;    /* next position a producer claims */
+  size_t head;            /* writer only */
+  uint64_t dropped_noted; /* writer only */
+  _Atomic uint64_t records, dropped;
+  _Atomic int stop;
+  int fd; /* -1 until log_init() */
+  int wake_fd;
+  int threaded; /* else every record is written on the spot */
+  pthread_t thread;
+  pthread_mutex_t sync_lock;
+} LogRing;
+
+static LogRing g_log = {.fd = -1,
+                        .wake_fd = -1,
+                        .sync_lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Wall clock second taken once per main loop iteration by log_tick();
+ * threads that never tick read the clock per record. */
+static _Thread_local time_t t_log_now;
+
+static void log_tick(void) { t_log_now = time(NULL); }
+
+static int log_level_parse(const char *name) {
+  for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_FATAL; i++)
+    if (strcasecmp(name, log_level_names[i]) == 0)
+      return i;
+  return -1;
+}
+
+/* A failed wakeup only delays the write until the next LOG_FLUSH_MS. */
+static void log_wake(void) {
+  uint64_t one = 1;
+  ssize_t n = write(g_log.wake_fd, &one, sizeof(one));
+  (void)n;
+}
+
+static const char *log_stamp(time_t sec) {
+  static time_t last_sec = -1;
+  static char tb[16];
+  if (sec != last_sec) {
+    struct tm t;
+    localtime_r(&sec, &t);
+    strftime(tb, sizeof(tb), "%H:%M:%S", &t);
+    last_sec = sec;
+  }
+  return tb;
+}
+
+static void log_write_all(const char *buf, size_t len) {
+  while (len) {
+    ssize_t n = write(g_log.fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= (size_t)n;
+  }
+}
+
+/* Writes every published record in one batch; only the writer thread
+ * (or, without it, whoever holds sync_lock) may call this. */
+static void log_drain(void) {
+  static char out[64 * 1024];
+  size_t len = 0;
+  uint64_t dropped = atomic_load(&g_log.dropped) - g_log.dropped_noted;
+  g_log.dropped_noted += dropped;
+  for (;;) {
+    LogRecord *r = &g_log.slots[g_log.head & (LOG_RING_SLOTS - 1)];
+    int ready = atomic_load_explicit(&r->seq, memory_order_acquire) ==
+                g_log.head + 1;
+    if (len && (!ready || len + 32 + r->len > sizeof(out))) {
+      log_write_all(out, len);
+      len = 0;
+    }
+    if (!ready)
+      break;
+    len += (size_t)snprintf(out + len, 32, "[%s][%s] ", log_stamp(r->sec),
+                            log_level_names[r->level]);
+    memcpy(out + len, r->text, r->len);
+    len += r->len;
+    atomic_store_explicit(&r->seq, g_log.head + LOG_RING_SLOTS,
+                          memory_order_release);
+    g_log.head++;
+  }
+  if (dropped) {
+    char note[64];
+    int n = snprintf(note, sizeof(note),
+                     "[%s][WARN] %" PRIu64 " log records dropped.\n",
+                     log_stamp(time(NULL)), dropped);
+    log_write_all(note, (size_t)n);
+  }
+}
 
-static FILE *g_logfile = NULL;
+static void *log_writer_main(void *arg) {
+  (void)arg;
+  for (;;) {
+    int stop = atomic_load(&g_log.stop);
+    struct pollfd pfd = {.fd = g_log.wake_fd, .events = POLLIN};
+    if (!stop && poll(&pfd, 1, LOG_FLUSH_MS) > 0) {
+      uint64_t v;
+      while (read(g_log.wake_fd, &v, sizeof(v)) > 0)
+        ;
+    }
+    log_drain();
+    if (stop)
+      return NULL;
+  }
+}
 
 static void log_init(void) {
-  g_logfile = fopen(LOG_PATH, "w");
-  if (!g_logfile)
-    g_logfile = stderr;
+  g_log.fd = open(LOG_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (g_log.fd < 0)
+    g_log.fd = STDERR_FILENO;
+  for (size_t i = 0; i < LOG_RING_SLOTS; i++)
+    atomic_store(&g_log.slots[i].seq, i);
+  g_log.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g_log.wake_fd < 0)
+    return;
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  g_log.threaded =
+      pthread_create(&g_log.thread, NULL, log_writer_main, NULL) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
+/* Flushes whatever is still queued; later records are discarded. */
 static void log_close(void) {
-  if (g_logfile && g_logfile != stderr) {
-    fclose(g_logfile);
-    g_logfile = NULL;
+  if (g_log.fd < 0)
+    return;
+  if (g_log.threaded) {
+    atomic_store(&g_log.stop, 1);
+    log_wake();
+    pthread_join(g_log.thread, NULL);
+    g_log.threaded = 0;
+  } else {
+    log_drain();
   }
+  if (g_log.wake_fd >= 0)
+    close(g_log.wake_fd);
+  if (g_log.fd != STDERR_FILENO)
+    close(g_log.fd);
+  g_log.fd = g_log.wake_fd = -1;
 }
 
+/* Never blocks and never enters the kernel, short of the wakeup when
+ * the ring is half full or a FATAL record needs to hit the disk. A
+ * full ring drops the record and counts it instead. */
 __attribute__((format(printf, 2, 3))) static void
-log_msg(const char *level, const char *fmt, ...) {
-  if (!g_logfile)
+log_msg(int level, const char *fmt, ...) {
+  if (g_log.fd < 0)
     return;
-  time_t now = time(NULL);
-  struct tm *t = localtime(&now);
-  char tb[16];
-  strftime(tb, sizeof(tb), "%H:%M:%S", t);
-  fprintf(g_logfile, "[%s][%s] ", tb, level);
+  size_t pos = atomic_load_explicit(&g_log.tail, memory_order_relaxed);
+  LogRecord *r;
+  for (;;) {
+    r = &g_log.slots[pos & (LOG_RING_SLOTS - 1)];
+    size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&g_log.tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (seq < pos) {
+      atomic_fetch_add_explicit(&g_log.dropped, 1, memory_order_relaxed);
+      return;
+    } else {
+      pos = atomic_load_explicit(&g_log.tail, memory_order_relaxed);
+    }
+  }
+
+  r->sec = t_log_now ? t_log_now : time(NULL);
+  r->level = (uint8_t)level;
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(g_logfile, fmt, ap);
+  int n = vsnprintf(r->text, sizeof(r->text), fmt, ap);
   va_end(ap);
-  fflush(g_logfile);
+  if (n < 0)
+    n = 0;
+  if ((size_t)n >= sizeof(r->text)) { /* truncated: keep the newline */
+    n = (int)sizeof(r->text) - 1;
+    r->text[n - 1] = '\n';
+  }
+  r->len = (uint16_t)n;
+  atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+  atomic_fetch_add_explicit(&g_log.records, 1, memory_order_relaxed);
+
+  if (!g_log.threaded) {
+    pthread_mutex_lock(&g_log.sync_lock);
+    log_drain();
+    pthread_mutex_unlock(&g_log.sync_lock);
+  } else if (level == LOG_LEVEL_FATAL ||
+             (pos & (LOG_RING_SLOTS / 2 - 1)) == 0) {
+    log_wake();
+  }
 }
 
-#define LOG_INFO(...) log_msg("INFO", __VA_ARGS__)
-#define LOG_WARN(...) log_msg("WARN", __VA_ARGS__)
-#define LOG_FATAL(...) log_msg("FATAL", __VA_ARGS__)
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) >=                                                             \
+        atomic_load_explicit(&g_log_level, memory_order_relaxed))             \
+      log_msg(level, __VA_ARGS__);                                             \
+  } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_FATAL(...) LOG_AT(LOG_LEVEL_FATAL, __VA_ARGS__)
 
 /* -- Helpers ------------------------------------------------------ */
 
@@ -94,6 +330,89 @@ static inline uint32_t rgb_pack(uint8_t r, uint8_t g, uint8_t b) {
   return ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
 }
 
+/* Encodes one code point, returning its length (1-4). */
+static int utf8_put(uint8_t *p, uint32_t cp) {
+  if (cp < 0x80) {
+    p[0] = (uint8_t)cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    p[0] = (uint8_t)(0xC0 | (cp >> 6));
+    p[1] = (uint8_t)(0x80 | (cp & 0x3F));
+    return 2;
+  }
+  if (cp < 0x10000) {
+    p[0] = (uint8_t)(0xE0 | (cp >> 12));
+    p[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+    p[2] = (uint8_t)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+  p[0] = (uint8_t)(0xF0 | (cp >> 18));
+  p[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+  p[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+  p[3] = (uint8_t)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+/* Decodes a code point written by utf8_put() and advances *p. */
+static uint32_t utf8_get(const uint8_t **p) {
+  const uint8_t *s = *p;
+  uint32_t cp;
+  int n;
+  if (s[0] < 0x80) {
+    cp = s[0];
+    n = 1;
+  } else if (s[0] < 0xE0) {
+    cp = s[0] & 0x1Fu;
+    n = 2;
+  } else if (s[0] < 0xF0) {
+    cp = s[0] & 0x0Fu;
+    n = 3;
+  } else {
+    cp = s[0] & 0x07u;
+    n = 4;
+  }
+  for (int i = 1; i < n; i++)
+    cp = (cp << 6) | (s[i] & 0x3Fu);
+  *p = s + n;
+  return cp;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* $XDG_CACHE_HOME/opalterm/<name>, or ~/.cache/opalterm/<name>; with
+ * create set, the directories are made as needed. */
+static int cache_path(char *buf, size_t size, const char *name, int create) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+  if (xdg && *xdg)
+    n = snprintf(buf, size, "%s/opalterm", xdg);
+  else if (home && *home)
+    n = snprintf(buf, size, "%s/.cache/opalterm", home);
+  else
+    return -1;
+  if (n < 0 || (size_t)n >= size)
+    return -1;
+  if (create) {
+    for (char *p = buf + 1; *p; p++) {
+      if (*p != '/')
+        continue;
+      *p = '\0';
+      mkdir(buf, 0755);
+      *p = '/';
+    }
+    if (mkdir(buf, 0755) < 0 && errno != EEXIST)
+      return -1;
+  }
+  n = snprintf(buf + n, size - (size_t)n, "/%s", name);
+  return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
 #define MAX_EAGAIN_RETRIES 50
 
 static int write_all(int fd, const char *buf, size_t len) {
@@ -166,10 +485,166 @@ static int enable_raw_mode(void) {
   return 0;
 }
 
+/* -- Byte Ring ---------------------------------------------------- */
+
+/* Single-producer/single-consumer byte queue. head is only advanced by
+ * the reader and tail only by the writer; both count every byte ever
+ * passed and are reduced modulo cap on use, and each side publishes
+ * its index with release ordering, so the PTY I/O thread and the main
+ * thread can share a ring without a lock. */
+typedef struct {
+  char *data;
+  size_t cap;
+  _Atomic size_t head, tail;
+} ByteRing;
+
+static int ring_alloc(ByteRing *r, size_t cap) {
+  r->data = malloc(cap);
+  if (!r->data)
+    return -1;
+  r->cap = cap;
+  atomic_store(&r->head, 0);
+  atomic_store(&r->tail, 0);
+  return 0;
+}
+
+static void ring_free(ByteRing *r) {
+  free(r->data);
+  r->data = NULL;
+  r->cap = 0;
+  atomic_store(&r->head, 0);
+  atomic_store(&r->tail, 0);
+}
+
+static size_t ring_len(const ByteRing *r) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  return tail - atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+/* Writer side: contiguous free span at the tail; commit what was filled. */
+static char *ring_write_span(ByteRing *r, size_t *n) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (!r->cap) {
+    *n = 0;
+    return r->data;
+  }
+  size_t off = tail % r->cap;
+  size_t free_total = r->cap - (tail - head);
+  size_t to_end = r->cap - off;
+  *n = free_total < to_end ? free_total : to_end;
+  return r->data + off;
+}
+
+static void ring_commit(ByteRing *r, size_t n) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+}
+
+/* Reader side: contiguous readable span at the head; consume what was
+ * used. */
+static const char *ring_read_span(const ByteRing *r, size_t *n) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (!r->cap) {
+    *n = 0;
+    return r->data;
+  }
+  size_t off = head % r->cap;
+  size_t len = tail - head;
+  size_t to_end = r->cap - off;
+  *n = len < to_end ? len : to_end;
+  return r->data + off;
+}
+
+static void ring_consume(ByteRing *r, size_t n) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  atomic_store_explicit(&r->head, head + n, memory_order_release);
+}
+
+/* -- Slot Masks --------------------------------------------------- */
+
+/* Every pane owns a slot, its index in the pane pool. Panes are handed
+ * out in chunks of PANE_CHUNK, lowest free slot first; MAX_SLOTS
+ * matches the kernel's default PTY limit. Sets of slots are one word
+ * per chunk plus a summary word marking the non-empty ones, so walking
+ * a set costs its set bits, not the pool size. Words outside the
+ * summary are always zero. */
+#define PANE_CHUNK 64
+#define MAX_PANE_CHUNKS 64
+#define MAX_SLOTS (PANE_CHUNK * MAX_PANE_CHUNKS)
+#define SLOT_BIT(k) ((uint64_t)1 << ((k) % PANE_CHUNK))
+
+_Static_assert(MAX_PANE_CHUNKS <= 64, "chunk summary is one 64-bit word");
+
+typedef struct {
+  uint64_t any;
+  uint64_t word[MAX_PANE_CHUNKS];
+} SlotMask;
+
+static void mask_set(SlotMask *m, int k) {
+  m->word[k / PANE_CHUNK] |= SLOT_BIT(k);
+  m->any |= (uint64_t)1 << (k / PANE_CHUNK);
+}
+
+static void mask_clear(SlotMask *m, int k) {
+  int w = k / PANE_CHUNK;
+  m->word[w] &= ~SLOT_BIT(k);
+  if (!m->word[w])
+    m->any &= ~((uint64_t)1 << w);
+}
+
+static int mask_test(const SlotMask *m, int k) {
+  return (m->word[k / PANE_CHUNK] & SLOT_BIT(k)) != 0;
+}
+
+static void mask_merge(SlotMask *dst, const SlotMask *src) {
+  for (uint64_t a = src->any; a; a &= a - 1) {
+    int w = __builtin_ctzll(a);
+    dst->word[w] |= src->word[w];
+  }
+  dst->any |= src->any;
+}
+
+static void mask_reset(SlotMask *m) {
+  for (uint64_t a = m->any; a; a &= a - 1)
+    m->word[__builtin_ctzll(a)] = 0;
+  m->any = 0;
+}
+
+/* First slot >= from in the set, or -1. */
+static int mask_next(const SlotMask *m, int from) {
+  if (from >= MAX_SLOTS)
+    return -1;
+  int w = from / PANE_CHUNK;
+  uint64_t bits = m->word[w] & (~(uint64_t)0 << (from % PANE_CHUNK));
+  while (!bits) {
+    uint64_t rest = w + 1 < 64 ? m->any & (~(uint64_t)0 << (w + 1)) : 0;
+    if (!rest)
+      return -1;
+    w = __builtin_ctzll(rest);
+    bits = m->word[w];
+  }
+  return w * PANE_CHUNK + __builtin_ctzll(bits);
+}
+
 /* -- State Structures --------------------------------------------- */
 
 typedef struct {
   int font_size;
+  int glyph_cache_kb;
+  int blend_cache_kb;
+  int io_thread;
+  int input_evdev;
+  int startup_cache;
+  int atlas_cache;
+  int log_level;
+  int drm_buffers;
+  int bg_parse_budget;
+  int bg_ring_kb;
+  int pty_read_budget_kb;
+  int scrollback_kb;
+  int scrollback_total_kb;
   uint32_t default_bg;
   uint32_t default_fg;
   uint32_t cursor_bg;
@@ -177,61 +652,315 @@ typedef struct {
   uint32_t tabbar_bg;
   uint32_t tabbar_fg;
   uint32_t tabbar_active;
+  uint32_t offscreen_width, offscreen_height;
+  const char *capture_path;
 } AppConfig;
 
+#define DRM_MAX_BUFFERS 3
+#define DRM_MAX_STALE 16
+
+typedef struct {
+  int x, y, w, h;
+} PixelRect;
+
+/* One dumb buffer + FB. In page-flip mode each buffer also remembers
+ * which regions later frames changed, so it can be brought up to date
+ * from the newest buffer before it is rendered into again. */
+typedef struct {
+  uint32_t handle, fb_id;
+  uint8_t *map;
+  size_t map_size; /* the whole dumb buffer, which may exceed the mode */
+  PixelRect stale[DRM_MAX_STALE];
+  int stale_count;
+  int stale_full;
+} DrmBuffer;
+
 typedef struct {
   int fd;
-  uint32_t width, height, stride, size, handle, fb_id, crtc_id, conn_id;
+  int card; /* N of the /dev/dri/cardN in use */
+  uint32_t width, height, stride, size, crtc_id, conn_id;
+  uint32_t cap_width, cap_height; /* largest mode the buffers can hold */
+  size_t back_cap;                /* bytes allocated for a heap shadow */
   drmModeModeInfo mode;
   drmModeCrtc *orig_crtc;
-  uint8_t *framebuffer;
-  uint8_t *back_buffer;
+  uint8_t *framebuffer; /* scanout memory (shadow-copy mode)      */
+  uint8_t *back_buffer; /* render target: heap shadow or off-screen dumb */
+  DrmBuffer bufs[DRM_MAX_BUFFERS];
+  int num_bufs; /* 1 = shadow copy, 2-3 = page flip */
+  int front;    /* buffer on screen                                */
+  int back;     /* buffer being rendered                           */
+  int pending;  /* flip submitted, waiting for its event (-1: none) */
+  int queued;   /* rendered, waiting for the pending flip (-1: none) */
+  int last;     /* most recently completed frame                   */
+  int offscreen; /* heap-only target, no device (drm_init_offscreen) */
+  uint32_t id;   /* never reused; what its flip events carry       */
+  struct Capture *capture; /* damage stream of what it shows, or NULL */
 } DrmState;
 
+/* Cache key: codepoint in the low 24 bits, style in the high 8. */
+#define GLYPH_KEY(cp, style) ((uint32_t)(cp) | ((uint32_t)(style) << 24))
+
+typedef struct {
+  uint32_t key;
+  int16_t left, top, advance;
+  uint16_t width, rows;
+  int32_t hnext;      /* hash chain */
+  int32_t prev, next; /* LRU list, most recent at lru_head */
+} GlyphEntry;
+
+/* Fixed-slot coverage atlas. Every slot is slot_w x slot_h bytes
+ * (pitch slot_w) rounded up to a cache line; entry i owns slot i. */
+typedef struct {
+  GlyphEntry *entries;
+  int32_t *buckets;
+  uint8_t *atlas;
+  uint32_t slot_w, slot_h, slot_bytes;
+  uint32_t bucket_mask;
+  int32_t capacity, used;
+  int32_t pinned; /* leading slots mapped from the atlas file, never evicted */
+  int32_t lru_head, lru_tail;
+  uint32_t evictions;
+  uint64_t hits, misses;
+} GlyphCache;
+
+#define BLEND_CACHE_WAYS 4
+
+typedef struct {
+  uint32_t key, fg, bg;
+  uint32_t stamp; /* last use; 0 = empty way */
+} BlendTag;
+
+/* Glyphs pre-blended for one fg/bg pair; way i of the flattened sets
+ * owns pixels[i * slot_px], packed at pitch = glyph width. */
+typedef struct {
+  BlendTag *tags;
+  uint32_t *pixels;
+  uint32_t slot_px, set_mask, clock;
+  uint32_t def_fg, def_bg;
+  uint64_t hits, misses;
+} BlendCache;
+
+#define FONT_STYLES 4 /* every CELL_BOLD | CELL_ITALIC combination */
+#define FONT_MAX_FALLBACKS 8
+#define FONT_FACES (FONT_STYLES + FONT_MAX_FALLBACKS)
+#define FACE_MEMO_BITS 10
+#define FACE_NONE 0xFF
+
+typedef struct {
+  FT_Face face;  /* NULL: not opened (yet) */
+  uint8_t *map;  /* the font file, mapped for FT_New_Memory_Face */
+  size_t size;
+  int tried;     /* opened or failed to, and never retried */
+} FontFace;
+
 typedef struct {
   FT_Library lib;
-  FT_Face face;
+  const char *path; /* the font_fallbacks[] entry in use */
+  int pixel_size;
+  /* Indexed by style, then FONT_STYLES + i for font_fallbacks[i]. All
+   * but the regular face are opened on first use. */
+  FontFace faces[FONT_FACES];
+  /* Which fallback face has a codepoint the style faces lack, direct
+   * mapped by codepoint: memo_cp holds cp + 1 (0 = empty). */
+  uint32_t memo_cp[1 << FACE_MEMO_BITS];
+  uint8_t memo_face[1 << FACE_MEMO_BITS];
   int cell_w, cell_h, ascender;
+  GlyphCache cache;
+  BlendCache blend;
 } FontState;
 
+/* One output as the renderer sees it. */
 typedef struct {
   DrmState drm;
-  FontState font;
+  FontState *font; /* shared by every output */
 } HardwareState;
 
-#define MAX_TABS 8
-#define MAX_PANES 2
+#define MAX_DIRTY_RECTS 16
+
+/* Cell rectangles damaged since the last frame (libvterm coordinates). */
+typedef struct {
+  VTermRect rects[MAX_DIRTY_RECTS];
+  int count;
+} DirtyList;
+
+/* Scrolls reported through moverect, replayed on the pixels at render
+ * time instead of re-rasterizing the moved cells. */
+#define MAX_PENDING_MOVES 8
+
+typedef struct {
+  VTermRect dest, src;
+} PaneMove;
+
+/* Scrollback lines are packed back to back into fixed-size chunks: an
+ * SbLine header, runs of glyphs sharing resolved colors and attributes,
+ * then one UTF-8 code point per glyph. Trailing blank cells are not
+ * stored. A pane evicts whole chunks, oldest first. */
+#define SB_CHUNK_BYTES (64 * 1024)
+
+typedef struct SbChunk {
+  struct SbChunk *next;
+  uint32_t used, lines;
+  uint8_t data[];
+} SbChunk;
+
+typedef struct {
+  uint16_t cols, nruns, text_len, pad;
+} SbLine;
+
+typedef struct {
+  uint16_t glyphs;
+  uint8_t attrs, width;
+  uint32_t fg, bg;
+} SbRun;
+
+typedef struct {
+  SbChunk *head, *tail; /* oldest .. newest */
+  size_t bytes;         /* chunk memory held */
+  SbLine **lines;       /* ring of line pointers, oldest first */
+  size_t lines_cap, lines_head, count;
+  int view; /* rows scrolled back; 0 shows the live screen */
+} Scrollback;
+
+struct TabSession;
+struct PaneNode;
 
 typedef struct {
   int master_fd;
   pid_t child_pid;
+  int slot;   /* pane pool index; indexes I/O slots and slot masks */
+  int polled; /* master_fd registered with the main loop's epoll */
+  struct TabSession *tab;
+  struct PaneNode *node; /* leaf holding the pane in tab's layout */
   VTerm *vt;
   VTermScreen *vtscreen;
-  int term_cols;
-  int start_col;
+  int term_cols, term_rows;
+  int start_col, start_row; /* top-left corner, in pixels */
+  DirtyList dirty;
+  PaneMove moves[MAX_PENDING_MOVES];
+  int num_moves;
+  VTermPos cursor_drawn; /* cell holding the cursor image (row -1: none) */
+  uint32_t palette[256];  /* libvterm's indexed colors, resolved */
+  char osc_buf[512];      /* OSC 4/104 payload being assembled */
+  size_t osc_len;
+  Scrollback sb;
+  ByteRing input;  /* unparsed output: background backlog, or the I/O
+                    * thread's hand-off to the main thread */
+  ByteRing output; /* keystrokes queued for the I/O thread to write */
+  char *tx_pend;   /* keystrokes the output ring had no room for yet */
+  size_t tx_pend_len, tx_pend_cap;
+  char *rbuf;     /* adaptive read buffer, PTY_RBUF_MIN..PTY_RBUF_MAX */
+  size_t rbuf_cap;
+  int rbuf_idle; /* consecutive reads that used under a quarter of it */
+  uint64_t parsed, parse_ns; /* bytes fed to libvterm and time it took */
 } PaneSession;
 
-typedef struct {
-  PaneSession panes[MAX_PANES];
+/* A tab's layout is a binary tree: leaves hold panes, inner nodes
+ * split their box in half, side by side (SPLIT_V) or stacked
+ * (SPLIT_H), with a 1px border over the first half's last pixel column
+ * or row. Boxes are in cells, relative to the screen's top-left. */
+enum { SPLIT_V, SPLIT_H };
+
+typedef struct PaneNode {
+  struct PaneNode *parent;
+  struct PaneNode *child[2]; /* left/top, right/bottom; NULL in a leaf */
+  PaneSession *pane;         /* leaves only */
+  int split;
+  int col, row, cols, rows;
+} PaneNode;
+
+typedef struct TabSession {
+  PaneNode *root;
+  PaneSession *active_pane;
   int num_panes;
-  int active_pane;
-  int term_rows;
-  int active;
+  int output; /* index into g_app.outputs */
 } TabSession;
 
+/* Pane storage. A chunk is allocated on first use and only freed by
+ * full_cleanup(), so a PaneSession never moves while the I/O thread
+ * holds its rings. The I/O thread keeps its slot state apart, in
+ * IoThread.chunks. */
+typedef struct {
+  PaneSession *chunks[MAX_PANE_CHUNKS];
+  SlotMask used;
+} PanePool;
+
+#define CELL_BOLD 0x01
+#define CELL_ITALIC 0x02
+#define CELL_UNDERLINE 0x04
+#define CELL_STYLE(attrs) ((attrs) & (CELL_BOLD | CELL_ITALIC))
+
+/* One cell with colors resolved (reverse and cursor already applied).
+ * A rect is snapshotted once and both render passes read from it. */
+typedef struct {
+  uint32_t cp; /* 0 = nothing to draw */
+  uint32_t fg, bg;
+  uint8_t width; /* 0 = skip cell */
+  uint8_t attrs;
+} RowCell;
+
+#define DRM_MAX_OUTPUTS 4
+
+/* A display and the tabs it shows. Each keeps its own frame schedule
+ * and its own flips, so one output never waits on another. */
 typedef struct {
-  AppConfig cfg;
   HardwareState hw;
-  TabSession tabs[MAX_TABS];
-  int active_tab;
-  int num_tabs;
+  TabSession *tab; /* shown; NULL once the output's last tab closed */
+  int need_render; /* damaged this loop iteration */
+  int render_now;  /* skip the frame interval */
+  int render_pending;
+  int full_redraw;
+  uint64_t last_frame_ns;
+  uint64_t frames;
+} Output;
+
+/* Tabs belong to one output each, and keep their order in tabs[] there.
+ * Input and the tab commands go to the focused output. */
+typedef struct {
+  AppConfig cfg;
+  FontState font;
+  int drm_fd; /* the card every output is on */
+  Output outputs[DRM_MAX_OUTPUTS];
+  int num_outputs;
+  int focus;
+  TabSession **tabs;
+  int num_tabs, tabs_cap;
   int initialized;
 } AppCtx;
 
+/* Frame render times, in doubling buckets from under 250 us to 32 ms
+ * and over. */
+#define STATS_HIST_BUCKETS 9
+#define STATS_HIST_FIRST_US 250
+
+/* Hot-path counters for --stats; main thread only. Pane and cache
+ * counters live with the pane and the caches. */
+typedef struct {
+  uint64_t start_ns;
+  uint64_t wakeups, timeouts;    /* epoll_wait returns; with no event */
+  uint64_t frames, full_frames;  /* render_screen() calls */
+  uint64_t frames_coalesced;     /* updates merged into a pending frame */
+  uint64_t flip_waits;           /* due frames held for a free buffer */
+  uint64_t frame_ns;             /* total render_screen() time */
+  uint64_t frame_hist[STATS_HIST_BUCKETS];
+} Stats;
+
 static AppCtx g_app = {
     .cfg =
         {
             .font_size = 20,
+            .glyph_cache_kb = 4096,
+            .blend_cache_kb = 2048,
+            .drm_buffers = 1,
+            .bg_parse_budget = 16384,
+            .bg_ring_kb = 1024,
+            .io_thread = 1,
+            .input_evdev = 1,
+            .startup_cache = 1,
+            .atlas_cache = 1,
+            .log_level = LOG_LEVEL_INFO,
+            .pty_read_budget_kb = 256,
+            .scrollback_kb = 4096,
+            .scrollback_total_kb = 65536,
             .default_bg = 0x002E3440,
             .default_fg = 0x00D8DEE9,
             .cursor_bg = 0x00D8DEE9,
@@ -240,12 +969,32 @@ static AppCtx g_app = {
             .tabbar_fg = 0x00D8DEE9,
             .tabbar_active = 0x0088C0D0,
         },
-    .hw = {.drm = {.fd = -1}},
+    .drm_fd = -1,
 };
 
+/* A connected IPC client and the part of its input not yet a whole
+ * request. Clients stay registered in the main epoll set until they
+ * hang up. */
+typedef struct {
+  int used;
+  int fd;
+  size_t len;
+  char buf[4 + IPC_MSG_MAX];
+  char *out; /* reply bytes the socket had no room for yet */
+  size_t out_len;
+} IpcClient;
+
+static PanePool g_panes;
+static Stats g_stats;
 static int g_ipc_fd = -1;
+static IpcClient g_ipc_clients[IPC_MAX_CLIENTS];
+_Static_assert(IPC_MAX_CLIENTS <= 32, "ready clients are one 32-bit word");
+static RowCell *g_row_cells = NULL;
+static size_t g_row_cells_cap = 0;
+static size_t g_sb_bytes = 0; /* scrollback chunk memory, all panes */
 static int g_tty_fd = -1;
 static volatile sig_atomic_t g_vt_active = 1;
+static volatile sig_atomic_t g_vt_acquired = 0; /* main loop must resume */
 static struct vt_mode g_orig_vt_mode;
 static int g_vt_mode_saved = 0;
 
@@ -262,8 +1011,8 @@ static void signal_handler(int sig) {
 static void vt_release_handler(int sig) {
   (void)sig;
   g_vt_active = 0;
-  if (g_app.hw.drm.fd >= 0)
-    drmDropMaster(g_app.hw.drm.fd);
+  if (g_app.drm_fd >= 0)
+    drmDropMaster(g_app.drm_fd);
   if (g_tty_fd >= 0)
     ioctl(g_tty_fd, VT_RELDISP, 1);
 }
@@ -271,8 +1020,9 @@ static void vt_release_handler(int sig) {
 static void vt_acquire_handler(int sig) {
   (void)sig;
   g_vt_active = 1;
-  if (g_app.hw.drm.fd >= 0)
-    drmSetMaster(g_app.hw.drm.fd);
+  g_vt_acquired = 1;
+  if (g_app.drm_fd >= 0)
+    drmSetMaster(g_app.drm_fd);
   if (g_tty_fd >= 0)
     ioctl(g_tty_fd, VT_RELDISP, VT_ACKACQ);
 }
@@ -344,292 +1094,3409 @@ static void vt_cleanup(void) {
   }
 }
 
-/* -- Cleanup ------------------------------------------------------ */
-
-static void full_cleanup(void) {
-  LOG_INFO("Running full cleanup...\n");
-  disable_raw_mode();
-  vt_cleanup();
+/* -- Evdev Keyboard ----------------------------------------------- */
 
-  if (g_ipc_fd >= 0) {
-    close(g_ipc_fd);
-    g_ipc_fd = -1;
-  }
-  char sock_path[64];
-  get_socket_path(sock_path, sizeof(sock_path));
-  unlink(sock_path);
+/* With make EVDEV=1 and input_evdev set, keys are read straight from
+ * the keyboard's evdev node and translated with xkbcommon, skipping
+ * the TTY's line discipline. The device is grabbed so the console
+ * never sees the keys; that also hides Ctrl+Alt+Fn from the kernel,
+ * so VT switches are requested from here, and the grab is dropped
+ * whenever the VT is switched away. */
 
-  for (int i = 0; i < MAX_TABS; i++) {
-    TabSession *tab = &g_app.tabs[i];
-    if (!tab->active)
-      continue;
-    for (int p = 0; p < tab->num_panes; p++) {
-      PaneSession *pane = &tab->panes[p];
-      if (pane->master_fd >= 0) {
-        close(pane->master_fd);
-        pane->master_fd = -1;
-      }
-      if (pane->child_pid > 0) {
-        waitpid(pane->child_pid, NULL, WNOHANG);
-        pane->child_pid = -1;
-      }
-      if (pane->vt) {
-        vterm_free(pane->vt);
-        pane->vt = NULL;
-        pane->vtscreen = NULL;
-      }
-    }
-    tab->active = 0;
-  }
+#ifdef OPALTERM_EVDEV
 
-  HardwareState *hw = &g_app.hw;
-  if (hw->font.face) {
-    FT_Done_Face(hw->font.face);
-    hw->font.face = NULL;
-  }
-  if (hw->font.lib) {
-    FT_Done_FreeType(hw->font.lib);
-    hw->font.lib = NULL;
-  }
+/* evdev keycodes are offset by 8 from XKB keycodes. */
+#define EVDEV_TO_XKB(code) ((code) + 8)
 
-  DrmState *drm = &hw->drm;
-  if (drm->orig_crtc) {
-    drmModeSetCrtc(drm->fd, drm->orig_crtc->crtc_id, drm->orig_crtc->buffer_id,
-                   drm->orig_crtc->x, drm->orig_crtc->y, &drm->conn_id, 1,
-                   &drm->orig_crtc->mode);
-    drmModeFreeCrtc(drm->orig_crtc);
-    drm->orig_crtc = NULL;
-  }
-  free(drm->back_buffer);
-  drm->back_buffer = NULL;
-  if (drm->framebuffer && drm->framebuffer != MAP_FAILED) {
-    munmap(drm->framebuffer, drm->size);
-    drm->framebuffer = NULL;
-  }
-  if (drm->fb_id) {
-    drmModeRmFB(drm->fd, drm->fb_id);
-    drm->fb_id = 0;
-  }
-  if (drm->handle) {
-    struct drm_mode_destroy_dumb dreq = {0};
-    dreq.handle = drm->handle;
-    drmIoctl(drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
-    drm->handle = 0;
-  }
-  if (drm->fd >= 0) {
-    close(drm->fd);
-    drm->fd = -1;
+typedef struct {
+  int fd;
+  int grabbed;
+  struct libevdev *dev;
+  struct xkb_context *ctx;
+  struct xkb_keymap *keymap;
+  struct xkb_state *state;
+} EvdevInput;
+
+static EvdevInput g_evdev = {.fd = -1};
+static char g_ep_evdev; /* its epoll tag */
+
+/* The first device reporting KEY_A is taken as the keyboard. */
+static int evdev_find_keyboard(EvdevInput *in) {
+  DIR *dir = opendir("/dev/input");
+  if (!dir) {
+    LOG_WARN("opendir /dev/input failed: %s\n", strerror(errno));
+    return -1;
   }
-  LOG_INFO("Goodbye.\n");
-  log_close();
-}
 
-/* -- DRM Setup ---------------------------------------------------- */
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "event", 5) != 0)
+      continue;
 
-static int drm_init(DrmState *drm) {
-  memset(drm, 0, sizeof(*drm));
-  drm->fd = -1;
-  drmModeRes *res = NULL;
-  drmModeConnector *conn = NULL;
+    char path[512];
+    snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISCHR(st.st_mode))
+      continue;
 
-  for (int card = 0; card < 64; card++) {
-    char path[32];
-    snprintf(path, sizeof(path), "/dev/dri/card%d", card);
-    int fd = open(path, O_RDWR | O_CLOEXEC);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
     if (fd < 0)
       continue;
-    drmModeRes *r = drmModeGetResources(fd);
-    if (!r) {
+    struct libevdev *dev = NULL;
+    if (libevdev_new_from_fd(fd, &dev) < 0) {
       close(fd);
       continue;
     }
-    if (r->count_connectors > 0 && r->count_crtcs > 0) {
-      drm->fd = fd;
-      res = r;
-      LOG_INFO("Found KMS device: %s (%d conn, %d CRTCs)\n", path,
-               r->count_connectors, r->count_crtcs);
-      break;
+    if (libevdev_has_event_type(dev, EV_KEY) &&
+        libevdev_has_event_code(dev, EV_KEY, KEY_A)) {
+      LOG_INFO("Keyboard: %s (%s).\n", libevdev_get_name(dev), path);
+      closedir(dir);
+      in->fd = fd;
+      in->dev = dev;
+      return 0;
     }
-    drmModeFreeResources(r);
+    libevdev_free(dev);
     close(fd);
   }
-  if (drm->fd < 0) {
-    LOG_FATAL("No KMS device found.\n");
-    goto fail;
-  }
-
-  for (int i = 0; i < res->count_connectors; i++) {
-    drmModeConnector *c = drmModeGetConnector(drm->fd, res->connectors[i]);
-    if (c && c->connection == DRM_MODE_CONNECTED && c->count_modes > 0) {
-      conn = c;
-      break;
-    }
-    drmModeFreeConnector(c);
-  }
-  if (!conn) {
-    LOG_FATAL("No connected monitor.\n");
-    goto fail;
-  }
 
-  drm->mode = conn->modes[0];
-  drm->width = drm->mode.hdisplay;
-  drm->height = drm->mode.vdisplay;
-  drm->conn_id = conn->connector_id;
-  LOG_INFO("Resolution: %ux%u\n", drm->width, drm->height);
+  closedir(dir);
+  LOG_WARN("No keyboard found in /dev/input.\n");
+  return -1;
+}
 
-  if (conn->encoder_id) {
-    drmModeEncoder *enc = drmModeGetEncoder(drm->fd, conn->encoder_id);
-    if (enc) {
-      drm->crtc_id = enc->crtc_id;
-      drmModeFreeEncoder(enc);
-    }
+static void evdev_close(EvdevInput *in) {
+  if (in->dev) {
+    if (in->grabbed)
+      libevdev_grab(in->dev, LIBEVDEV_UNGRAB);
+    libevdev_free(in->dev);
+    in->dev = NULL;
   }
-  if (!drm->crtc_id && res->count_crtcs > 0)
-    drm->crtc_id = res->crtcs[0];
-  if (!drm->crtc_id) {
-    LOG_FATAL("No CRTC.\n");
-    goto fail;
+  in->grabbed = 0;
+  if (in->fd >= 0) {
+    close(in->fd);
+    in->fd = -1;
   }
+  if (in->state)
+    xkb_state_unref(in->state);
+  if (in->keymap)
+    xkb_keymap_unref(in->keymap);
+  if (in->ctx)
+    xkb_context_unref(in->ctx);
+  in->state = NULL;
+  in->keymap = NULL;
+  in->ctx = NULL;
+}
 
-  drm->orig_crtc = drmModeGetCrtc(drm->fd, drm->crtc_id);
+/* NULL rule names pick the system default layout, so XKB_DEFAULT_LAYOUT
+ * and friends are honoured. */
+static int evdev_init(EvdevInput *in) {
+  if (evdev_find_keyboard(in) < 0)
+    return -1;
 
-  {
-    struct drm_mode_create_dumb creq = {0};
-    creq.width = drm->width;
-    creq.height = drm->height;
-    creq.bpp = 32;
-    if (drmIoctl(drm->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
-      perror("CREATE_DUMB");
-      goto fail;
-    }
-    drm->stride = creq.pitch;
-    drm->size = creq.size;
-    drm->handle = creq.handle;
-  }
-  if (drmModeAddFB(drm->fd, drm->width, drm->height, 24, 32, drm->stride,
-                   drm->handle, &drm->fb_id) < 0) {
-    perror("AddFB");
-    goto fail;
+  in->ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+  if (in->ctx)
+    in->keymap =
+        xkb_keymap_new_from_names(in->ctx, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
+  if (in->keymap)
+    in->state = xkb_state_new(in->keymap);
+  if (!in->state) {
+    LOG_WARN("xkbcommon keymap setup failed.\n");
+    evdev_close(in);
+    return -1;
   }
-  {
-    struct drm_mode_map_dumb mreq = {0};
-    mreq.handle = drm->handle;
-    if (drmIoctl(drm->fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq) < 0) {
-      perror("MAP_DUMB");
-      goto fail;
-    }
-    drm->framebuffer = mmap(NULL, drm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                            drm->fd, mreq.offset);
-    if (drm->framebuffer == MAP_FAILED) {
-      perror("mmap");
-      drm->framebuffer = NULL;
-      goto fail;
-    }
+
+  int rc = libevdev_grab(in->dev, LIBEVDEV_GRAB);
+  if (rc < 0) {
+    LOG_WARN("Keyboard grab failed: %s\n", strerror(-rc));
+    evdev_close(in);
+    return -1;
   }
+  in->grabbed = 1;
+  return 0;
+}
 
-  drm->back_buffer = malloc(drm->size);
-  if (!drm->back_buffer) {
-    perror("back_buffer malloc");
-    goto fail;
+/* The grab follows VT ownership, so other VTs get the keyboard. */
+static void evdev_set_grab(EvdevInput *in, int grab) {
+  if (!in->dev || in->grabbed == grab)
+    return;
+  int rc = libevdev_grab(in->dev, grab ? LIBEVDEV_GRAB : LIBEVDEV_UNGRAB);
+  if (rc < 0) {
+    LOG_WARN("Keyboard %s failed: %s\n", grab ? "grab" : "ungrab",
+             strerror(-rc));
+    return;
   }
-  if (drmModeSetCrtc(drm->fd, drm->crtc_id, drm->fb_id, 0, 0, &drm->conn_id, 1,
-                     &drm->mode) < 0) {
-    perror("SetCrtc");
-    goto fail;
+  in->grabbed = grab;
+}
+
+/* Keys whose bytes come from a fixed table rather than the keymap.
+ * Returns NULL for keys xkbcommon should translate. */
+static const char *evdev_key_sequence(unsigned int code) {
+  switch (code) {
+  case KEY_UP:
+    return "\x1b[A";
+  case KEY_DOWN:
+    return "\x1b[B";
+  case KEY_RIGHT:
+    return "\x1b[C";
+  case KEY_LEFT:
+    return "\x1b[D";
+  case KEY_HOME:
+    return "\x1b[H";
+  case KEY_END:
+    return "\x1b[F";
+  case KEY_INSERT:
+    return "\x1b[2~";
+  case KEY_DELETE:
+    return "\x1b[3~";
+  case KEY_PAGEUP:
+    return "\x1b[5~";
+  case KEY_PAGEDOWN:
+    return "\x1b[6~";
+  case KEY_BACKSPACE:
+    return "\x7f";
+  case KEY_ENTER:
+  case KEY_KPENTER:
+    return "\r";
+  case KEY_ESC:
+    return "\x1b";
+  case KEY_TAB:
+    return "\t";
+  case KEY_F1:
+    return "\x1bOP";
+  case KEY_F2:
+    return "\x1bOQ";
+  case KEY_F3:
+    return "\x1bOR";
+  case KEY_F4:
+    return "\x1bOS";
+  case KEY_F5:
+    return "\x1b[15~";
+  case KEY_F6:
+    return "\x1b[17~";
+  case KEY_F7:
+    return "\x1b[18~";
+  case KEY_F8:
+    return "\x1b[19~";
+  case KEY_F9:
+    return "\x1b[20~";
+  case KEY_F10:
+    return "\x1b[21~";
+  case KEY_F11:
+    return "\x1b[23~";
+  case KEY_F12:
+    return "\x1b[24~";
+  default:
+    return NULL;
   }
+}
 
-  drmModeFreeConnector(conn);
-  drmModeFreeResources(res);
-  LOG_INFO("DRM initialized (stride=%u).\n", drm->stride);
+/* VT number for Ctrl+Alt+Fn, or 0. */
+static int evdev_vt_key(unsigned int code) {
+  if (code >= KEY_F1 && code <= KEY_F10)
+    return (int)(code - KEY_F1) + 1;
+  if (code == KEY_F11)
+    return 11;
+  if (code == KEY_F12)
+    return 12;
   return 0;
+}
 
-fail:
-  if (conn)
-    drmModeFreeConnector(conn);
-  if (res)
-    drmModeFreeResources(res);
+#endif /* OPALTERM_EVDEV */
+
+/* -- Font Faces --------------------------------------------------- */
+
+static const char *font_fallbacks[] = {
+    "/usr/share/fonts/TTF/JetBrainsMonoNerdFont-Regular.ttf",
+    "/usr/share/fonts/truetype/jetbrains-mono/JetBrainsMono-Regular.ttf",
+    "/usr/share/fonts/TTF/FiraCodeNerdFont-Regular.ttf",
+    "/usr/share/fonts/truetype/firacode/FiraCode-Regular.ttf",
+    "/usr/share/fonts/TTF/DejaVuSansMono.ttf",
+    "/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf",
+    "/usr/share/fonts/TTF/LiberationMono-Regular.ttf",
+    "/usr/share/fonts/truetype/liberation/LiberationMono-Regular.ttf",
+    NULL};
+
+#define FONT_FALLBACKS                                                         \
+  ((int)(sizeof(font_fallbacks) / sizeof(font_fallbacks[0])) - 1)
+_Static_assert(FONT_FALLBACKS <= FONT_MAX_FALLBACKS,
+               "raise FONT_MAX_FALLBACKS");
+
+/* File name parts of the styled siblings of a regular face, tried in
+ * order: "Foo-Regular.ttf" becomes "Foo-Bold.ttf", and a name without
+ * "Regular" gets a suffix, as in "DejaVuSansMono-Oblique.ttf". */
+static const char *const font_style_names[FONT_STYLES][2] = {
+    [CELL_BOLD] = {"Bold", NULL},
+    [CELL_ITALIC] = {"Italic", "Oblique"},
+    [CELL_BOLD | CELL_ITALIC] = {"BoldItalic", "BoldOblique"},
+};
+
+static int font_style_path(const char *regular, const char *name, char *out,
+                           size_t size) {
+  const char *tag = strstr(regular, "Regular");
+  const char *ext = strrchr(regular, '.');
+  int n;
+  if (tag)
+    n = snprintf(out, size, "%.*s%s%s", (int)(tag - regular), regular, name,
+                 tag + 7);
+  else if (ext)
+    n = snprintf(out, size, "%.*s-%s%s", (int)(ext - regular), regular, name,
+                 ext);
+  else
+    return -1;
+  return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+static void font_face_close(FontFace *f) {
+  if (f->face)
+    FT_Done_Face(f->face);
+  if (f->map)
+    munmap(f->map, f->size);
+  f->face = NULL;
+  f->map = NULL;
+}
+
+/* Mapped, not read: instances on one box share the page cache. */
+static int font_face_open(FontState *font, FontFace *f, const char *path) {
+  f->tried = 1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size <= 0) {
+    LOG_WARN("Font %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  f->size = (size_t)st.st_size;
+  f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (f->map == MAP_FAILED) {
+    f->map = NULL;
+    LOG_WARN("Font %s: mmap: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (FT_New_Memory_Face(font->lib, f->map, (FT_Long)f->size, 0, &f->face)) {
+    f->face = NULL;
+    LOG_WARN("FT_New_Memory_Face: %s\n", path);
+    font_face_close(f);
+    return -1;
+  }
+  FT_Set_Pixel_Sizes(f->face, 0, (FT_UInt)font->pixel_size);
+  return 0;
+}
+
+/* The face drawn for a style, or NULL when FreeType has to synthesize
+ * it from the regular one. */
+static FontFace *font_style_face(FontState *font, int style) {
+  FontFace *f = &font->faces[style];
+  if (!f->tried) {
+    f->tried = 1;
+    char path[512];
+    for (int v = 0; v < 2 && !f->face; v++) {
+      const char *name = font_style_names[style][v];
+      if (name && font_style_path(font->path, name, path, sizeof(path)) == 0 &&
+          access(path, F_OK) == 0)
+        font_face_open(font, f, path);
+    }
+    if (f->face)
+      LOG_INFO("Font style %d: %s\n", style, path);
+    else
+      LOG_INFO("Font style %d: synthesized.\n", style);
+  }
+  return f->face ? f : NULL;
+}
+
+static FontFace *font_fallback_face(FontState *font, int i) {
+  FontFace *f = &font->faces[FONT_STYLES + i];
+  if (!f->tried) {
+    f->tried = 1;
+    if (font_fallbacks[i] != font->path &&
+        access(font_fallbacks[i], F_OK) == 0 &&
+        font_face_open(font, f, font_fallbacks[i]) == 0)
+      LOG_INFO("Fallback font: %s\n", font_fallbacks[i]);
+  }
+  return f->face ? f : NULL;
+}
+
+/* Picks the face and glyph index to draw cp in a style: the styled
+ * face, else the regular one, else the first font_fallbacks[] face
+ * that has it (memoized), else the regular face's .notdef. *synth gets
+ * the style bits the chosen face lacks. */
+static FT_UInt font_resolve(FontState *font, uint32_t cp, int style,
+                            FontFace **out, int *synth) {
+  FontFace *regular = &font->faces[0];
+  FontFace *f = style ? font_style_face(font, style) : regular;
+  FT_UInt idx;
+  *synth = 0;
+  if (f && (idx = FT_Get_Char_Index(f->face, cp))) {
+    *out = f;
+    return idx;
+  }
+  *synth = style;
+  *out = regular;
+  if (f != regular && (idx = FT_Get_Char_Index(regular->face, cp)))
+    return idx;
+
+  uint32_t slot = (cp * 2654435761u) >> (32 - FACE_MEMO_BITS);
+  int id = font->memo_face[slot];
+  if (font->memo_cp[slot] != cp + 1) {
+    id = FACE_NONE;
+    for (int i = 0; i < FONT_FALLBACKS; i++) {
+      FontFace *fb = font_fallback_face(font, i);
+      if (fb && FT_Get_Char_Index(fb->face, cp)) {
+        id = FONT_STYLES + i;
+        break;
+      }
+    }
+    font->memo_cp[slot] = cp + 1;
+    font->memo_face[slot] = (uint8_t)id;
+  }
+  if (id == FACE_NONE)
+    return 0;
+  *out = &font->faces[id];
+  return FT_Get_Char_Index((*out)->face, cp);
+}
+
+/* -- Glyph Cache -------------------------------------------------- */
+
+#define GLYPH_CACHE_LINE 64
+#define GLYPH_CACHE_MIN_SLOTS 256
+
+static void glyph_cache_free(GlyphCache *gc) {
+  free(gc->entries);
+  free(gc->buckets);
+  if (gc->atlas)
+    munmap(gc->atlas, (size_t)gc->capacity * gc->slot_bytes);
+  memset(gc, 0, sizeof(*gc));
+}
+
+/* Slots hold up to two cells wide and 1.5 cells tall; larger bitmaps
+ * are cropped. The slot count is derived from cap_bytes. */
+static int glyph_cache_init(GlyphCache *gc, int cell_w, int cell_h,
+                            size_t cap_bytes) {
+  memset(gc, 0, sizeof(*gc));
+  gc->slot_w = (uint32_t)(2 * cell_w);
+  gc->slot_h = (uint32_t)(cell_h + cell_h / 2);
+  gc->slot_bytes = (gc->slot_w * gc->slot_h + GLYPH_CACHE_LINE - 1) &
+                   ~(uint32_t)(GLYPH_CACHE_LINE - 1);
+
+  size_t slots = cap_bytes / gc->slot_bytes;
+  if (slots < GLYPH_CACHE_MIN_SLOTS)
+    slots = GLYPH_CACHE_MIN_SLOTS;
+  gc->capacity = (int32_t)slots;
+
+  uint32_t nbuckets = 1;
+  while (nbuckets < slots * 2)
+    nbuckets <<= 1;
+  gc->bucket_mask = nbuckets - 1;
+
+  gc->entries = calloc(slots, sizeof(GlyphEntry));
+  gc->buckets = malloc(nbuckets * sizeof(int32_t));
+  /* Mapped rather than allocated, so glyph_cache_pin_file() can lay
+   * the atlas file over its first pages. */
+  gc->atlas = mmap(NULL, slots * gc->slot_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (gc->atlas == MAP_FAILED)
+    gc->atlas = NULL;
+  if (!gc->entries || !gc->buckets || !gc->atlas) {
+    LOG_FATAL("Glyph cache allocation failed (%zu slots).\n", slots);
+    glyph_cache_free(gc);
+    return -1;
+  }
+  memset(gc->buckets, 0xFF, nbuckets * sizeof(int32_t));
+  gc->lru_head = gc->lru_tail = -1;
+
+  LOG_INFO("Glyph cache: %d slots of %ux%u (%zu KB).\n", gc->capacity,
+           gc->slot_w, gc->slot_h, slots * gc->slot_bytes / 1024);
+  return 0;
+}
+
+/* Fibonacci hashing into [0, n): multiplies by 2^32 / phi and keeps
+ * the product's top bits, which depend on every key bit. Its low bits
+ * would only see the key's low bits, so keys differing in style alone
+ * would share a bucket. */
+static inline uint32_t fib_hash(uint32_t key, uint64_t n) {
+  return (uint32_t)(((uint64_t)(key * 2654435761u) * n) >> 32);
+}
+
+static inline uint32_t glyph_hash(const GlyphCache *gc, uint32_t key) {
+  return fib_hash(key, (uint64_t)gc->bucket_mask + 1);
+}
+
+static inline const uint8_t *glyph_bitmap(const GlyphCache *gc,
+                                          const GlyphEntry *e) {
+  return gc->atlas + (size_t)(e - gc->entries) * gc->slot_bytes;
+}
+
+static void lru_unlink(GlyphCache *gc, int32_t i) {
+  GlyphEntry *e = &gc->entries[i];
+  if (e->prev >= 0)
+    gc->entries[e->prev].next = e->next;
+  else
+    gc->lru_head = e->next;
+  if (e->next >= 0)
+    gc->entries[e->next].prev = e->prev;
+  else
+    gc->lru_tail = e->prev;
+}
+
+static void lru_push_front(GlyphCache *gc, int32_t i) {
+  GlyphEntry *e = &gc->entries[i];
+  e->prev = -1;
+  e->next = gc->lru_head;
+  if (gc->lru_head >= 0)
+    gc->entries[gc->lru_head].prev = i;
+  gc->lru_head = i;
+  if (gc->lru_tail < 0)
+    gc->lru_tail = i;
+}
+
+/* Reclaims the least recently used slot, unhooking it from its chain. */
+static int32_t glyph_cache_evict(GlyphCache *gc) {
+  int32_t i = gc->lru_tail;
+  gc->evictions++;
+  lru_unlink(gc, i);
+  int32_t *link = &gc->buckets[glyph_hash(gc, gc->entries[i].key)];
+  while (*link != i)
+    link = &gc->entries[*link].hnext;
+  *link = gc->entries[i].hnext;
+  return i;
+}
+
+/* Returns the cached glyph for a codepoint in a style (CELL_STYLE()
+ * bits), rasterizing it on a miss.
+ * Glyphs FreeType can't load are cached as empty bitmaps so they are
+ * not retried every frame. The returned entry stays valid until the
+ * next lookup that misses. */
+static const GlyphEntry *glyph_cache_get(FontState *font, uint32_t cp,
+                                         int style) {
+  GlyphCache *gc = &font->cache;
+  uint32_t key = GLYPH_KEY(cp, style);
+  uint32_t h = glyph_hash(gc, key);
+
+  for (int32_t i = gc->buckets[h]; i >= 0; i = gc->entries[i].hnext) {
+    if (gc->entries[i].key == key) {
+      if (i >= gc->pinned && gc->lru_head != i) {
+        lru_unlink(gc, i);
+        lru_push_front(gc, i);
+      }
+      gc->hits++;
+      return &gc->entries[i];
+    }
+  }
+  gc->misses++;
+
+  int32_t i = gc->used < gc->capacity ? gc->used++ : glyph_cache_evict(gc);
+  GlyphEntry *e = &gc->entries[i];
+  memset(e, 0, sizeof(*e));
+  e->key = key;
+
+  FontFace *face;
+  int synth;
+  FT_UInt idx = font_resolve(font, cp, style, &face, &synth);
+  FT_GlyphSlot g = face->face->glyph;
+  int loaded = FT_Load_Glyph(face->face, idx,
+                             synth ? FT_LOAD_NO_BITMAP : FT_LOAD_RENDER) == 0;
+  if (loaded && synth) {
+    if (synth & CELL_ITALIC)
+      FT_GlyphSlot_Oblique(g);
+    if (synth & CELL_BOLD)
+      FT_GlyphSlot_Embolden(g);
+    loaded = FT_Render_Glyph(g, FT_RENDER_MODE_NORMAL) == 0;
+  }
+  if (loaded) {
+    const FT_Bitmap *bmp = &g->bitmap;
+    uint32_t w = bmp->width < gc->slot_w ? bmp->width : gc->slot_w;
+    uint32_t rows = bmp->rows < gc->slot_h ? bmp->rows : gc->slot_h;
+    uint8_t *dst = gc->atlas + (size_t)i * gc->slot_bytes;
+    for (uint32_t r = 0; r < rows; r++)
+      memcpy(dst + r * gc->slot_w, bmp->buffer + r * (unsigned)bmp->pitch, w);
+    e->left = (int16_t)g->bitmap_left;
+    e->top = (int16_t)g->bitmap_top;
+    e->advance = (int16_t)(g->advance.x >> 6);
+    e->width = (uint16_t)w;
+    e->rows = (uint16_t)rows;
+  }
+
+  e->hnext = gc->buckets[h];
+  gc->buckets[h] = i;
+  lru_push_front(gc, i);
+  return e;
+}
+
+/* -- Blended Glyph Cache ------------------------------------------ */
+
+/* Second-level cache of glyphs already blended for one (glyph, fg, bg)
+ * triple, so a hit is a masked row copy instead of a per-pixel blend.
+ * 4-way set associative with a small fixed budget. Entries for the
+ * default fg/bg pair are only displaced by other default-pair glyphs,
+ * keeping plain text resident while colored cells churn through the
+ * remaining ways. */
+
+static void blend_cache_free(BlendCache *bc) {
+  free(bc->tags);
+  free(bc->pixels);
+  memset(bc, 0, sizeof(*bc));
+}
+
+static int blend_cache_init(BlendCache *bc, const GlyphCache *gc,
+                            const AppConfig *cfg) {
+  memset(bc, 0, sizeof(*bc));
+  bc->slot_px = gc->slot_w * gc->slot_h;
+  size_t slots = (size_t)cfg->blend_cache_kb * 1024 / (bc->slot_px * 4);
+  if (slots < BLEND_CACHE_WAYS)
+    return 0; /* disabled */
+  uint32_t sets = 1;
+  while ((size_t)sets * 2 * BLEND_CACHE_WAYS <= slots)
+    sets <<= 1;
+  bc->set_mask = sets - 1;
+  bc->tags = calloc((size_t)sets * BLEND_CACHE_WAYS, sizeof(BlendTag));
+  bc->pixels =
+      malloc((size_t)sets * BLEND_CACHE_WAYS * bc->slot_px * sizeof(uint32_t));
+  if (!bc->tags || !bc->pixels) {
+    LOG_WARN("Blended glyph cache allocation failed, disabled.\n");
+    blend_cache_free(bc);
+    return 0;
+  }
+  bc->def_fg = cfg->default_fg;
+  bc->def_bg = cfg->default_bg;
+  LOG_INFO("Blended glyph cache: %u x %d ways (%zu KB).\n", sets,
+           BLEND_CACHE_WAYS,
+           (size_t)sets * BLEND_CACHE_WAYS * bc->slot_px * 4 / 1024);
+  return 0;
+}
+
+/* Returns the pre-blended pixels of glyph g in fg on bg, blending them
+ * into a way on a miss; NULL when the set has no way to give up. */
+static const uint32_t *blend_cache_get(BlendCache *bc, const GlyphCache *gc,
+                                       const GlyphEntry *g, uint32_t fg,
+                                       uint32_t bg) {
+  if (!bc->tags)
+    return NULL;
+  uint32_t h = g->key ^ (fg * 0x85EBCA77u) ^ (bg * 0xC2B2AE3Du);
+  size_t base =
+      (size_t)fib_hash(h, (uint64_t)bc->set_mask + 1) * BLEND_CACHE_WAYS;
+  BlendTag *set = &bc->tags[base];
+  int is_def = fg == bc->def_fg && bg == bc->def_bg;
+  int victim = -1;
+  if (++bc->clock == 0) {
+    /* Clock wrapped: age everything equally rather than mis-order. */
+    size_t n = ((size_t)bc->set_mask + 1) * BLEND_CACHE_WAYS;
+    for (size_t i = 0; i < n; i++)
+      if (bc->tags[i].stamp)
+        bc->tags[i].stamp = 1;
+    bc->clock = 2;
+  }
+  for (int w = 0; w < BLEND_CACHE_WAYS; w++) {
+    BlendTag *t = &set[w];
+    if (t->stamp && t->key == g->key && t->fg == fg && t->bg == bg) {
+      t->stamp = bc->clock;
+      bc->hits++;
+      return bc->pixels + (base + (size_t)w) * bc->slot_px;
+    }
+    if (!t->stamp) {
+      if (victim < 0 || set[victim].stamp)
+        victim = w;
+      continue;
+    }
+    int t_def = t->fg == bc->def_fg && t->bg == bc->def_bg;
+    if (t_def && !is_def)
+      continue;
+    if (victim < 0 || (set[victim].stamp && t->stamp < set[victim].stamp))
+      victim = w;
+  }
+  bc->misses++;
+  if (victim < 0)
+    return NULL;
+
+  BlendTag *t = &set[victim];
+  uint32_t *px = bc->pixels + (base + (size_t)victim) * bc->slot_px;
+  blit_preblend(glyph_bitmap(gc, g), g->width, g->rows, (int)gc->slot_w, px,
+                fg, bg);
+  *t = (BlendTag){g->key, fg, bg, bc->clock};
+  return px;
+}
+
+/* -- Palette ------------------------------------------------------ */
+
+/* Indexed colors resolve through a per-pane table mirroring libvterm's
+ * palette, rebuilt only when OSC 4/104 changes it; RGB colors (which
+ * include the configured defaults) are packed directly. */
+
+static VTermColor g_palette_default[256]; /* captured from the first pane */
+static int g_palette_default_set = 0;
+
+static void pane_palette_build(PaneSession *pane) {
+  VTermState *state = vterm_obtain_state(pane->vt);
+  if (!g_palette_default_set) {
+    for (int i = 0; i < 256; i++)
+      vterm_state_get_palette_color(state, i, &g_palette_default[i]);
+    g_palette_default_set = 1;
+  }
+  for (int i = 0; i < 256; i++) {
+    VTermColor c;
+    vterm_state_get_palette_color(state, i, &c);
+    vterm_state_convert_color_to_rgb(state, &c);
+    pane->palette[i] = rgb_pack(c.rgb.red, c.rgb.green, c.rgb.blue);
+  }
+}
+
+static inline uint32_t pane_color(const PaneSession *pane,
+                                  const VTermColor *c) {
+  if (VTERM_COLOR_IS_RGB(c))
+    return rgb_pack(c->rgb.red, c->rgb.green, c->rgb.blue);
+  return pane->palette[c->indexed.idx];
+}
+
+/* Final colors of one cell: palette lookup, then reverse video, then the
+ * cursor override. */
+static inline void pane_cell_colors(const PaneSession *pane,
+                                    const AppConfig *cfg,
+                                    const VTermScreenCell *cell, int is_cursor,
+                                    uint32_t *fg, uint32_t *bg) {
+  if (is_cursor) {
+    *fg = cfg->cursor_fg;
+    *bg = cfg->cursor_bg;
+  } else if (cell->attrs.reverse) {
+    *fg = pane_color(pane, &cell->bg);
+    *bg = pane_color(pane, &cell->fg);
+  } else {
+    *fg = pane_color(pane, &cell->fg);
+    *bg = pane_color(pane, &cell->bg);
+  }
+}
+
+/* Parses an XParseColor-style "rgb:R/G/B" (1-4 hex digits per channel)
+ * or "#RRGGBB" spec as used by OSC 4. */
+static int parse_color_spec(const char *s, uint8_t rgb[3]) {
+  if (s[0] == '#') {
+    unsigned v;
+    if (strlen(s) != 7 || sscanf(s + 1, "%6x", &v) != 1)
+      return -1;
+    rgb[0] = (uint8_t)(v >> 16);
+    rgb[1] = (uint8_t)(v >> 8);
+    rgb[2] = (uint8_t)v;
+    return 0;
+  }
+  if (strncmp(s, "rgb:", 4) != 0)
+    return -1;
+  s += 4;
+  for (int i = 0; i < 3; i++) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 16);
+    int digits = (int)(end - s);
+    if (digits < 1 || digits > 4 || (i < 2 ? *end != '/' : *end != '\0'))
+      return -1;
+    rgb[i] = (uint8_t)(v * 255 / ((1ul << (digits * 4)) - 1));
+    s = end + 1;
+  }
+  return 0;
+}
+
+/* -- Scrollback --------------------------------------------------- */
+
+static size_t sb_line_size(const SbLine *line) {
+  size_t n = sizeof(SbLine) + line->nruns * sizeof(SbRun) + line->text_len;
+  return (n + 3) & ~(size_t)3;
+}
+
+static SbLine *sb_line_at(const Scrollback *sb, size_t i) {
+  return sb->lines[(sb->lines_head + i) % sb->lines_cap];
+}
+
+static void sb_free(Scrollback *sb) {
+  while (sb->head) {
+    SbChunk *next = sb->head->next;
+    free(sb->head);
+    sb->head = next;
+  }
+  g_sb_bytes -= sb->bytes;
+  free(sb->lines);
+  memset(sb, 0, sizeof(*sb));
+}
+
+/* Drops the oldest chunk and its lines. The chunk is handed back
+ * through *spare for reuse when there is room for one. */
+static void sb_drop_oldest(Scrollback *sb, SbChunk **spare) {
+  SbChunk *c = sb->head;
+  if (!c)
+    return;
+  sb->head = c->next;
+  if (!sb->head)
+    sb->tail = NULL;
+  sb->count -= c->lines;
+  sb->lines_head = sb->count ? (sb->lines_head + c->lines) % sb->lines_cap : 0;
+  if ((size_t)sb->view > sb->count)
+    sb->view = (int)sb->count;
+  sb->bytes -= SB_CHUNK_BYTES;
+  g_sb_bytes -= SB_CHUNK_BYTES;
+  if (!*spare)
+    *spare = c;
+  else
+    free(c);
+}
+
+static Scrollback *sb_largest(void) {
+  Scrollback *best = NULL;
+  for (int k = mask_next(&g_panes.used, 0); k >= 0;
+       k = mask_next(&g_panes.used, k + 1)) {
+    Scrollback *sb = &g_panes.chunks[k / PANE_CHUNK][k % PANE_CHUNK].sb;
+    if (sb->head && (!best || sb->bytes > best->bytes))
+      best = sb;
+  }
+  return best;
+}
+
+/* Appends an empty chunk, first evicting down to the per-pane cap and
+ * then, from whichever pane holds most, down to the global cap. */
+static SbChunk *sb_new_chunk(Scrollback *sb, const AppConfig *cfg) {
+  size_t pane_cap = (size_t)cfg->scrollback_kb * 1024;
+  size_t total_cap = (size_t)cfg->scrollback_total_kb * 1024;
+  SbChunk *c = NULL;
+  while (sb->head && sb->bytes + SB_CHUNK_BYTES > pane_cap)
+    sb_drop_oldest(sb, &c);
+  while (g_sb_bytes + SB_CHUNK_BYTES > total_cap) {
+    Scrollback *victim = sb_largest();
+    if (!victim)
+      break;
+    sb_drop_oldest(victim, &c);
+  }
+  if (g_sb_bytes + SB_CHUNK_BYTES > total_cap) {
+    free(c);
+    return NULL;
+  }
+  if (!c)
+    c = malloc(sizeof(SbChunk) + SB_CHUNK_BYTES);
+  if (!c)
+    return NULL;
+  c->next = NULL;
+  c->used = c->lines = 0;
+  if (sb->tail)
+    sb->tail->next = c;
+  else
+    sb->head = c;
+  sb->tail = c;
+  sb->bytes += SB_CHUNK_BYTES;
+  g_sb_bytes += SB_CHUNK_BYTES;
+  return c;
+}
+
+/* Makes room in the line index for one more line. Done before a chunk
+ * is added or written, so a failure leaves nothing to unwind. */
+static int sb_index_reserve(Scrollback *sb) {
+  if (sb->count == sb->lines_cap) {
+    size_t cap = sb->lines_cap ? sb->lines_cap * 2 : 256;
+    SbLine **grown = malloc(cap * sizeof(*grown));
+    if (!grown)
+      return -1;
+    for (size_t i = 0; i < sb->count; i++)
+      grown[i] = sb_line_at(sb, i);
+    free(sb->lines);
+    sb->lines = grown;
+    sb->lines_cap = cap;
+    sb->lines_head = 0;
+  }
+  return 0;
+}
+
+static int sb_cell_blank(const VTermScreenCell *cell) {
+  return (cell->chars[0] == 0 || cell->chars[0] == ' ') && cell->width == 1 &&
+         VTERM_COLOR_IS_DEFAULT_BG(&cell->bg) && !cell->attrs.reverse &&
+         !cell->attrs.underline;
+}
+
+static int pane_sb_pushline(int cols, const VTermScreenCell *cells,
+                            void *user) {
+  PaneSession *pane = user;
+  const AppConfig *cfg = &g_app.cfg;
+  Scrollback *sb = &pane->sb;
+  if (cfg->scrollback_kb <= 0 || cols > UINT16_MAX)
+    return 0;
+
+  int n = cols;
+  while (n > 0 && sb_cell_blank(&cells[n - 1]))
+    n--;
+  size_t worst = sizeof(SbLine) + (size_t)n * (sizeof(SbRun) + 4) + 3;
+  if (worst > SB_CHUNK_BYTES || sb_index_reserve(sb) < 0)
+    return 0;
+  SbChunk *c = sb->tail;
+  if (!c || c->used + worst > SB_CHUNK_BYTES)
+    c = sb_new_chunk(sb, cfg);
+  if (!c)
+    return 0;
+
+  /* Text is staged past the worst-case run array, then slid down. */
+  SbLine *line = (SbLine *)(c->data + c->used);
+  SbRun *runs = (SbRun *)(line + 1);
+  uint8_t *text = (uint8_t *)(runs + n), *t = text;
+  int nruns = 0;
+  for (int col = 0; col < n; col++) {
+    const VTermScreenCell *cell = &cells[col];
+    if (cell->chars[0] == (uint32_t)-1)
+      continue;
+    uint32_t fg, bg;
+    pane_cell_colors(pane, cfg, cell, 0, &fg, &bg);
+    uint8_t attrs = (uint8_t)((cell->attrs.bold ? CELL_BOLD : 0) |
+                              (cell->attrs.italic ? CELL_ITALIC : 0) |
+                              (cell->attrs.underline ? CELL_UNDERLINE : 0));
+    uint8_t width = cell->width > 1 ? 2 : 1;
+    SbRun *r = nruns ? &runs[nruns - 1] : NULL;
+    if (!r || r->fg != fg || r->bg != bg || r->attrs != attrs ||
+        r->width != width)
+      runs[nruns++] = (SbRun){0, attrs, width, fg, bg};
+    runs[nruns - 1].glyphs++;
+    uint32_t cp = cell->chars[0];
+    t += utf8_put(t, (cp == 0 || cp > 0x10FFFF) ? ' ' : cp);
+  }
+  line->cols = (uint16_t)cols;
+  line->nruns = (uint16_t)nruns;
+  line->text_len = (uint16_t)(t - text);
+  line->pad = 0;
+  memmove(runs + nruns, text, line->text_len);
+
+  sb->lines[(sb->lines_head + sb->count++) % sb->lines_cap] = line;
+  c->used += (uint32_t)sb_line_size(line);
+  c->lines++;
+  /* Keep a scrolled-back view on the same lines. */
+  if (sb->view > 0 && (size_t)sb->view < sb->count)
+    sb->view++;
+  return 1;
+}
+
+/* Hands the newest line back to libvterm when the screen grows. The
+ * newest line always lives in the tail chunk; if that ever does not
+ * hold, the line is kept rather than the counts corrupted. */
+static int pane_sb_popline(int cols, VTermScreenCell *cells, void *user) {
+  PaneSession *pane = user;
+  Scrollback *sb = &pane->sb;
+  SbChunk *c = sb->tail;
+  if (sb->count == 0 || !c || c->lines == 0)
+    return 0;
+  SbLine *line = sb_line_at(sb, sb->count - 1);
+
+  VTermColor def_fg, def_bg;
+  vterm_state_get_default_colors(vterm_obtain_state(pane->vt), &def_fg,
+                                 &def_bg);
+  for (int col = 0; col < cols; col++) {
+    memset(&cells[col], 0, sizeof(cells[col]));
+    cells[col].width = 1;
+    cells[col].fg = def_fg;
+    cells[col].bg = def_bg;
+  }
+  const SbRun *runs = (const SbRun *)(line + 1);
+  const uint8_t *t = (const uint8_t *)(runs + line->nruns);
+  int col = 0;
+  for (int i = 0; i < line->nruns; i++)
+    for (int g = 0; g < runs[i].glyphs && col < cols; g++) {
+      const SbRun *r = &runs[i];
+      VTermScreenCell *cell = &cells[col];
+      uint32_t cp = utf8_get(&t);
+      cell->chars[0] = cp == ' ' ? 0 : cp;
+      cell->width = r->width;
+      cell->attrs.bold = !!(r->attrs & CELL_BOLD);
+      cell->attrs.italic = !!(r->attrs & CELL_ITALIC);
+      cell->attrs.underline = !!(r->attrs & CELL_UNDERLINE);
+      vterm_color_rgb(&cell->fg, (r->fg >> 16) & 0xFF, (r->fg >> 8) & 0xFF,
+                      r->fg & 0xFF);
+      vterm_color_rgb(&cell->bg, (r->bg >> 16) & 0xFF, (r->bg >> 8) & 0xFF,
+                      r->bg & 0xFF);
+      if (r->width == 2 && col + 1 < cols) {
+        cells[col + 1].chars[0] = (uint32_t)-1;
+        cells[col + 1].bg = cell->bg;
+      }
+      col += r->width;
+    }
+
+  sb->count--;
+  c->used -= (uint32_t)sb_line_size(line);
+  if (--c->lines == 0) {
+    SbChunk **link = &sb->head;
+    while (*link != c)
+      link = &(*link)->next;
+    *link = NULL;
+    sb->tail = NULL;
+    for (SbChunk *k = sb->head; k; k = k->next)
+      sb->tail = k;
+    free(c);
+    sb->bytes -= SB_CHUNK_BYTES;
+    g_sb_bytes -= SB_CHUNK_BYTES;
+  }
+  if ((size_t)sb->view > sb->count)
+    sb->view = (int)sb->count;
+  return 1;
+}
+
+/* Unpacks columns [c0, c1) of a stored line straight into row cells;
+ * columns past the stored text are default-colored blanks. */
+static void sb_unpack_row(const SbLine *line, const AppConfig *cfg, int c0,
+                          int c1, RowCell *out) {
+  const SbRun *runs = (const SbRun *)(line + 1);
+  const uint8_t *t = (const uint8_t *)(runs + line->nruns);
+  int col = 0;
+  for (int i = 0; i < line->nruns && col < c1; i++) {
+    const SbRun *r = &runs[i];
+    for (int g = 0; g < r->glyphs && col < c1; g++) {
+      uint32_t cp = utf8_get(&t);
+      for (int k = 0; k < r->width; k++, col++) {
+        if (col < c0 || col >= c1)
+          continue;
+        RowCell *rc = &out[col - c0];
+        rc->width = k == 0 ? r->width : 0;
+        rc->cp = cp == ' ' ? 0 : cp;
+        rc->fg = r->fg;
+        rc->bg = r->bg;
+        rc->attrs = r->attrs;
+      }
+    }
+  }
+  for (; col < c1; col++)
+    if (col >= c0)
+      out[col - c0] =
+          (RowCell){.fg = cfg->default_fg, .bg = cfg->default_bg, .width = 1};
+}
+
+/* -- DRM Buffers -------------------------------------------------- */
+
+/* Dumb buffers are sized for cap_width x cap_height and framed for the
+ * current mode, at the same pitch, so a later mode that fits only
+ * needs new framebuffer objects (drm_apply_mode()). */
+static int drm_buffer_create(DrmState *drm, DrmBuffer *buf) {
+  memset(buf, 0, sizeof(*buf));
+  struct drm_mode_create_dumb creq = {0};
+  creq.width = drm->cap_width;
+  creq.height = drm->cap_height;
+  creq.bpp = 32;
+  if (drmIoctl(drm->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
+    perror("CREATE_DUMB");
+    return -1;
+  }
+  drm->stride = creq.pitch;
+  drm->size = drm->stride * drm->height;
+  buf->handle = creq.handle;
+  buf->map_size = creq.size;
+
+  if (drmModeAddFB(drm->fd, drm->width, drm->height, 24, 32, drm->stride,
+                   buf->handle, &buf->fb_id) < 0) {
+    perror("AddFB");
+    return -1;
+  }
+
+  struct drm_mode_map_dumb mreq = {0};
+  mreq.handle = buf->handle;
+  if (drmIoctl(drm->fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq) < 0) {
+    perror("MAP_DUMB");
+    return -1;
+  }
+  buf->map = mmap(NULL, buf->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  drm->fd, mreq.offset);
+  if (buf->map == MAP_FAILED) {
+    perror("mmap");
+    buf->map = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void drm_buffer_destroy(DrmState *drm, DrmBuffer *buf) {
+  if (buf->map) {
+    munmap(buf->map, buf->map_size);
+    buf->map = NULL;
+  }
+  if (buf->fb_id) {
+    drmModeRmFB(drm->fd, buf->fb_id);
+    buf->fb_id = 0;
+  }
+  if (buf->handle) {
+    struct drm_mode_destroy_dumb dreq = {0};
+    dreq.handle = buf->handle;
+    drmIoctl(drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+    buf->handle = 0;
+  }
+}
+
+/* Releases an output. Its CRTC gets back what it showed before we
+ * took it (restore > 0), is switched off, as after an unplug (0), or
+ * is left alone when another output drives it now (< 0). The card fd
+ * is shared and stays open. */
+static void drm_output_destroy(DrmState *drm, int restore) {
+  if (drm->orig_crtc && restore > 0 && drm->orig_crtc->mode_valid)
+    drmModeSetCrtc(drm->fd, drm->orig_crtc->crtc_id, drm->orig_crtc->buffer_id,
+                   drm->orig_crtc->x, drm->orig_crtc->y, &drm->conn_id, 1,
+                   &drm->orig_crtc->mode);
+  else if (drm->orig_crtc && restore == 0)
+    drmModeSetCrtc(drm->fd, drm->crtc_id, 0, 0, 0, NULL, 0, NULL);
+  if (drm->orig_crtc) {
+    drmModeFreeCrtc(drm->orig_crtc);
+    drm->orig_crtc = NULL;
+  }
+  if (drm->num_bufs == 1)
+    free(drm->back_buffer);
+  if (drm->offscreen)
+    free(drm->framebuffer);
+  drm->back_buffer = NULL;
+  drm->framebuffer = NULL;
+  for (int i = 0; i < drm->num_bufs; i++)
+    drm_buffer_destroy(drm, &drm->bufs[i]);
+  drm->num_bufs = 0;
+}
+
+/* -- PTY I/O Thread ----------------------------------------------- */
+
+/* With io_thread set, one thread owns every PTY fd: it reads output
+ * into each pane's input ring and writes the pane's output ring back,
+ * so a slow frame no longer leaves the child blocked on a full PTY and
+ * a stalled child no longer holds up the main thread in write_all().
+ * The main thread parses the rings and renders. Panes are published to
+ * the thread by storing their fd last; detaching waits until the
+ * thread has dropped every registration of the fd, so it can be closed
+ * and the rings freed. Both directions pass slot sets (kick: slot
+ * changed, ready: slot has news) so neither side scans idle panes.
+ * Slots are the panes' pool indices. The thread's per-slot state lives
+ * in its own chunks, which the main thread allocates on a chunk's first
+ * attach and io_thread_stop() frees after the join. */
+
+#define IO_TX_RING_BYTES (64 * 1024)
+#define IO_MAX_EVENTS 64
+
+/* epoll backend: every attached fd is registered once, for input while
+ * its ring has room and for output while keystrokes wait. */
+typedef struct {
+  int fd;          /* fd registered below, or -1 */
+  uint32_t events; /* current registration; 0: not registered */
+} IoEpSlot;
+
+#ifdef OPALTERM_IO_URING
+/* io_uring backend: PTYs only. Stdin and the IPC socket are consumed on
+ * the main thread, so they stay in its epoll set. */
+#define IOU_BUFS 64 /* power of two */
+
+typedef struct {
+  int fd;                  /* fd the requests below are posted on, or -1 */
+  int reading, writing;    /* multishot read / POLLOUT poll in flight */
+  int cancelling, closing; /* read cancel / cancel-all sent */
+  int hup;                 /* read side finished */
+  uint16_t pend[IOU_BUFS]; /* filled buffers not yet copied, oldest first */
+  int pend_head, pend_count;
+  uint32_t pend_off; /* bytes of the oldest already copied */
+} IouSlot;
+#endif
+
+typedef struct {
+  _Atomic int fd;      /* -1: not attached */
+  _Atomic int eof;     /* EOF, EIO or POLLERR seen */
+  _Atomic int stalled; /* input ring full, fd no longer read */
+  _Atomic int tx_wait; /* output ring was full for io_write() */
+  ByteRing *rx, *tx;
+  /* Backend bookkeeping, only touched by the I/O thread. */
+  IoEpSlot ep;
+#ifdef OPALTERM_IO_URING
+  IouSlot iou;
+#endif
+} IoSlot;
+
+/* A slot set both threads add to. Bits are published word first and
+ * summary second, and taken summary first, so none is lost; at worst a
+ * summary bit outlives its word and the next take finds it empty. */
+typedef struct {
+  _Atomic uint64_t any;
+  _Atomic uint64_t word[MAX_PANE_CHUNKS];
+} SlotSet;
+
+typedef struct {
+  pthread_t thread;
+  int running;
+  int epfd;
+  int wake_fd;   /* eventfd: main thread -> I/O thread */
+  int notify_fd; /* eventfd: I/O thread -> main thread */
+  SlotSet kick;  /* slots to re-examine: attach, detach, rings */
+  SlotSet ready; /* slots with new input or EOF for the main loop */
+  _Atomic int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t synced;
+  uint32_t sync_req, sync_seen;
+  int exited;         /* thread gone: nothing left to wait for */
+  size_t read_budget; /* bytes read per slot per epoll wakeup */
+  IoSlot *chunks[MAX_PANE_CHUNKS];
+} IoThread;
+
+static IoThread g_io = {
+    .epfd = -1,
+    .wake_fd = -1,
+    .notify_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .synced = PTHREAD_COND_INITIALIZER,
+};
+
+static void io_signal(int efd) {
+  uint64_t one = 1;
+  if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    LOG_WARN("eventfd write failed: %s\n", strerror(errno));
+}
+
+static void io_drain(int efd) {
+  uint64_t v;
+  while (read(efd, &v, sizeof(v)) > 0)
+    ;
+}
+
+static void slotset_add(SlotSet *s, int k) {
+  atomic_fetch_or(&s->word[k / PANE_CHUNK], SLOT_BIT(k));
+  atomic_fetch_or(&s->any, (uint64_t)1 << (k / PANE_CHUNK));
+}
+
+/* Moves every bit of the set into *m. */
+static void slotset_take(SlotSet *s, SlotMask *m) {
+  for (uint64_t a = atomic_exchange(&s->any, 0); a; a &= a - 1) {
+    int w = __builtin_ctzll(a);
+    uint64_t bits = atomic_exchange(&s->word[w], 0);
+    if (bits) {
+      m->word[w] |= bits;
+      m->any |= (uint64_t)1 << w;
+    }
+  }
+}
+
+static IoSlot *io_slot(const IoThread *io, int k) {
+  return &io->chunks[k / PANE_CHUNK][k % PANE_CHUNK];
+}
+
+static void io_kick(IoThread *io, int k) {
+  slotset_add(&io->kick, k);
+  io_signal(io->wake_fd);
+}
+
+static void io_post_ready(IoThread *io, const SlotMask *ready) {
+  if (!ready->any)
+    return;
+  for (uint64_t a = ready->any; a; a &= a - 1) {
+    int w = __builtin_ctzll(a);
+    atomic_fetch_or(&io->ready.word[w], ready->word[w]);
+  }
+  atomic_fetch_or(&io->ready.any, ready->any);
+  io_signal(io->notify_fd);
+}
+
+/* Moves PTY output into the slot's ring until EAGAIN, EOF, a full ring
+ * or the per-wakeup read budget, so one flooding pane cannot hold up
+ * the others; the fd stays readable for the next epoll_wait(). Reads
+ * land in the ring itself, so there is no read buffer to size as in
+ * pane_read_output(). Returns whether anything for the main thread
+ * happened. */
+static int io_slot_read(IoSlot *s, int fd, size_t budget) {
+  int got = 0;
+  size_t total = 0;
+  if (budget > s->rx->cap)
+    budget = s->rx->cap;
+  while (total < budget) {
+    size_t room;
+    char *dst = ring_write_span(s->rx, &room);
+    if (room == 0)
+      break;
+    if (room > budget - total)
+      room = budget - total;
+    ssize_t n = read(fd, dst, room);
+    if (n > 0) {
+      ring_commit(s->rx, (size_t)n);
+      total += (size_t)n;
+      got = 1;
+      continue;
+    }
+    if (n == 0 || errno == EIO) {
+      atomic_store(&s->eof, 1);
+      return 1;
+    }
+    if (errno == EINTR)
+      continue;
+    break;
+  }
+  return got;
+}
+
+static void io_slot_write(IoSlot *s, int fd) {
+  for (;;) {
+    size_t n;
+    const char *src = ring_read_span(s->tx, &n);
+    if (n == 0)
+      return;
+    ssize_t w = write(fd, src, n);
+    if (w > 0) {
+      ring_consume(s->tx, (size_t)w);
+      continue;
+    }
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0 && errno != EAGAIN)
+      ring_consume(s->tx, ring_len(s->tx)); /* child gone: drop input */
+    return;
+  }
+}
+
+/* Whether the output ring has room again for an io_write() that found
+ * it full. Paired with the fence there: either io_write() sees the
+ * room or this sees its flag. */
+static int io_slot_tx_resumed(IoSlot *s) {
+  if (ring_len(s->tx) == s->tx->cap)
+    return 0;
+  atomic_thread_fence(memory_order_seq_cst);
+  return atomic_load_explicit(&s->tx_wait, memory_order_relaxed) &&
+         atomic_exchange(&s->tx_wait, 0);
+}
+
+/* Detach handshake, thread side: sample the request count before
+ * looking at the slots, acknowledge it once none of them is in use. */
+static uint32_t io_sync_begin(IoThread *io) {
+  pthread_mutex_lock(&io->lock);
+  uint32_t req = io->sync_req;
+  pthread_mutex_unlock(&io->lock);
+  return req;
+}
+
+static void io_sync_ack(IoThread *io, uint32_t req) {
+  pthread_mutex_lock(&io->lock);
+  io->sync_seen = req;
+  pthread_cond_broadcast(&io->synced);
+  pthread_mutex_unlock(&io->lock);
+}
+
+/* Whether the slot's input ring has room; if not, flags it stalled.
+ * Paired with the fence in io_consumed(): either the main thread sees
+ * the flag or the re-check here sees its progress. */
+static int io_slot_room(IoSlot *s) {
+  if (ring_len(s->rx) < s->rx->cap)
+    return 1;
+  atomic_store(&s->stalled, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (ring_len(s->rx) < s->rx->cap) {
+    atomic_store(&s->stalled, 0);
+    return 1;
+  }
+  return 0;
+}
+
+static void io_ep_update(IoThread *io, int k, SlotMask *ready) {
+  IoSlot *s = io_slot(io, k);
+  IoEpSlot *es = &s->ep;
+  int fd = atomic_load_explicit(&s->fd, memory_order_acquire);
+  if (es->fd >= 0 && fd != es->fd) {
+    if (es->events)
+      epoll_ctl(io->epfd, EPOLL_CTL_DEL, es->fd, NULL);
+    *es = (IoEpSlot){.fd = -1};
+  }
+  if (fd < 0)
+    return;
+  es->fd = fd;
+
+  uint32_t want = 0;
+  if (!atomic_load(&s->eof)) {
+    if (ring_len(s->tx))
+      io_slot_write(s, fd);
+    if (io_slot_tx_resumed(s))
+      mask_set(ready, k);
+    if (io_slot_room(s))
+      want |= EPOLLIN;
+    if (ring_len(s->tx))
+      want |= EPOLLOUT;
+  }
+  if (want == es->events)
+    return;
+  /* Deregistered rather than masked: EPOLLHUP is reported regardless. */
+  struct epoll_event ev = {.events = want, .data.u32 = (uint32_t)k};
+  int op = !es->events ? EPOLL_CTL_ADD : want ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+  if (epoll_ctl(io->epfd, op, fd, &ev) == 0)
+    es->events = want;
+  else
+    LOG_WARN("I/O thread epoll_ctl(%d) failed: %s\n", fd, strerror(errno));
+}
+
+static void io_epoll_loop(IoThread *io) {
+  struct epoll_event evs[IO_MAX_EVENTS];
+  SlotMask kick = {0}, ready = {0};
+
+  while (!atomic_load(&io->stop)) {
+    uint32_t req = io_sync_begin(io);
+    slotset_take(&io->kick, &kick);
+    for (int k = mask_next(&kick, 0); k >= 0; k = mask_next(&kick, k + 1))
+      io_ep_update(io, k, &ready);
+    mask_reset(&kick);
+    io_sync_ack(io, req);
+    io_post_ready(io, &ready);
+    mask_reset(&ready);
+
+    int n = epoll_wait(io->epfd, evs, IO_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      LOG_WARN("I/O thread epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int j = 0; j < n; j++) {
+      int k = (int)evs[j].data.u32;
+      if (k == MAX_SLOTS) {
+        io_drain(io->wake_fd);
+        continue;
+      }
+      IoSlot *s = io_slot(io, k);
+      uint32_t re = evs[j].events;
+      if (re & EPOLLOUT)
+        io_slot_write(s, s->ep.fd);
+      if (re & (EPOLLIN | EPOLLHUP)) {
+        if (io_slot_read(s, s->ep.fd, io->read_budget))
+          mask_set(&ready, k);
+      } else if (re & EPOLLERR) {
+        atomic_store(&s->eof, 1);
+        mask_set(&ready, k);
+      }
+      io_ep_update(io, k, &ready);
+    }
+    io_post_ready(io, &ready);
+    mask_reset(&ready);
+  }
+}
+
+#ifdef OPALTERM_IO_URING
+
+/* io_uring backend (make IO_URING=1): every attached PTY keeps one
+ * multishot read posted that picks buffers from a shared provided
+ * buffer ring, so a wakeup with many busy panes costs one
+ * io_uring_enter() instead of a poll() plus a read() per pane. Filled
+ * buffers are copied into the pane's input ring; what does not fit
+ * stays queued on the slot, its read is cancelled so it cannot take
+ * every buffer, and it is re-armed once the main thread caught up.
+ * Writes go out directly and only wait on a POLLOUT poll when the PTY
+ * is full. No read budget is needed: each completion is one buffer,
+ * handled in arrival order whichever pane it belongs to. Falls back to
+ * the epoll loop when the kernel lacks multishot reads. */
+
+#define IOU_ENTRIES 128
+#define IOU_BUF_BYTES (16 * 1024)
+#define IOU_BGID 0
+
+enum { IOU_WAKE, IOU_READ, IOU_POLLOUT, IOU_CANCEL };
+
+typedef struct {
+  struct io_uring ring;
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  uint32_t buf_len[IOU_BUFS];
+  int free_bufs;
+  uint64_t wake_val;
+} IouState;
+
+static struct io_uring_sqe *iou_sqe(IouState *u) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+  if (!sqe) {
+    io_uring_submit(&u->ring);
+    sqe = io_uring_get_sqe(&u->ring);
+  }
+  return sqe;
+}
+
+static void iou_post(struct io_uring_sqe *sqe, int op, int k) {
+  io_uring_sqe_set_data64(sqe, (uint64_t)op << 32 | (uint32_t)k);
+}
+
+static void iou_recycle(IouState *u, uint16_t bid) {
+  io_uring_buf_ring_add(u->br, u->bufs + (size_t)bid * IOU_BUF_BYTES,
+                        IOU_BUF_BYTES, bid, io_uring_buf_ring_mask(IOU_BUFS),
+                        0);
+  io_uring_buf_ring_advance(u->br, 1);
+  u->free_bufs++;
+}
+
+static void iou_arm_wake(IouState *u, int wake_fd) {
+  struct io_uring_sqe *sqe = iou_sqe(u);
+  if (!sqe)
+    return;
+  io_uring_prep_read(sqe, wake_fd, &u->wake_val, sizeof(u->wake_val), 0);
+  iou_post(sqe, IOU_WAKE, 0);
+}
+
+/* Copies queued buffers into the pane's ring. Returns bytes copied. */
+static size_t iou_flush(IouState *u, IouSlot *us, IoSlot *s) {
+  size_t done = 0;
+  while (us->pend_count) {
+    uint16_t bid = us->pend[us->pend_head];
+    uint32_t left = u->buf_len[bid] - us->pend_off;
+    size_t room;
+    char *dst = ring_write_span(s->rx, &room);
+    if (room == 0)
+      break;
+    if (room > left)
+      room = left;
+    memcpy(dst, u->bufs + (size_t)bid * IOU_BUF_BYTES + us->pend_off, room);
+    ring_commit(s->rx, room);
+    done += room;
+    us->pend_off += (uint32_t)room;
+    if (us->pend_off == u->buf_len[bid]) {
+      iou_recycle(u, bid);
+      us->pend_head = (us->pend_head + 1) % IOU_BUFS;
+      us->pend_count--;
+      us->pend_off = 0;
+    }
+  }
+  return done;
+}
+
+static void iou_drop_pending(IouState *u, IouSlot *us) {
+  while (us->pend_count) {
+    iou_recycle(u, us->pend[us->pend_head]);
+    us->pend_head = (us->pend_head + 1) % IOU_BUFS;
+    us->pend_count--;
+  }
+  us->pend_off = 0;
+}
+
+/* Brings slot k's posted requests in line with its attachment and ring
+ * state. Returns 1 while a detached fd still has requests in flight,
+ * which holds back the detach acknowledgement, and 2 when the read
+ * could not be re-armed for lack of free buffers. */
+static int iou_update_slot(IoThread *io, IouState *u, int k, SlotMask *ready) {
+  IoSlot *s = io_slot(io, k);
+  IouSlot *us = &s->iou;
+  int fd = atomic_load_explicit(&s->fd, memory_order_acquire);
+  struct io_uring_sqe *sqe;
+
+  if (us->fd >= 0 && fd != us->fd) {
+    iou_drop_pending(u, us);
+    if (us->reading || us->writing) {
+      if (!us->closing && (sqe = iou_sqe(u))) {
+        io_uring_prep_cancel_fd(sqe, us->fd, IORING_ASYNC_CANCEL_ALL);
+        iou_post(sqe, IOU_CANCEL, k);
+        us->closing = 1;
+      }
+      return 1;
+    }
+    *us = (IouSlot){.fd = -1};
+  }
+  if (fd < 0)
+    return 0;
+  if (us->fd != fd)
+    *us = (IouSlot){.fd = fd};
+
+  if (us->pend_count) {
+    if (iou_flush(u, us, s))
+      mask_set(ready, k);
+    if (us->pend_count && !io_slot_room(s) && us->reading &&
+        !us->cancelling && (sqe = iou_sqe(u))) {
+      io_uring_prep_cancel64(sqe, (uint64_t)IOU_READ << 32 | (uint32_t)k, 0);
+      iou_post(sqe, IOU_CANCEL, k);
+      us->cancelling = 1;
+    }
+  }
+  if (us->hup && !us->pend_count && !atomic_load(&s->eof)) {
+    atomic_store(&s->eof, 1);
+    mask_set(ready, k);
+  }
+  if (!us->writing && ring_len(s->tx)) {
+    io_slot_write(s, fd);
+    if (ring_len(s->tx) && (sqe = iou_sqe(u))) {
+      io_uring_prep_poll_add(sqe, fd, POLLOUT);
+      iou_post(sqe, IOU_POLLOUT, k);
+      us->writing = 1;
+    }
+  }
+  if (io_slot_tx_resumed(s))
+    mask_set(ready, k);
+  if (!us->reading && !us->hup && !us->pend_count && io_slot_room(s)) {
+    if (!u->free_bufs)
+      return 2;
+    if ((sqe = iou_sqe(u))) {
+      io_uring_prep_read_multishot(sqe, fd, 0, 0, IOU_BGID);
+      iou_post(sqe, IOU_READ, k);
+      us->reading = 1;
+      us->cancelling = 0;
+    }
+  }
+  return 0;
+}
+
+/* Returns the slot the completion belongs to, or -1. */
+static int iou_complete(IoThread *io, IouState *u, struct io_uring_cqe *cqe) {
+  uint64_t data = io_uring_cqe_get_data64(cqe);
+  int op = (int)(data >> 32), k = (int)(uint32_t)data;
+  if (op == IOU_WAKE) {
+    /* Whatever ended the read, kicks must keep being noticed. */
+    if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN &&
+        cqe->res != -ECANCELED)
+      LOG_WARN("I/O thread wake read failed: %s\n", strerror(-cqe->res));
+    if (!atomic_load(&io->stop))
+      iou_arm_wake(u, io->wake_fd);
+    return -1;
+  }
+  IoSlot *s = io_slot(io, k);
+  IouSlot *us = &s->iou;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+
+  switch (op) {
+  case IOU_READ:
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      u->free_bufs--;
+      if (cqe->res > 0 && us->fd == atomic_load(&s->fd)) {
+        u->buf_len[bid] = (uint32_t)cqe->res;
+        us->pend[(us->pend_head + us->pend_count) % IOU_BUFS] = bid;
+        us->pend_count++;
+      } else {
+        iou_recycle(u, bid);
+      }
+    }
+    if (cqe->res == 0 ||
+        (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
+      us->hup = 1;
+    if (!more)
+      us->reading = 0;
+    break;
+  case IOU_POLLOUT:
+    us->writing = 0;
+    if (cqe->res > 0 && us->fd >= 0)
+      io_slot_write(s, us->fd);
+    break;
+  default:
+    break;
+  }
+  return k;
+}
+
+/* Returns -1 if io_uring is unusable, before anything was posted. */
+static int io_uring_loop(IoThread *io) {
+  IouState *u = calloc(1, sizeof(*u));
+  if (!u)
+    return -1;
+  int ret = io_uring_queue_init(IOU_ENTRIES, &u->ring, 0);
+  if (ret < 0) {
+    LOG_WARN("io_uring unavailable (%s), using epoll.\n", strerror(-ret));
+    free(u);
+    return -1;
+  }
+  struct io_uring_probe *probe = io_uring_get_probe_ring(&u->ring);
+  int ok = probe && io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT);
+  if (probe)
+    io_uring_free_probe(probe);
+  u->bufs = ok ? malloc((size_t)IOU_BUFS * IOU_BUF_BYTES) : NULL;
+  u->br = u->bufs ? io_uring_setup_buf_ring(&u->ring, IOU_BUFS, IOU_BGID, 0,
+                                             &ret)
+                  : NULL;
+  if (!u->br) {
+    LOG_WARN("io_uring lacks multishot reads, using epoll.\n");
+    free(u->bufs);
+    io_uring_queue_exit(&u->ring);
+    free(u);
+    return -1;
+  }
+  for (int b = 0; b < IOU_BUFS; b++)
+    iou_recycle(u, (uint16_t)b);
+  iou_arm_wake(u, io->wake_fd);
+  LOG_INFO("I/O thread using io_uring.\n");
+
+  /* The pass works through dirty and leaves the slots it must revisit
+   * in busy; the two are swapped afterwards. */
+  SlotMask masks[2] = {{0}}, starved = {0}, ready = {0};
+  SlotMask *dirty = &masks[0], *busy = &masks[1];
+  while (!atomic_load(&io->stop)) {
+    uint32_t req = io_sync_begin(io);
+    slotset_take(&io->kick, dirty);
+    if (u->free_bufs) {
+      mask_merge(dirty, &starved);
+      mask_reset(&starved);
+    }
+    for (int k = mask_next(dirty, 0); k >= 0; k = mask_next(dirty, k + 1)) {
+      int r = iou_update_slot(io, u, k, &ready);
+      if (r == 1)
+        mask_set(busy, k);
+      else if (r == 2)
+        mask_set(&starved, k);
+    }
+    mask_reset(dirty);
+    SlotMask *t = dirty;
+    dirty = busy;
+    busy = t;
+    if (!dirty->any)
+      io_sync_ack(io, req);
+    io_post_ready(io, &ready);
+    mask_reset(&ready);
+
+    /* Buffers freed by this pass can re-arm starved slots right away. */
+    ret = starved.any && u->free_bufs ? io_uring_submit(&u->ring)
+                                      : io_uring_submit_and_wait(&u->ring, 1);
+    if (ret < 0 && ret != -EINTR) {
+      LOG_WARN("io_uring_submit_and_wait failed: %s\n", strerror(-ret));
+      break;
+    }
+    struct io_uring_cqe *cqe;
+    unsigned head, seen = 0;
+    io_uring_for_each_cqe(&u->ring, head, cqe) {
+      int k = iou_complete(io, u, cqe);
+      if (k >= 0)
+        mask_set(dirty, k);
+      seen++;
+    }
+    io_uring_cq_advance(&u->ring, seen);
+  }
+
+  io_uring_free_buf_ring(&u->ring, u->br, IOU_BUFS, IOU_BGID);
+  io_uring_queue_exit(&u->ring);
+  free(u->bufs);
+  free(u);
+  return 0;
+}
+
+#endif /* OPALTERM_IO_URING */
+
+static void *io_thread_main(void *arg) {
+  IoThread *io = arg;
+#ifdef OPALTERM_IO_URING
+  if (io_uring_loop(io) < 0)
+#endif
+    io_epoll_loop(io);
+
+  pthread_mutex_lock(&io->lock);
+  io->exited = 1;
+  pthread_cond_broadcast(&io->synced);
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+
+static int io_thread_start(IoThread *io, const AppConfig *cfg) {
+  io->read_budget = cfg->pty_read_budget_kb > 0
+                        ? (size_t)cfg->pty_read_budget_kb * 1024
+                        : SIZE_MAX;
+  io->epfd = epoll_create1(EPOLL_CLOEXEC);
+  io->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  io->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = MAX_SLOTS};
+  if (io->epfd < 0 || io->wake_fd < 0 || io->notify_fd < 0 ||
+      epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->wake_fd, &ev) < 0) {
+    LOG_WARN("I/O thread setup failed: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int rc = pthread_create(&io->thread, NULL, io_thread_main, io);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0) {
+    LOG_WARN("I/O thread failed to start.\n");
+    goto fail;
+  }
+  io->running = 1;
+  LOG_INFO("PTY I/O thread started.\n");
+  return 0;
+
+fail:
+  if (io->epfd >= 0)
+    close(io->epfd);
+  if (io->wake_fd >= 0)
+    close(io->wake_fd);
+  if (io->notify_fd >= 0)
+    close(io->notify_fd);
+  io->epfd = io->wake_fd = io->notify_fd = -1;
+  return -1;
+}
+
+static void io_thread_stop(IoThread *io) {
+  if (!io->running)
+    return;
+  atomic_store(&io->stop, 1);
+  io_signal(io->wake_fd);
+  pthread_join(io->thread, NULL);
+  io->running = 0;
+  close(io->epfd);
+  close(io->wake_fd);
+  close(io->notify_fd);
+  io->epfd = io->wake_fd = io->notify_fd = -1;
+  for (int c = 0; c < MAX_PANE_CHUNKS; c++) {
+    free(io->chunks[c]);
+    io->chunks[c] = NULL;
+  }
+}
+
+/* Slot state for a chunk on its first attach; nothing is registered. */
+static IoSlot *io_chunk_new(void) {
+  IoSlot *chunk = calloc(PANE_CHUNK, sizeof(*chunk));
+  if (!chunk)
+    return NULL;
+  for (int i = 0; i < PANE_CHUNK; i++) {
+    atomic_init(&chunk[i].fd, -1);
+    chunk[i].ep.fd = -1;
+#ifdef OPALTERM_IO_URING
+    chunk[i].iou.fd = -1;
+#endif
+  }
+  return chunk;
+}
+
+/* Hands a pane's PTY to the I/O thread. Its input ring also serves as
+ * the background backlog, so it is sized by bg_ring_kb. */
+static int io_attach(IoThread *io, int slot, PaneSession *pane,
+                     const AppConfig *cfg) {
+  IoSlot **chunk = &io->chunks[slot / PANE_CHUNK];
+  if (!*chunk && !(*chunk = io_chunk_new()))
+    return -1;
+  IoSlot *s = io_slot(io, slot);
+  size_t rx_cap = cfg->bg_ring_kb > 0 ? (size_t)cfg->bg_ring_kb * 1024
+                                      : PTY_RBUF_MAX;
+  if (!pane->input.cap && ring_alloc(&pane->input, rx_cap) < 0)
+    return -1;
+  if (!pane->output.cap && ring_alloc(&pane->output, IO_TX_RING_BYTES) < 0)
+    return -1;
+  s->rx = &pane->input;
+  s->tx = &pane->output;
+  atomic_store(&s->eof, 0);
+  atomic_store(&s->stalled, 0);
+  atomic_store(&s->tx_wait, 0);
+  atomic_store_explicit(&s->fd, pane->master_fd, memory_order_release);
+  io_kick(io, slot);
+  return 0;
+}
+
+static int io_attached(const IoThread *io, int slot) {
+  return io->running && io->chunks[slot / PANE_CHUNK] &&
+         atomic_load(&io_slot(io, slot)->fd) >= 0;
+}
+
+/* Returns once the I/O thread no longer uses the slot's fd or rings. */
+static void io_detach(IoThread *io, int slot) {
+  if (!io_attached(io, slot))
+    return;
+  atomic_store(&io_slot(io, slot)->fd, -1);
+  slotset_add(&io->kick, slot);
+  pthread_mutex_lock(&io->lock);
+  uint32_t want = ++io->sync_req;
+  io_signal(io->wake_fd);
+  while (!io->exited && (int32_t)(io->sync_seen - want) < 0)
+    pthread_cond_wait(&io->synced, &io->lock);
+  pthread_mutex_unlock(&io->lock);
+}
+
+/* After the main thread consumed input: resumes a slot the I/O thread
+ * stopped reading because its ring was full. */
+static void io_consumed(IoThread *io, int slot) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_exchange(&io_slot(io, slot)->stalled, 0))
+    io_kick(io, slot);
+}
+
+/* Queues keystrokes for the I/O thread and returns how many it took;
+ * after EOF they are all taken and dropped. Whatever did not fit is
+ * the caller's to keep: the slot is posted ready once the ring has
+ * drained. */
+static size_t io_write(IoThread *io, int slot, const char *buf, size_t len) {
+  IoSlot *s = io_slot(io, slot);
+  size_t done = 0;
+  while (done < len) {
+    if (atomic_load(&s->eof))
+      return len;
+    size_t room;
+    char *dst = ring_write_span(s->tx, &room);
+    if (room == 0) {
+      atomic_store(&s->tx_wait, 1);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (ring_len(s->tx) < s->tx->cap)
+        continue;
+      break;
+    }
+    if (room > len - done)
+      room = len - done;
+    memcpy(dst, buf + done, room);
+    ring_commit(s->tx, room);
+    done += room;
+  }
+  io_kick(io, slot);
+  return done;
+}
+
+/* -- Event Registration ------------------------------------------- */
+
+/* The main loop's epoll set. Sources are registered once; pane events
+ * carry their PaneSession, the others one of the tags below. */
+static int g_epfd = -1;
+static int g_uevent_fd = -1;
+static char g_ep_stdin, g_ep_ipc, g_ep_drm, g_ep_io, g_ep_uevent;
+
+static void ep_watch(int fd, void *tag, int on) {
+  if (g_epfd < 0 || fd < 0)
+    return;
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = tag};
+  if (epoll_ctl(g_epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev) < 0)
+    LOG_WARN("epoll_ctl(%d) failed: %s\n", fd, strerror(errno));
+}
+
+/* Switches a registered fd to waiting for other events. */
+static void ep_rewatch(int fd, void *tag, uint32_t events) {
+  struct epoll_event ev = {.events = events, .data.ptr = tag};
+  if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+    LOG_WARN("epoll_ctl(%d) failed: %s\n", fd, strerror(errno));
+}
+
+/* For PTYs the main loop reads itself; a full background ring takes
+ * the fd out of the set rather than masking it, since EPOLLHUP would
+ * still be reported. */
+static void pane_set_polled(PaneSession *pane, int on) {
+  if (pane->polled == on || pane->master_fd < 0)
+    return;
+  ep_watch(pane->master_fd, pane, on);
+  pane->polled = on;
+}
+
+/* -- Pixel Rects -------------------------------------------------- */
+
+/* Clips a rect to the surface; 0 when nothing of it is left. */
+static int pixel_rect_clip(const DrmState *drm, PixelRect *r) {
+  if (r->x < 0) {
+    r->w += r->x;
+    r->x = 0;
+  }
+  if (r->y < 0) {
+    r->h += r->y;
+    r->y = 0;
+  }
+  if (r->x + r->w > (int)drm->width)
+    r->w = (int)drm->width - r->x;
+  if (r->y + r->h > (int)drm->height)
+    r->h = (int)drm->height - r->y;
+  return r->w > 0 && r->h > 0;
+}
+
+/* Adds a rect to a set of at most max, merged with every rect it
+ * touches. A set that would overflow turns into "everything". */
+static void rect_set_add(PixelRect *set, int *count, int *full, int max,
+                         PixelRect r) {
+  if (*full)
+    return;
+  for (int i = 0; i < *count; i++) {
+    PixelRect *s = &set[i];
+    if (r.x <= s->x + s->w && s->x <= r.x + r.w && r.y <= s->y + s->h &&
+        s->y <= r.y + r.h) {
+      int x0 = r.x < s->x ? r.x : s->x, y0 = r.y < s->y ? r.y : s->y;
+      int x1 = r.x + r.w > s->x + s->w ? r.x + r.w : s->x + s->w;
+      int y1 = r.y + r.h > s->y + s->h ? r.y + r.h : s->y + s->h;
+      r = (PixelRect){x0, y0, x1 - x0, y1 - y0};
+      set[i] = set[--*count];
+      i = -1;
+    }
+  }
+  if (*count == max) {
+    *full = 1;
+    *count = 0;
+    return;
+  }
+  set[(*count)++] = r;
+}
+
+/* -- Frame Capture ------------------------------------------------ */
+
+/* Streams what the first output draws to capture_path, damaged regions
+ * only, for pixel-exact tests and remote viewing. The path may be a
+ * file, a FIFO or a listening Unix socket. A reader slower than the
+ * frames never stalls rendering: while one frame is still going out,
+ * later damage piles up and is sent merged, as the frame after it. */
+#define CAPTURE_MAX_RECTS 32
+
+/* Stream records, native-endian. CAPTURE_SIZE starts the stream and
+ * every size change (w, h), and the frame after it is a full one.
+ * CAPTURE_TILE is followed by w * h XRGB8888 pixels, row by row.
+ * CAPTURE_FRAME ends a frame: seq counts frames from 0, ns is the
+ * CLOCK_MONOTONIC time it was drawn. */
+enum { CAPTURE_SIZE = 1, CAPTURE_TILE = 2, CAPTURE_FRAME = 3 };
+
+typedef struct {
+  uint64_t ns;
+  uint32_t type, seq;
+  uint16_t x, y, w, h;
+} CaptureRecord;
+
+_Static_assert(sizeof(CaptureRecord) == 24, "capture record padding");
+
+typedef struct Capture {
+  int fd;        /* -1 once the reader is gone */
+  int is_socket; /* written with send(), so no SIGPIPE */
+  int polled;    /* in the epoll set, unlike a regular file */
+  int watching;  /* polled for room to write */
+  PixelRect rects[CAPTURE_MAX_RECTS]; /* damage not sent yet */
+  int count, full;
+  uint32_t width, height; /* size last announced, 0 before the first */
+  uint32_t seq;
+  uint8_t *out; /* encoded frame; out_off .. out_len still to go */
+  size_t out_len, out_off, out_cap;
+  uint64_t frames, bytes, deferred;
+} Capture;
+
+static Capture *g_capture;
+static char g_ep_capture;
+
+static Capture *capture_open(const char *path) {
+  struct stat st;
+  int known = stat(path, &st) == 0, fd;
+  int sock = known && S_ISSOCK(st.st_mode);
+  int fifo = known && S_ISFIFO(st.st_mode);
+  if (sock) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    /* Holding the read end too lets a FIFO open before its reader
+     * and outlive it without SIGPIPE. */
+    int flags = fifo ? O_RDWR : O_WRONLY | O_CREAT | O_TRUNC;
+    fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+  }
+  if (fd < 0) {
+    LOG_WARN("Capture %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  Capture *cap = calloc(1, sizeof(*cap));
+  if (!cap) {
+    close(fd);
+    return NULL;
+  }
+  cap->fd = fd;
+  cap->is_socket = sock;
+  cap->full = 1;
+  if ((sock || fifo) && g_epfd >= 0) {
+    struct epoll_event ev = {.events = 0, .data.ptr = &g_ep_capture};
+    cap->polled = epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+  }
+  LOG_INFO("Capturing to %s.\n", path);
+  return cap;
+}
+
+static void capture_stop(Capture *cap, const char *why) {
+  if (cap->fd < 0)
+    return;
+  LOG_WARN("Capture stopped: %s\n", why);
+  if (cap->polled)
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, cap->fd, NULL);
+  close(cap->fd);
+  cap->fd = -1;
+  free(cap->out);
+  cap->out = NULL;
+  cap->out_len = cap->out_off = cap->out_cap = 0;
+}
+
+static void capture_close(Capture *cap) {
+  if (!cap)
+    return;
+  if (cap->fd >= 0)
+    close(cap->fd);
+  free(cap->out);
+  free(cap);
+}
+
+/* Writes what the reader takes now; 1 while some of the frame is left.
+ * Meanwhile the fd is watched for room, so the rest goes out even if no
+ * further frame is drawn. */
+static int capture_flush(Capture *cap) {
+  while (cap->fd >= 0 && cap->out_off < cap->out_len) {
+    const uint8_t *p = cap->out + cap->out_off;
+    size_t left = cap->out_len - cap->out_off;
+    ssize_t n = cap->is_socket ? send(cap->fd, p, left, MSG_NOSIGNAL)
+                               : write(cap->fd, p, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      break;
+    if (n <= 0) {
+      capture_stop(cap, n < 0 ? strerror(errno) : "short write");
+      return 0;
+    }
+    cap->out_off += (size_t)n;
+    cap->bytes += (uint64_t)n;
+  }
+  int left = cap->fd >= 0 && cap->out_off < cap->out_len;
+  if (cap->polled && left != cap->watching) {
+    ep_rewatch(cap->fd, &g_ep_capture, left ? EPOLLOUT : 0);
+    cap->watching = left;
+  }
+  return left;
+}
+
+static void capture_damage(Capture *cap, PixelRect r) {
+  rect_set_add(cap->rects, &cap->count, &cap->full, CAPTURE_MAX_RECTS, r);
+}
+
+static void capture_put(Capture *cap, uint32_t type, PixelRect r,
+                        uint64_t ns) {
+  CaptureRecord rec = {.ns = ns,
+                       .type = type,
+                       .seq = cap->seq,
+                       .x = (uint16_t)r.x,
+                       .y = (uint16_t)r.y,
+                       .w = (uint16_t)r.w,
+                       .h = (uint16_t)r.h};
+  memcpy(cap->out + cap->out_len, &rec, sizeof(rec));
+  cap->out_len += sizeof(rec);
+}
+
+/* Encodes the damage gathered since the last frame sent, read from the
+ * finished back buffer, and starts writing it. */
+static void capture_frame(Capture *cap, const DrmState *drm, int full) {
+  if (cap->fd < 0)
+    return;
+  cap->full |= full;
+  if (capture_flush(cap)) {
+    cap->deferred++;
+    return;
+  }
+  if (cap->fd < 0)
+    return;
+  int resized = cap->width != drm->width || cap->height != drm->height;
+  if (resized || cap->full) {
+    cap->rects[0] = (PixelRect){0, 0, (int)drm->width, (int)drm->height};
+    cap->count = 1;
+  }
+  size_t need = (size_t)(cap->count + 2) * sizeof(CaptureRecord);
+  int n = 0;
+  for (int i = 0; i < cap->count; i++)
+    if (pixel_rect_clip(drm, &cap->rects[i])) {
+      cap->rects[n] = cap->rects[i];
+      need += (size_t)cap->rects[n].w * (size_t)cap->rects[n].h * 4;
+      n++;
+    }
+  cap->count = 0;
+  cap->full = 0;
+  if (!n)
+    return;
+  if (need > cap->out_cap) {
+    uint8_t *grown = realloc(cap->out, need);
+    if (!grown) {
+      cap->full = 1;
+      return;
+    }
+    cap->out = grown;
+    cap->out_cap = need;
+  }
+
+  cap->out_len = cap->out_off = 0;
+  if (resized) {
+    cap->width = drm->width;
+    cap->height = drm->height;
+    capture_put(cap, CAPTURE_SIZE,
+                (PixelRect){0, 0, (int)drm->width, (int)drm->height}, 0);
+  }
+  for (int i = 0; i < n; i++) {
+    PixelRect r = cap->rects[i];
+    capture_put(cap, CAPTURE_TILE, r, 0);
+    const uint8_t *src = drm->back_buffer + (size_t)r.y * drm->stride +
+                         (size_t)r.x * 4;
+    for (int row = 0; row < r.h; row++, src += drm->stride) {
+      memcpy(cap->out + cap->out_len, src, (size_t)r.w * 4);
+      cap->out_len += (size_t)r.w * 4;
+    }
+  }
+  capture_put(cap, CAPTURE_FRAME, (PixelRect){0, 0, 0, 0}, now_ns());
+  cap->seq++;
+  cap->frames++;
+  capture_flush(cap);
+}
+
+/* The reader made room: the rest of the frame goes out, then whatever
+ * piled up behind it, read from the frame last drawn. */
+static void capture_pump(Capture *cap, const DrmState *drm) {
+  if (!capture_flush(cap) && (cap->count || cap->full))
+    capture_frame(cap, drm, 0);
+}
+
+/* -- Pane Pool ---------------------------------------------------- */
+
+/* Hands out a zeroed pane in the lowest free slot, or NULL. */
+static PaneSession *pane_alloc(void) {
+  for (int c = 0; c < MAX_PANE_CHUNKS; c++) {
+    uint64_t used = g_panes.used.word[c];
+    if (used == ~(uint64_t)0)
+      continue;
+    if (!g_panes.chunks[c]) {
+      g_panes.chunks[c] = malloc(PANE_CHUNK * sizeof(PaneSession));
+      if (!g_panes.chunks[c]) {
+        LOG_WARN("Pane allocation failed.\n");
+        return NULL;
+      }
+    }
+    int i = __builtin_ctzll(~used);
+    PaneSession *pane = &g_panes.chunks[c][i];
+    memset(pane, 0, sizeof(*pane));
+    pane->slot = c * PANE_CHUNK + i;
+    pane->master_fd = -1;
+    pane->child_pid = -1;
+    pane->cursor_drawn.row = -1;
+    mask_set(&g_panes.used, pane->slot);
+    return pane;
+  }
+  LOG_WARN("Pane limit (%d) reached.\n", MAX_SLOTS);
+  return NULL;
+}
+
+/* The pane in a slot, or NULL if the slot is free. */
+static PaneSession *pane_at(int slot) {
+  if (!mask_test(&g_panes.used, slot))
+    return NULL;
+  return &g_panes.chunks[slot / PANE_CHUNK][slot % PANE_CHUNK];
+}
+
+/* Frees what the pane holds and returns its slot. The I/O thread and
+ * the main loop's epoll set must already be done with it. */
+static void pane_release(PaneSession *pane) {
+  if (pane->master_fd >= 0) {
+    close(pane->master_fd);
+    pane->master_fd = -1;
+  }
+  if (pane->child_pid > 0) {
+    waitpid(pane->child_pid, NULL, WNOHANG);
+    pane->child_pid = -1;
+  }
+  if (pane->vt) {
+    vterm_free(pane->vt);
+    pane->vt = NULL;
+    pane->vtscreen = NULL;
+  }
+  ring_free(&pane->input);
+  ring_free(&pane->output);
+  free(pane->rbuf);
+  pane->rbuf = NULL;
+  pane->rbuf_cap = 0;
+  free(pane->tx_pend);
+  pane->tx_pend = NULL;
+  pane->tx_pend_len = pane->tx_pend_cap = 0;
+  sb_free(&pane->sb);
+  mask_clear(&g_panes.used, pane->slot);
+}
+
+/* -- Pane Layout -------------------------------------------------- */
+
+static PaneNode *node_first_leaf(PaneNode *n) {
+  while (n && n->child[0])
+    n = n->child[0];
+  return n;
+}
+
+static PaneNode *node_last_leaf(PaneNode *n) {
+  while (n && n->child[1])
+    n = n->child[1];
+  return n;
+}
+
+/* Neighbouring leaves in layout order (left to right, top to bottom),
+ * or NULL past either end. */
+static PaneNode *node_next_leaf(PaneNode *n) {
+  for (; n->parent; n = n->parent)
+    if (n == n->parent->child[0])
+      return node_first_leaf(n->parent->child[1]);
+  return NULL;
+}
+
+static PaneNode *node_prev_leaf(PaneNode *n) {
+  for (; n->parent; n = n->parent)
+    if (n == n->parent->child[1])
+      return node_last_leaf(n->parent->child[0]);
+  return NULL;
+}
+
+/* The pointer that holds n: its parent's child slot or the tab root. */
+static PaneNode **node_link(TabSession *tab, PaneNode *n) {
+  if (!n->parent)
+    return &tab->root;
+  return &n->parent->child[n == n->parent->child[1]];
+}
+
+static void node_free(PaneNode *n) {
+  if (!n)
+    return;
+  node_free(n->child[0]);
+  node_free(n->child[1]);
+  free(n);
+}
+
+/* Gives a pane a new cell size: libvterm reflows and the child gets
+ * SIGWINCH. Pending damage is dropped, as every layout change is
+ * followed by a full redraw. */
+static void pane_resize(PaneSession *pane, int cols, int rows,
+                        const HardwareState *hw) {
+  cols = cols > 0 ? cols : 1;
+  rows = rows > 0 ? rows : 1;
+  if (cols == pane->term_cols && rows == pane->term_rows)
+    return;
+  pane->term_cols = cols;
+  pane->term_rows = rows;
+  vterm_set_size(pane->vt, rows, cols);
+  pane->dirty.count = 0;
+  pane->num_moves = 0;
+  if (pane->master_fd >= 0) {
+    struct winsize ws = {
+        .ws_row = (unsigned short)rows,
+        .ws_col = (unsigned short)cols,
+        .ws_xpixel = (unsigned short)(cols * hw->font->cell_w),
+        .ws_ypixel = (unsigned short)(rows * hw->font->cell_h),
+    };
+    if (ioctl(pane->master_fd, TIOCSWINSZ, &ws) < 0)
+      LOG_WARN("TIOCSWINSZ on pane %d failed: %s\n", pane->slot,
+               strerror(errno));
+  }
+  LOG_INFO("Pane %d resized to %dx%d.\n", pane->slot, cols, rows);
+}
+
+/* Assigns a subtree its box and splits it down to the leaves. Only
+ * panes whose size changed are resized. */
+static void node_layout(PaneNode *n, int col, int row, int cols, int rows,
+                        const HardwareState *hw) {
+  n->col = col;
+  n->row = row;
+  n->cols = cols;
+  n->rows = rows;
+  if (n->pane) {
+    n->pane->start_col = col * hw->font->cell_w;
+    n->pane->start_row = row * hw->font->cell_h;
+    pane_resize(n->pane, cols, rows, hw);
+    return;
+  }
+  if (n->split == SPLIT_V) {
+    int left = cols / 2;
+    node_layout(n->child[0], col, row, left, rows, hw);
+    node_layout(n->child[1], col + left, row, cols - left, rows, hw);
+  } else {
+    int top = rows / 2;
+    node_layout(n->child[0], col, row, cols, top, hw);
+    node_layout(n->child[1], col, row + top, cols, rows - top, hw);
+  }
+}
+
+/* Makes pane the single leaf of an empty tab. */
+static int node_init_root(TabSession *tab, PaneSession *pane) {
+  PaneNode *root = calloc(1, sizeof(*root));
+  if (!root)
+    return -1;
+  root->pane = pane;
+  pane->node = root;
+  pane->tab = tab;
+  tab->root = root;
+  tab->active_pane = pane;
+  tab->num_panes = 1;
+  return 0;
+}
+
+/* Replaces leaf with a split node holding it and a new leaf for pane,
+ * and lays the pair out in leaf's old box. */
+static int node_split(TabSession *tab, PaneNode *leaf, int split,
+                      PaneSession *pane, const HardwareState *hw) {
+  PaneNode *inner = calloc(1, sizeof(*inner));
+  PaneNode *fresh = calloc(1, sizeof(*fresh));
+  if (!inner || !fresh) {
+    free(inner);
+    free(fresh);
+    return -1;
+  }
+  *node_link(tab, leaf) = inner;
+  inner->parent = leaf->parent;
+  inner->split = split;
+  inner->child[0] = leaf;
+  inner->child[1] = fresh;
+  leaf->parent = fresh->parent = inner;
+  fresh->pane = pane;
+  pane->node = fresh;
+  pane->tab = tab;
+  tab->num_panes++;
+  node_layout(inner, leaf->col, leaf->row, leaf->cols, leaf->rows, hw);
+  return 0;
+}
+
+/* Takes a pane's leaf out of the layout; its sibling subtree inherits
+ * the parent's box and, if the pane had focus, the nearest leaf in it
+ * takes over. Leaves the tab without a root after its last pane. */
+static void node_remove(TabSession *tab, PaneSession *pane,
+                        const HardwareState *hw) {
+  PaneNode *leaf = pane->node, *parent = leaf->parent;
+  tab->num_panes--;
+  pane->node = NULL;
+  if (!parent) {
+    free(leaf);
+    tab->root = NULL;
+    tab->active_pane = NULL;
+    return;
+  }
+  int was_first = leaf == parent->child[0];
+  PaneNode *sib = parent->child[was_first];
+  free(leaf);
+  *node_link(tab, parent) = sib;
+  sib->parent = parent->parent;
+  node_layout(sib, parent->col, parent->row, parent->cols, parent->rows, hw);
+  free(parent);
+  if (tab->active_pane == pane)
+    tab->active_pane =
+        (was_first ? node_first_leaf(sib) : node_last_leaf(sib))->pane;
+}
+
+/* -- Cleanup ------------------------------------------------------ */
+
+static void full_cleanup(void) {
+  LOG_INFO("Running full cleanup...\n");
+  io_thread_stop(&g_io);
+  if (g_epfd >= 0) {
+    close(g_epfd);
+    g_epfd = -1;
+  }
+  if (g_uevent_fd >= 0) {
+    close(g_uevent_fd);
+    g_uevent_fd = -1;
+  }
+  capture_close(g_capture);
+  g_capture = NULL;
+  disable_raw_mode();
+#ifdef OPALTERM_EVDEV
+  evdev_close(&g_evdev);
+#endif
+  vt_cleanup();
+
+  for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+    if (g_ipc_clients[i].used) {
+      close(g_ipc_clients[i].fd);
+      free(g_ipc_clients[i].out);
+      g_ipc_clients[i].used = 0;
+    }
+  if (g_ipc_fd >= 0) {
+    close(g_ipc_fd);
+    g_ipc_fd = -1;
+    char sock_path[64];
+    get_socket_path(sock_path, sizeof(sock_path));
+    unlink(sock_path);
+  }
+
+  for (int k = mask_next(&g_panes.used, 0); k >= 0;
+       k = mask_next(&g_panes.used, k + 1))
+    pane_release(pane_at(k));
+  for (int c = 0; c < MAX_PANE_CHUNKS; c++) {
+    free(g_panes.chunks[c]);
+    g_panes.chunks[c] = NULL;
+  }
+  for (int i = 0; i < g_app.num_tabs; i++) {
+    node_free(g_app.tabs[i]->root);
+    free(g_app.tabs[i]);
+  }
+  free(g_app.tabs);
+  g_app.tabs = NULL;
+  g_app.num_tabs = g_app.tabs_cap = 0;
+
+  free(g_row_cells);
+  g_row_cells = NULL;
+  g_row_cells_cap = 0;
+
+  FontState *font = &g_app.font;
+  glyph_cache_free(&font->cache);
+  blend_cache_free(&font->blend);
+  for (int i = 0; i < FONT_FACES; i++)
+    font_face_close(&font->faces[i]);
+  if (font->lib) {
+    FT_Done_FreeType(font->lib);
+    font->lib = NULL;
+  }
+
+  for (int o = 0; o < g_app.num_outputs; o++)
+    drm_output_destroy(&g_app.outputs[o].hw.drm, 1);
+  g_app.num_outputs = 0;
+  if (g_app.drm_fd >= 0) {
+    close(g_app.drm_fd);
+    g_app.drm_fd = -1;
+  }
+  LOG_INFO("Goodbye.\n");
+  log_close();
+}
+
+/* -- DRM Setup ---------------------------------------------------- */
+
+/* A connector's preferred mode, else its first. */
+static drmModeModeInfo drm_conn_mode(const drmModeConnector *conn) {
+  for (int i = 0; i < conn->count_modes; i++)
+    if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED)
+      return conn->modes[i];
+  return conn->modes[0];
+}
+
+static int drm_conn_usable(const drmModeConnector *conn) {
+  return conn && conn->connection == DRM_MODE_CONNECTED &&
+         conn->count_modes > 0;
+}
+
+/* A CRTC for conn that is not taken (bits by res->crtcs index): the
+ * one its encoder has, else the first any of its encoders can drive.
+ * Returns its index, or -1. */
+static int drm_pick_crtc(int fd, const drmModeRes *res,
+                         const drmModeConnector *conn, uint32_t taken) {
+  int n = res->count_crtcs < 32 ? res->count_crtcs : 32;
+  uint32_t current = 0;
+  if (conn->encoder_id) {
+    drmModeEncoder *enc = drmModeGetEncoder(fd, conn->encoder_id);
+    if (enc) {
+      current = enc->crtc_id;
+      drmModeFreeEncoder(enc);
+    }
+  }
+  for (int i = 0; i < n; i++)
+    if (current && res->crtcs[i] == current && !(taken & 1u << i))
+      return i;
+  for (int e = 0; e < conn->count_encoders; e++) {
+    drmModeEncoder *enc = drmModeGetEncoder(fd, conn->encoders[e]);
+    if (!enc)
+      continue;
+    uint32_t possible = enc->possible_crtcs & ~taken;
+    drmModeFreeEncoder(enc);
+    for (int i = 0; i < n; i++)
+      if (possible & 1u << i)
+        return i;
+  }
+  return -1;
+}
+
+/* Probes /dev/dri/card0..63 for a node with connectors and CRTCs,
+ * trying card_hint (from the startup cache; -1 for none) first.
+ * Returns its fd, or -1. */
+static int drm_open_card(int card_hint, int *card_out, drmModeRes **res) {
+  for (int i = card_hint >= 0 ? -1 : 0; i < 64; i++) {
+    int card = i < 0 ? card_hint : i;
+    if (i >= 0 && card == card_hint)
+      continue;
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/dri/card%d", card);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    drmModeRes *r = drmModeGetResources(fd);
+    if (!r) {
+      close(fd);
+      continue;
+    }
+    if (r->count_connectors > 0 && r->count_crtcs > 0) {
+      *card_out = card;
+      *res = r;
+      LOG_INFO("Found KMS device: %s (%d conn, %d CRTCs)\n", path,
+               r->count_connectors, r->count_crtcs);
+      return fd;
+    }
+    drmModeFreeResources(r);
+    close(fd);
+  }
+  return -1;
+}
+
+/* Drives conn in its preferred mode on crtc_id, with num_bufs dumb
+ * buffers of its own. */
+static int drm_output_init(DrmState *drm, int fd, int card,
+                           const drmModeConnector *conn, uint32_t crtc_id,
+                           int num_bufs) {
+  static uint32_t next_id;
+  memset(drm, 0, sizeof(*drm));
+  drm->id = ++next_id;
+  drm->fd = fd;
+  drm->card = card;
+  drm->mode = drm_conn_mode(conn);
+  drm->width = drm->cap_width = drm->mode.hdisplay;
+  drm->height = drm->cap_height = drm->mode.vdisplay;
+  drm->conn_id = conn->connector_id;
+  drm->crtc_id = crtc_id;
+  drm->orig_crtc = drmModeGetCrtc(fd, crtc_id);
+
+  if (num_bufs < 1)
+    num_bufs = 1;
+  if (num_bufs > DRM_MAX_BUFFERS)
+    num_bufs = DRM_MAX_BUFFERS;
+  for (int i = 0; i < num_bufs; i++) {
+    if (drm_buffer_create(drm, &drm->bufs[i]) < 0) {
+      drm_buffer_destroy(drm, &drm->bufs[i]);
+      if (i == 0)
+        goto fail;
+      if (i == 1)
+        LOG_WARN("Second dumb buffer failed, using shadow copy.\n");
+      else
+        LOG_WARN("Third dumb buffer failed, using double buffering.\n");
+      break;
+    }
+    drm->num_bufs = i + 1;
+  }
+
+  drm->front = drm->last = 0;
+  drm->pending = drm->queued = -1;
+  drm->framebuffer = drm->bufs[0].map;
+  if (drm->num_bufs == 1) {
+    drm->back = 0;
+    drm->back_cap = drm->size;
+    drm->back_buffer = malloc(drm->back_cap);
+    if (!drm->back_buffer) {
+      perror("back_buffer malloc");
+      goto fail;
+    }
+  } else {
+    drm->back = 1;
+    drm->back_buffer = drm->bufs[1].map;
+  }
+  if (drmModeSetCrtc(fd, crtc_id, drm->bufs[0].fb_id, 0, 0, &drm->conn_id, 1,
+                     &drm->mode) < 0) {
+    perror("SetCrtc");
+    goto fail;
+  }
+  LOG_INFO("Output on connector %u, CRTC %u: %ux%u@%u (stride=%u, %d "
+           "buffer%s, %s).\n",
+           drm->conn_id, crtc_id, drm->width, drm->height,
+           drm->mode.vrefresh, drm->stride, drm->num_bufs,
+           drm->num_bufs == 1 ? "" : "s",
+           drm->num_bufs == 1 ? "shadow copy" : "page flip");
+  return 0;
+
+fail:
+  drm_output_destroy(drm, 1);
+  return -1;
+}
+
+/* Drives every connected connector, up to max, each on a CRTC and
+ * with buffers of its own, all on one card. Returns how many outputs
+ * came up, or -1. */
+static int drm_init(DrmState *outs, int max, int num_bufs, int card_hint) {
+  drmModeRes *res = NULL;
+  int card = -1;
+  int fd = drm_open_card(card_hint, &card, &res);
+  if (fd < 0) {
+    LOG_FATAL("No KMS device found.\n");
+    return -1;
+  }
+
+  int n = 0;
+  uint32_t taken = 0;
+  for (int i = 0; i < res->count_connectors && n < max; i++) {
+    drmModeConnector *conn = drmModeGetConnector(fd, res->connectors[i]);
+    if (drm_conn_usable(conn)) {
+      int c = drm_pick_crtc(fd, res, conn, taken);
+      if (c < 0)
+        LOG_WARN("No free CRTC for connector %u.\n", conn->connector_id);
+      else if (drm_output_init(&outs[n], fd, card, conn, res->crtcs[c],
+                               num_bufs) == 0) {
+        taken |= 1u << c;
+        n++;
+      }
+    }
+    drmModeFreeConnector(conn);
+  }
+  drmModeFreeResources(res);
+  if (!n) {
+    LOG_FATAL("No connected monitor.\n");
+    close(fd);
+    return -1;
+  }
+  LOG_INFO("DRM initialized, %d output%s.\n", n, n == 1 ? "" : "s");
+  return n;
+}
+
+/* Heap-only render target with the shadow-copy layout, for --bench
+ * runs and servers with offscreen_width set: the renderer draws into it
+ * as into a display, with no device behind it. */
+static int drm_init_offscreen(DrmState *drm, uint32_t width, uint32_t height) {
+  memset(drm, 0, sizeof(*drm));
+  drm->fd = -1;
+  drm->card = -1;
+  drm->offscreen = 1;
+  drm->width = width;
+  drm->height = height;
+  drm->stride = width * 4;
+  drm->size = drm->stride * height;
+  drm->mode.vrefresh = 60;
+  drm->num_bufs = 1;
+  drm->pending = drm->queued = -1;
+  drm->framebuffer = calloc(1, drm->size);
+  drm->back_buffer = calloc(1, drm->size);
+  if (!drm->framebuffer || !drm->back_buffer) {
+    perror("offscreen malloc");
+    return -1;
+  }
+  LOG_INFO("Offscreen target %ux%u.\n", width, height);
+  return 0;
+}
+
+/* -- Presentation ------------------------------------------------- */
+
+static void blit_rect(const DrmState *drm, uint8_t *dst, const uint8_t *src,
+                      PixelRect r) {
+  if (!pixel_rect_clip(drm, &r))
+    return;
+  size_t off = (size_t)r.y * drm->stride + (size_t)r.x * 4;
+  for (int row = 0; row < r.h; row++, off += drm->stride)
+    memcpy(dst + off, src + off, (size_t)r.w * 4);
+}
+
+static void stale_add(DrmBuffer *buf, PixelRect r) {
+  rect_set_add(buf->stale, &buf->stale_count, &buf->stale_full,
+               DRM_MAX_STALE, r);
+}
+
+/* The flip event carries the output's id, not its address: outputs[]
+ * is compacted when a monitor goes, and a flip that was given up on
+ * may still report in later. */
+static int drm_page_flip(DrmState *drm, int idx) {
+  if (drmModePageFlip(drm->fd, drm->crtc_id, drm->bufs[idx].fb_id,
+                      DRM_MODE_PAGE_FLIP_EVENT,
+                      (void *)(uintptr_t)drm->id) < 0) {
+    /* No flip (e.g. VT switched away): show it synchronously. */
+    drmModeSetCrtc(drm->fd, drm->crtc_id, drm->bufs[idx].fb_id, 0, 0,
+                   &drm->conn_id, 1, &drm->mode);
+    drm->front = idx;
+    return -1;
+  }
+  drm->pending = idx;
+  return 0;
+}
+
+static void drm_on_page_flip(int fd, unsigned int seq, unsigned int tv_sec,
+                             unsigned int tv_usec, void *user) {
+  (void)fd;
+  (void)seq;
+  (void)tv_sec;
+  (void)tv_usec;
+  DrmState *drm = NULL;
+  for (int o = 0; o < g_app.num_outputs; o++)
+    if (g_app.outputs[o].hw.drm.id == (uint32_t)(uintptr_t)user)
+      drm = &g_app.outputs[o].hw.drm;
+  if (!drm)
+    return; /* its output is gone */
+  if (drm->pending >= 0)
+    drm->front = drm->pending;
+  drm->pending = -1;
+  if (drm->queued >= 0) {
+    int q = drm->queued;
+    drm->queued = -1;
+    drm_page_flip(drm, q);
+  }
+}
+
+/* Drains flip-complete events from the DRM fd. */
+static void drm_handle_events(DrmState *drm) {
+  drmEventContext ev = {
+      .version = 2,
+      .page_flip_handler = drm_on_page_flip,
+  };
+  drmHandleEvent(drm->fd, &ev);
+}
+
+/* Whether a buffer is free to render the next frame into. */
+static int drm_can_render(const DrmState *drm) {
+  if (drm->num_bufs == 1 || drm->pending < 0)
+    return 1;
+  return drm->num_bufs > 2 && drm->queued < 0;
+}
+
+/* Takes the display back after a VT switch. Whoever ran meanwhile
+ * owned the CRTC, so the front buffer is put back on it; a flip still
+ * in flight when master was dropped may never complete, so it is
+ * forgotten rather than waited for. Every buffer is left stale and the
+ * caller redraws in full. */
+static void drm_vt_resume(DrmState *drm) {
+  if (drm->offscreen || drm->num_bufs == 0)
+    return;
+  drm->pending = drm->queued = -1;
+  for (int i = 0; i < drm->num_bufs; i++)
+    drm->bufs[i].stale_full = 1;
+  if (drmModeSetCrtc(drm->fd, drm->crtc_id, drm->bufs[drm->front].fb_id, 0, 0,
+                     &drm->conn_id, 1, &drm->mode) < 0)
+    LOG_WARN("SetCrtc on VT acquire failed: %s\n", strerror(errno));
+}
+
+/* Picks the render target and, for partial frames, copies into it the
+ * regions it missed while other buffers were being drawn. */
+static void drm_frame_begin(DrmState *drm, int full) {
+  if (drm->num_bufs == 1)
+    return;
+  int b;
+  for (b = 0; b < drm->num_bufs; b++)
+    if (b != drm->front && b != drm->pending && b != drm->queued)
+      break;
+  drm->back = b;
+  drm->back_buffer = drm->bufs[b].map;
+
+  DrmBuffer *buf = &drm->bufs[b];
+  if (!full && b != drm->last) {
+    const uint8_t *src = drm->bufs[drm->last].map;
+    if (buf->stale_full)
+      memcpy(buf->map, src, drm->size);
+    else
+      for (int i = 0; i < buf->stale_count; i++)
+        blit_rect(drm, buf->map, src, buf->stale[i]);
+  }
+  buf->stale_count = 0;
+  buf->stale_full = 0;
+}
+
+/* Moves a pixel rect of the back buffer by (dx, dy), for scrolls. Rows
+ * are walked away from the destination so overlapping moves are safe. */
+static void drm_move_rect(DrmState *drm, PixelRect src, int dx, int dy) {
+  if (src.w <= 0 || src.h <= 0)
+    return;
+  size_t row_bytes = (size_t)src.w * 4;
+  for (int i = 0; i < src.h; i++) {
+    int y = dy > 0 ? src.y + src.h - 1 - i : src.y + i;
+    uint8_t *from = drm->back_buffer + (size_t)y * drm->stride +
+                    (size_t)src.x * 4;
+    uint8_t *to = drm->back_buffer + (size_t)(y + dy) * drm->stride +
+                  (size_t)(src.x + dx) * 4;
+    memmove(to, from, row_bytes);
+  }
+}
+
+/* Marks one pixel rect of the frame as changed. In shadow-copy mode it
+ * goes straight to scanout; in page-flip mode the other buffers are
+ * told they are stale there. */
+static void present_rect(DrmState *drm, int x, int y, int w, int h) {
+  PixelRect r = {x, y, w, h};
+  if (drm->capture)
+    capture_damage(drm->capture, r);
+  if (drm->num_bufs == 1) {
+    blit_rect(drm, drm->framebuffer, drm->back_buffer, r);
+    return;
+  }
+  for (int i = 0; i < drm->num_bufs; i++)
+    if (i != drm->back)
+      stale_add(&drm->bufs[i], r);
+}
+
+static void drm_frame_end(DrmState *drm, int full) {
+  if (drm->capture)
+    capture_frame(drm->capture, drm, full);
+  if (drm->num_bufs == 1) {
+    if (full)
+      memcpy(drm->framebuffer, drm->back_buffer, drm->size);
+    return;
+  }
+  if (full)
+    for (int i = 0; i < drm->num_bufs; i++)
+      if (i != drm->back)
+        drm->bufs[i].stale_full = 1;
+  drm->last = drm->back;
+  if (drm->pending >= 0)
+    drm->queued = drm->back;
+  else
+    drm_page_flip(drm, drm->back);
+}
+
+/* -- Mode Changes ------------------------------------------------- */
+
+/* Puts the output in another mode. Its dumb buffers are a
+ * pool kept at the largest mode seen: a mode that fits only gets new
+ * framebuffer objects over the same buffers and allocates nothing; a
+ * bigger one replaces the pool, and if that fails the old mode stays.
+ * No flip may be in flight (display_rescan() waits for it). Every
+ * buffer is left stale and the caller redraws in full. */
+static int drm_apply_mode(DrmState *drm, const drmModeModeInfo *mode) {
+  uint32_t w = mode->hdisplay, h = mode->vdisplay;
+  int grow = w > drm->cap_width || h > drm->cap_height;
+  int made = 0;
+  uint8_t *shadow = NULL;
+
+  DrmState next = *drm;
+  next.mode = *mode;
+  next.width = w;
+  next.height = h;
+  if (grow) {
+    next.cap_width = w > drm->cap_width ? w : drm->cap_width;
+    next.cap_height = h > drm->cap_height ? h : drm->cap_height;
+    for (; made < drm->num_bufs; made++)
+      if (drm_buffer_create(&next, &next.bufs[made]) < 0) {
+        drm_buffer_destroy(&next, &next.bufs[made]);
+        goto fail;
+      }
+  } else {
+    for (; made < drm->num_bufs; made++)
+      if (drmModeAddFB(drm->fd, w, h, 24, 32, drm->stride,
+                       drm->bufs[made].handle, &next.bufs[made].fb_id) < 0) {
+        perror("AddFB");
+        goto fail;
+      }
+    next.size = next.stride * h;
+  }
+  if (drm->num_bufs == 1 &&
+      (size_t)next.stride * next.cap_height > drm->back_cap) {
+    next.back_cap = (size_t)next.stride * next.cap_height;
+    shadow = malloc(next.back_cap);
+    if (!shadow)
+      goto fail;
+  }
+  if (drmModeSetCrtc(drm->fd, next.crtc_id, next.bufs[0].fb_id, 0, 0,
+                     &next.conn_id, 1, &next.mode) < 0) {
+    perror("SetCrtc");
+    goto fail;
+  }
+
+  for (int i = 0; i < drm->num_bufs; i++) {
+    if (grow)
+      drm_buffer_destroy(drm, &drm->bufs[i]);
+    else
+      drmModeRmFB(drm->fd, drm->bufs[i].fb_id);
+    next.bufs[i].stale_count = 0;
+    next.bufs[i].stale_full = 1;
+  }
+  if (shadow) {
+    free(drm->back_buffer);
+    next.back_buffer = shadow;
+  }
+  next.front = next.last = 0;
+  next.framebuffer = next.bufs[0].map;
+  if (next.num_bufs > 1) {
+    next.back = 1;
+    next.back_buffer = next.bufs[1].map;
+  }
+  *drm = next;
+  LOG_INFO("Mode %ux%u@%u on connector %u (%s).\n", w, h, mode->vrefresh,
+           drm->conn_id, grow ? "new buffers" : "buffers reused");
+  return 0;
+
+fail:
+  LOG_WARN("Mode %ux%u failed, keeping %ux%u.\n", w, h, drm->width,
+           drm->height);
+  free(shadow);
+  for (int i = 0; i < made; i++) {
+    if (grow)
+      drm_buffer_destroy(&next, &next.bufs[i]);
+    else
+      drmModeRmFB(drm->fd, next.bufs[i].fb_id);
+  }
+  return -1;
+}
+
+/* Re-reads an output's connector, after a hotplug event or on
+ * request, and follows its preferred mode. Returns 1 when the mode
+ * changed and 0 when it did not or could not; the CRTC is set again
+ * either way, as a monitor that came back starts blank. Returns -1
+ * when the monitor is gone. */
+static int drm_output_rescan(DrmState *drm) {
+  if (drm->offscreen || drm->num_bufs == 0)
+    return 0;
+  drmModeConnector *conn = drmModeGetConnector(drm->fd, drm->conn_id);
+  if (!drm_conn_usable(conn)) {
+    drmModeFreeConnector(conn);
+    return -1;
+  }
+  drmModeModeInfo mode = drm_conn_mode(conn);
+  drmModeFreeConnector(conn);
+  if (memcmp(&mode, &drm->mode, sizeof(mode)) != 0 &&
+      drm_apply_mode(drm, &mode) == 0)
+    return 1;
+  drm_vt_resume(drm);
+  return 0;
+}
+
+/* Frame interval for the current mode. */
+static uint64_t drm_frame_ns(const DrmState *drm) {
+  return 1000000000u / (drm->mode.vrefresh ? drm->mode.vrefresh : 60);
+}
+
+/* -- Hotplug Events ----------------------------------------------- */
+
+/* Kernel uevents, for as long as the server runs. A monitor plugged
+ * in, pulled out or given new modes shows up as SUBSYSTEM=drm with
+ * HOTPLUG=1 on the card's device. */
+static int uevent_open(void) {
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  NETLINK_KOBJECT_UEVENT);
+  if (fd < 0) {
+    LOG_WARN("uevent socket failed: %s\n", strerror(errno));
+    return -1;
+  }
+  struct sockaddr_nl sa = {.nl_family = AF_NETLINK, .nl_groups = 1};
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    LOG_WARN("uevent bind failed: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Drains the socket; returns whether any event was a hotplug on card.
+ * Only messages from the kernel itself (port 0) count, and an overrun
+ * counts as one, since the event may have been among those lost. */
+static int uevent_drain(int fd, int card) {
+  char msg[2048], dev[32];
+  snprintf(dev, sizeof(dev), "DEVNAME=dri/card%d", card);
+  int hotplug = 0;
+  for (;;) {
+    struct sockaddr_nl sa = {0};
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(msg) - 1};
+    struct msghdr mh = {.msg_name = &sa,
+                        .msg_namelen = sizeof(sa),
+                        .msg_iov = &iov,
+                        .msg_iovlen = 1};
+    ssize_t n = recvmsg(fd, &mh, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS) {
+        hotplug = 1;
+        continue;
+      }
+      break;
+    }
+    if (sa.nl_pid != 0)
+      continue;
+    msg[n] = '\0';
+    int is_drm = 0, is_hotplug = 0, is_card = 0;
+    for (char *k = msg; k < msg + n; k += strlen(k) + 1) {
+      is_drm |= strcmp(k, "SUBSYSTEM=drm") == 0;
+      is_hotplug |= strcmp(k, "HOTPLUG=1") == 0;
+      is_card |= strcmp(k, dev) == 0;
+    }
+    hotplug |= is_drm && is_hotplug && is_card;
+  }
+  return hotplug;
+}
+
+/* -- Glyph Atlas File --------------------------------------------- */
+
+/* The warm-pass glyphs (printable ASCII) as rasterized by the first
+ * instance, for every later one to map read-only instead of rendering
+ * its own copy. Files are named by a hash of everything the bitmaps
+ * depend on, and that key is repeated in the header and checked in
+ * full. A header and the GlyphEntry metrics are followed, at a page
+ * boundary, by the slots exactly as they sit in the atlas. Bump
+ * ATLAS_VERSION whenever GlyphEntry or the slot layout changes. */
+
+#define ATLAS_MAGIC 0x4C54414Fu /* "OATL" */
+#define ATLAS_VERSION 1
+#define ATLAS_FIRST_CP 0x21
+#define ATLAS_GLYPHS (0x7F - ATLAS_FIRST_CP)
+
+typedef struct {
+  uint32_t magic, version;
+  uint32_t ft_version, font_size;
+  uint64_t font_bytes;
+  int64_t font_mtime;
+  uint32_t slot_w, slot_h, slot_bytes, count;
+  uint64_t atlas_offset;
+  char font_path[256];
+} AtlasHeader;
+
+static int atlas_header(AtlasHeader *h, const FontState *font,
+                        const AppConfig *cfg, char *path, size_t size,
+                        int create) {
+  struct stat st;
+  if (!font->path || stat(font->path, &st) < 0)
+    return -1;
+  FT_Int major, minor, patch;
+  FT_Library_Version(font->lib, &major, &minor, &patch);
+
+  const GlyphCache *gc = &font->cache;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t meta = sizeof(*h) + ATLAS_GLYPHS * sizeof(GlyphEntry);
+  memset(h, 0, sizeof(*h));
+  h->magic = ATLAS_MAGIC;
+  h->version = ATLAS_VERSION;
+  h->ft_version = (uint32_t)(major << 16 | minor << 8 | patch);
+  h->font_size = (uint32_t)cfg->font_size;
+  h->font_bytes = (uint64_t)st.st_size;
+  h->font_mtime = (int64_t)st.st_mtime;
+  h->slot_w = gc->slot_w;
+  h->slot_h = gc->slot_h;
+  h->slot_bytes = gc->slot_bytes;
+  h->count = ATLAS_GLYPHS;
+  h->atlas_offset = (meta + (size_t)page - 1) / (size_t)page * (size_t)page;
+  snprintf(h->font_path, sizeof(h->font_path), "%s", font->path);
+
+  /* FNV-1a over the header, which holds the whole key. */
+  uint64_t hash = 0xCBF29CE484222325u;
+  for (size_t i = 0; i < sizeof(*h); i++)
+    hash = (hash ^ ((const uint8_t *)h)[i]) * 0x100000001B3u;
+  char name[32];
+  snprintf(name, sizeof(name), "atlas-%016" PRIx64, hash);
+  return cache_path(path, size, name, create);
+}
+
+/* Maps a matching atlas file over the first slots and pins its glyphs
+ * there. Pinned slots are rounded up to whole pages, as the rest of
+ * the atlas must stay writable; the few slots sharing that last page
+ * are left unused. */
+static int glyph_cache_pin_file(FontState *font, const AppConfig *cfg) {
+  GlyphCache *gc = &font->cache;
+  AtlasHeader want, got;
+  char path[512];
+  if (atlas_header(&want, font, cfg, path, sizeof(path), 0) < 0)
+    return -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  long page = sysconf(_SC_PAGESIZE);
+  size_t bytes = (size_t)ATLAS_GLYPHS * gc->slot_bytes;
+  size_t pinned_bytes =
+      (bytes + (size_t)page - 1) / (size_t)page * (size_t)page;
+  int32_t pinned = (int32_t)((pinned_bytes + gc->slot_bytes - 1) /
+                             gc->slot_bytes);
+  struct stat st;
+  size_t meta = ATLAS_GLYPHS * sizeof(GlyphEntry);
+  if (pinned > gc->capacity / 2 || fstat(fd, &st) < 0 ||
+      (uint64_t)st.st_size < want.atlas_offset + bytes ||
+      pread(fd, &got, sizeof(got), 0) != (ssize_t)sizeof(got) ||
+      memcmp(&got, &want, sizeof(got)) != 0 ||
+      pread(fd, gc->entries, meta, sizeof(got)) != (ssize_t)meta) {
+    close(fd);
+    return -1;
+  }
+  for (int32_t i = 0; i < ATLAS_GLYPHS; i++) {
+    const GlyphEntry *e = &gc->entries[i];
+    if (e->key != GLYPH_KEY(ATLAS_FIRST_CP + i, 0) || e->width > gc->slot_w ||
+        e->rows > gc->slot_h) {
+      memset(gc->entries, 0, meta);
+      close(fd);
+      return -1;
+    }
+  }
+
+  void *map = mmap(gc->atlas, pinned_bytes, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                   fd, (off_t)want.atlas_offset);
+  close(fd);
+  if (map == MAP_FAILED) {
+    /* A failed MAP_FIXED may have dropped the old pages; put them back. */
+    mmap(gc->atlas, pinned_bytes, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    memset(gc->entries, 0, meta);
+    return -1;
+  }
+
+  for (int32_t i = 0; i < ATLAS_GLYPHS; i++) {
+    GlyphEntry *e = &gc->entries[i];
+    uint32_t h = glyph_hash(gc, e->key);
+    e->prev = e->next = -1;
+    e->hnext = gc->buckets[h];
+    gc->buckets[h] = i;
+  }
+  gc->pinned = gc->used = pinned;
+  LOG_INFO("Glyph atlas mapped from %s.\n", path);
+  return 0;
+}
+
+/* Writes the warm pass out for later instances; it has to be the
+ * first thing in an otherwise empty cache. */
+static void glyph_cache_save_file(const FontState *font,
+                                  const AppConfig *cfg) {
+  const GlyphCache *gc = &font->cache;
+  AtlasHeader h;
+  char path[512], tmp[540];
+  if (gc->used < ATLAS_GLYPHS || gc->evictions ||
+      atlas_header(&h, font, cfg, path, sizeof(path), 1) < 0)
+    return;
+  for (int32_t i = 0; i < ATLAS_GLYPHS; i++)
+    if (gc->entries[i].key != GLYPH_KEY(ATLAS_FIRST_CP + i, 0))
+      return;
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG_WARN("Glyph atlas %s: %s\n", tmp, strerror(errno));
+    return;
+  }
+  size_t meta = ATLAS_GLYPHS * sizeof(GlyphEntry);
+  size_t bytes = (size_t)ATLAS_GLYPHS * gc->slot_bytes;
+  int ok = pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+           pwrite(fd, gc->entries, meta, sizeof(h)) == (ssize_t)meta &&
+           pwrite(fd, gc->atlas, bytes, (off_t)h.atlas_offset) ==
+               (ssize_t)bytes;
+  if (close(fd) < 0 || !ok || rename(tmp, path) < 0) {
+    LOG_WARN("Glyph atlas %s: %s\n", path, strerror(errno));
+    unlink(tmp);
+    return;
+  }
+  LOG_INFO("Glyph atlas saved to %s.\n", path);
+}
+
+/* -- FreeType Setup ----------------------------------------------- */
+
+/* Loads the first font_fallbacks[] entry that exists. A path_hint
+ * (from the startup cache) that is still on the list and on disk is
+ * taken without checking the entries ahead of it. */
+static int font_init(FontState *font, const AppConfig *cfg,
+                     const char *path_hint) {
+  memset(font, 0, sizeof(*font));
+  if (FT_Init_FreeType(&font->lib)) {
+    LOG_FATAL("FT init failed.\n");
+    return -1;
+  }
+
+  const char *found = NULL;
+  for (int i = 0; path_hint && font_fallbacks[i]; i++) {
+    if (strcmp(font_fallbacks[i], path_hint) == 0) {
+      if (access(font_fallbacks[i], F_OK) == 0)
+        found = font_fallbacks[i];
+      break;
+    }
+  }
+  for (int i = 0; !found && font_fallbacks[i]; i++) {
+    if (access(font_fallbacks[i], F_OK) == 0) {
+      found = font_fallbacks[i];
+      break;
+    }
+  }
+  if (!found) {
+    LOG_FATAL("No monospace font found. Install one of:\n"
+              "  ttf-jetbrains-mono-nerd  (Arch)\n"
+              "  fonts-jetbrains-mono     (Debian/Ubuntu)\n"
+              "  ttf-fira-code            (Arch)\n"
+              "  ttf-dejavu               / fonts-dejavu-core\n"
+              "  ttf-liberation           / fonts-liberation\n");
+    FT_Done_FreeType(font->lib);
+    font->lib = NULL;
+    return -1;
+  }
+
+  font->path = found;
+  font->pixel_size = cfg->font_size;
+  FontFace *regular = &font->faces[0];
+  if (font_face_open(font, regular, found) < 0)
+    goto fail;
+  if (FT_Load_Char(regular->face, 'M', FT_LOAD_DEFAULT)) {
+    LOG_FATAL("FT_Load_Char('M') failed.\n");
+    goto fail;
+  }
+  font->cell_w = (int)(regular->face->glyph->advance.x >> 6);
+  font->cell_h = (int)(regular->face->size->metrics.height >> 6);
+  font->ascender = (int)(regular->face->size->metrics.ascender >> 6);
+  if (font->cell_w <= 0 || font->cell_h <= 0) {
+    LOG_FATAL("Bad metrics: %dx%d\n", font->cell_w, font->cell_h);
+    goto fail;
+  }
+  LOG_INFO("Font: %s @ %dpx cell %dx%d (asc=%d)\n", found, cfg->font_size,
+           font->cell_w, font->cell_h, font->ascender);
+
+  if (glyph_cache_init(&font->cache, font->cell_w, font->cell_h,
+                       (size_t)cfg->glyph_cache_kb * 1024) < 0)
+    goto fail;
+  blend_cache_init(&font->blend, &font->cache, cfg);
+  /* Warm pass: printable ASCII covers nearly every cell in practice. */
+  if (!cfg->atlas_cache || glyph_cache_pin_file(font, cfg) < 0) {
+    for (uint32_t cp = ATLAS_FIRST_CP; cp < 0x7F; cp++)
+      glyph_cache_get(font, cp, 0);
+    if (cfg->atlas_cache)
+      glyph_cache_save_file(font, cfg);
+  }
+  return 0;
+
+fail:
+  font_face_close(&font->faces[0]);
+  FT_Done_FreeType(font->lib);
+  font->lib = NULL;
   return -1;
 }
 
-/* -- FreeType Setup ----------------------------------------------- */
+/* -- Damage Tracking -------------------------------------------- */
+
+static int rect_touches(VTermRect a, VTermRect b) {
+  return a.start_row <= b.end_row && b.start_row <= a.end_row &&
+         a.start_col <= b.end_col && b.start_col <= a.end_col;
+}
+
+static VTermRect rect_union(VTermRect a, VTermRect b) {
+  VTermRect u = a;
+  if (b.start_row < u.start_row)
+    u.start_row = b.start_row;
+  if (b.end_row > u.end_row)
+    u.end_row = b.end_row;
+  if (b.start_col < u.start_col)
+    u.start_col = b.start_col;
+  if (b.end_col > u.end_col)
+    u.end_col = b.end_col;
+  return u;
+}
+
+/* Adds a rect, merging with any rect it touches. When the list is full
+ * everything collapses into one bounding box. */
+static void dirty_add(DirtyList *dl, VTermRect rect) {
+  if (rect.start_row >= rect.end_row || rect.start_col >= rect.end_col)
+    return;
+  for (int i = 0; i < dl->count; i++) {
+    if (rect_touches(dl->rects[i], rect)) {
+      rect = rect_union(dl->rects[i], rect);
+      dl->rects[i] = dl->rects[--dl->count];
+      i = -1;
+    }
+  }
+  if (dl->count == MAX_DIRTY_RECTS) {
+    for (int i = 1; i < dl->count; i++)
+      dl->rects[0] = rect_union(dl->rects[0], dl->rects[i]);
+    rect = rect_union(dl->rects[0], rect);
+    dl->count = 0;
+  }
+  dl->rects[dl->count++] = rect;
+}
+
+static int pane_on_damage(VTermRect rect, void *user) {
+  PaneSession *pane = user;
+  dirty_add(&pane->dirty, rect);
+  return 1;
+}
+
+static VTermRect rect_clip(VTermRect a, VTermRect b) {
+  VTermRect r = a;
+  if (b.start_row > r.start_row)
+    r.start_row = b.start_row;
+  if (b.end_row < r.end_row)
+    r.end_row = b.end_row;
+  if (b.start_col > r.start_col)
+    r.start_col = b.start_col;
+  if (b.end_col < r.end_col)
+    r.end_col = b.end_col;
+  return r;
+}
+
+static VTermRect rect_shift(VTermRect r, int drow, int dcol) {
+  return (VTermRect){r.start_row + drow, r.end_row + drow, r.start_col + dcol,
+                     r.end_col + dcol};
+}
+
+/* Folds a vertical scroll into the previous one when both scroll the
+ * same region the same way, so a flood queues one move per frame. */
+static int pane_merge_move(PaneSession *pane, VTermRect dest, VTermRect src) {
+  if (pane->num_moves == 0)
+    return 0;
+  PaneMove *m = &pane->moves[pane->num_moves - 1];
+  int d0 = m->dest.start_row - m->src.start_row;
+  int d1 = dest.start_row - src.start_row;
+  VTermRect r0 = rect_union(m->dest, m->src), r1 = rect_union(dest, src);
+  if (m->dest.start_col != m->src.start_col ||
+      dest.start_col != src.start_col ||
+      memcmp(&r0, &r1, sizeof(r0)) != 0 || (d0 < 0) != (d1 < 0))
+    return 0;
+  int d = d0 + d1, h = r0.end_row - r0.start_row;
+  if (d <= -h || d >= h) {
+    /* Everything scrolled out: the region is repainted outright. */
+    pane->num_moves--;
+    dirty_add(&pane->dirty, r0);
+    return 1;
+  }
+  m->dest = m->src = r0;
+  if (d < 0) {
+    m->dest.end_row += d;
+    m->src.start_row -= d;
+  } else {
+    m->dest.start_row += d;
+    m->src.end_row -= d;
+  }
+  return 1;
+}
+
+/* Queues the pixel move. Damage not yet rendered is in post-move cell
+ * coordinates, but its stale pixels travel with the move, so the moved
+ * copies (and the cursor image) become dirty too. */
+static int pane_on_moverect(VTermRect dest, VTermRect src, void *user) {
+  PaneSession *pane = user;
+  if (pane->num_moves == MAX_PENDING_MOVES) {
+    dirty_add(&pane->dirty, dest);
+    return 1;
+  }
+  int drow = dest.start_row - src.start_row;
+  int dcol = dest.start_col - src.start_col;
+
+  VTermRect moved[MAX_DIRTY_RECTS];
+  int n = 0;
+  for (int i = 0; i < pane->dirty.count; i++) {
+    VTermRect r = rect_clip(pane->dirty.rects[i], src);
+    if (r.start_row < r.end_row && r.start_col < r.end_col)
+      moved[n++] = rect_shift(r, drow, dcol);
+  }
+  for (int i = 0; i < n; i++)
+    dirty_add(&pane->dirty, moved[i]);
+
+  VTermPos *cur = &pane->cursor_drawn;
+  if (cur->row >= src.start_row && cur->row < src.end_row &&
+      cur->col >= src.start_col && cur->col < src.end_col) {
+    cur->row += drow;
+    cur->col += dcol;
+    dirty_add(&pane->dirty,
+              (VTermRect){cur->row, cur->row + 1, cur->col, cur->col + 1});
+  }
 
-static const char *font_fallbacks[] = {
-    "/usr/share/fonts/TTF/JetBrainsMonoNerdFont-Regular.ttf",
-    "/usr/share/fonts/truetype/jetbrains-mono/JetBrainsMono-Regular.ttf",
-    "/usr/share/fonts/TTF/FiraCodeNerdFont-Regular.ttf",
-    "/usr/share/fonts/truetype/firacode/FiraCode-Regular.ttf",
-    "/usr/share/fonts/TTF/DejaVuSansMono.ttf",
-    "/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf",
-    "/usr/share/fonts/TTF/LiberationMono-Regular.ttf",
-    "/usr/share/fonts/truetype/liberation/LiberationMono-Regular.ttf",
-    NULL};
+  if (!pane_merge_move(pane, dest, src))
+    pane->moves[pane->num_moves++] = (PaneMove){dest, src};
+  return 1;
+}
 
-static int font_init(FontState *font, const AppConfig *cfg) {
-  memset(font, 0, sizeof(*font));
-  if (FT_Init_FreeType(&font->lib)) {
-    LOG_FATAL("FT init failed.\n");
-    return -1;
-  }
+static int pane_on_movecursor(VTermPos pos, VTermPos oldpos, int visible,
+                              void *user) {
+  (void)visible;
+  PaneSession *pane = user;
+  dirty_add(&pane->dirty,
+            (VTermRect){oldpos.row, oldpos.row + 1, oldpos.col, oldpos.col + 1});
+  dirty_add(&pane->dirty,
+            (VTermRect){pos.row, pos.row + 1, pos.col, pos.col + 1});
+  return 1;
+}
 
-  const char *found = NULL;
-  for (int i = 0; font_fallbacks[i]; i++) {
-    if (access(font_fallbacks[i], F_OK) == 0) {
-      found = font_fallbacks[i];
+/* OSC 4 ("idx;spec;...") sets and OSC 104 ("idx;..." or nothing)
+ * resets palette entries; the pane's lookup table is rebuilt and every
+ * cell repainted. Queries ("?") are not answered. */
+static void pane_apply_palette_osc(PaneSession *pane, int command,
+                                   char *args) {
+  VTermState *state = vterm_obtain_state(pane->vt);
+  char *save = NULL;
+  if (command == 104 && !*args)
+    for (int i = 0; i < 256; i++)
+      vterm_state_set_palette_color(state, i, &g_palette_default[i]);
+  for (char *tok = strtok_r(args, ";", &save); tok;
+       tok = strtok_r(NULL, ";", &save)) {
+    int idx = atoi(tok);
+    if (idx < 0 || idx > 255)
       break;
+    if (command == 104) {
+      vterm_state_set_palette_color(state, idx, &g_palette_default[idx]);
+      continue;
     }
+    char *spec = strtok_r(NULL, ";", &save);
+    uint8_t rgb[3];
+    if (!spec)
+      break;
+    if (parse_color_spec(spec, rgb) < 0)
+      continue;
+    VTermColor c;
+    vterm_color_rgb(&c, rgb[0], rgb[1], rgb[2]);
+    vterm_state_set_palette_color(state, idx, &c);
   }
-  if (!found) {
-    LOG_FATAL("No monospace font found. Install one of:\n"
-              "  ttf-jetbrains-mono-nerd  (Arch)\n"
-              "  fonts-jetbrains-mono     (Debian/Ubuntu)\n"
-              "  ttf-fira-code            (Arch)\n"
-              "  ttf-dejavu               / fonts-dejavu-core\n"
-              "  ttf-liberation           / fonts-liberation\n");
-    FT_Done_FreeType(font->lib);
-    font->lib = NULL;
-    return -1;
-  }
+  pane_palette_build(pane);
+  int rows, cols;
+  vterm_get_size(pane->vt, &rows, &cols);
+  dirty_add(&pane->dirty, (VTermRect){0, rows, 0, cols});
+}
 
-  if (FT_New_Face(font->lib, found, 0, &font->face)) {
-    LOG_FATAL("FT_New_Face: %s\n", found);
-    FT_Done_FreeType(font->lib);
-    font->lib = NULL;
-    return -1;
-  }
-  FT_Set_Pixel_Sizes(font->face, 0, cfg->font_size);
-  if (FT_Load_Char(font->face, 'M', FT_LOAD_DEFAULT)) {
-    LOG_FATAL("FT_Load_Char('M') failed.\n");
-    FT_Done_Face(font->face);
-    FT_Done_FreeType(font->lib);
-    font->face = NULL;
-    font->lib = NULL;
-    return -1;
-  }
-  font->cell_w = (int)(font->face->glyph->advance.x >> 6);
-  font->cell_h = (int)(font->face->size->metrics.height >> 6);
-  font->ascender = (int)(font->face->size->metrics.ascender >> 6);
-  if (font->cell_w <= 0 || font->cell_h <= 0) {
-    LOG_FATAL("Bad metrics: %dx%d\n", font->cell_w, font->cell_h);
-    FT_Done_Face(font->face);
-    FT_Done_FreeType(font->lib);
-    font->face = NULL;
-    font->lib = NULL;
-    return -1;
+static int pane_on_osc(int command, VTermStringFragment frag, void *user) {
+  if (command != 4 && command != 104)
+    return 0;
+  PaneSession *pane = user;
+  if (frag.initial)
+    pane->osc_len = 0;
+  size_t room = sizeof(pane->osc_buf) - 1 - pane->osc_len;
+  size_t n = frag.len < room ? frag.len : room;
+  memcpy(pane->osc_buf + pane->osc_len, frag.str, n);
+  pane->osc_len += n;
+  if (frag.final) {
+    /* An overlong payload loses its cut-off last entry. */
+    if (n < frag.len) {
+      char *semi = memrchr(pane->osc_buf, ';', pane->osc_len);
+      pane->osc_len = semi ? (size_t)(semi - pane->osc_buf) : 0;
+    }
+    pane->osc_buf[pane->osc_len] = '\0';
+    pane_apply_palette_osc(pane, command, pane->osc_buf);
+    pane->osc_len = 0;
   }
-  LOG_INFO("Font: %s @ %dpx cell %dx%d (asc=%d)\n", found, cfg->font_size,
-           font->cell_w, font->cell_h, font->ascender);
-  return 0;
+  return 1;
 }
 
+static const VTermStateFallbacks pane_state_fallbacks = {
+    .osc = pane_on_osc,
+};
+
+static const VTermScreenCallbacks pane_screen_cbs = {
+    .damage = pane_on_damage,
+    .moverect = pane_on_moverect,
+    .movecursor = pane_on_movecursor,
+    .sb_pushline = pane_sb_pushline,
+    .sb_popline = pane_sb_popline,
+};
+
 /* -- Tab / Pane Session ------------------------------------------- */
 
-static int pane_spawn(PaneSession *pane, int rows, int cols, int start_col_px,
-                      const HardwareState *hw, const AppConfig *cfg) {
-  memset(pane, 0, sizeof(*pane));
-  pane->master_fd = -1;
-  pane->child_pid = -1;
+/* Sets up a pane's libvterm screen without a PTY behind it. Panes come
+ * zeroed from pane_alloc(); node_layout() positions them. */
+static int pane_vterm_init(PaneSession *pane, int rows, int cols,
+                           const AppConfig *cfg) {
   pane->term_cols = cols;
-  pane->start_col = start_col_px;
+  pane->term_rows = rows;
 
   pane->vt = vterm_new(rows, cols);
   if (!pane->vt) {
@@ -645,333 +4512,997 @@ static int pane_spawn(PaneSession *pane, int rows, int cols, int start_col_px,
   vterm_color_rgb(&def_bg, (cfg->default_bg >> 16) & 0xFF,
                   (cfg->default_bg >> 8) & 0xFF, cfg->default_bg & 0xFF);
   vterm_state_set_default_colors(vtstate, &def_fg, &def_bg);
+  vterm_state_set_unrecognised_fallbacks(vtstate, &pane_state_fallbacks, pane);
+  pane_palette_build(pane);
 
   pane->vtscreen = vterm_obtain_screen(pane->vt);
+  vterm_screen_set_callbacks(pane->vtscreen, &pane_screen_cbs, pane);
+  /* Row merging hands DirtyList one rect per changed row span; SCROLL
+   * merging would fold a whole flush into one bounding box. Scrolls
+   * still arrive through moverect. */
+  vterm_screen_set_damage_merge(pane->vtscreen, VTERM_DAMAGE_ROW);
   vterm_screen_reset(pane->vtscreen, 1);
+  return 0;
+}
+
+/* Forks a shell on a new PTY; returns its PID, or -1. */
+static pid_t shell_fork(int *master_fd, const struct winsize *ws) {
+  pid_t pid = forkpty(master_fd, NULL, NULL, ws);
+  if (pid < 0) {
+    LOG_FATAL("forkpty failed.\n");
+    return -1;
+  }
+  if (pid == 0) {
+    execlp("/bin/bash", "bash", (char *)NULL);
+    _exit(EXIT_FAILURE);
+  }
+  int flags = fcntl(*master_fd, F_GETFL);
+  if (flags >= 0)
+    fcntl(*master_fd, F_SETFL, flags | O_NONBLOCK);
+  return pid;
+}
+
+/* The first shell is forked before DRM and the font are up, sized from
+ * the startup cache, so it is already printing its prompt by the time
+ * the first pane adopts it. Until then its output waits in the PTY. */
+static struct {
+  pid_t pid;
+  int master_fd;
+} g_early_shell = {.pid = -1, .master_fd = -1};
+
+/* The cell size is the cached one too, so that the winsize matches
+ * pane_spawn()'s down to the pixel fields. */
+static void early_shell_start(int cols, int rows, int cell_w, int cell_h) {
+  struct winsize ws = {.ws_row = (unsigned short)rows,
+                       .ws_col = (unsigned short)cols,
+                       .ws_xpixel = (unsigned short)(cols * cell_w),
+                       .ws_ypixel = (unsigned short)(rows * cell_h)};
+  g_early_shell.pid = shell_fork(&g_early_shell.master_fd, &ws);
+  if (g_early_shell.pid > 0)
+    LOG_INFO("Early shell forked (PID %d) at %dx%d.\n", g_early_shell.pid,
+             cols, rows);
+}
+
+static int pane_spawn(PaneSession *pane, int rows, int cols,
+                      const HardwareState *hw, const AppConfig *cfg) {
+  if (pane_vterm_init(pane, rows, cols, cfg) < 0)
+    return -1;
 
-  int cw = hw->font.cell_w;
+  int cw = hw->font->cell_w;
   struct winsize ws = {
       .ws_row = (unsigned short)rows,
       .ws_col = (unsigned short)cols,
       .ws_xpixel = (unsigned short)(cols * cw),
-      .ws_ypixel = (unsigned short)(rows * hw->font.cell_h),
+      .ws_ypixel = (unsigned short)(rows * hw->font->cell_h),
   };
 
-  pane->child_pid = forkpty(&pane->master_fd, NULL, NULL, &ws);
+  if (g_early_shell.pid > 0) {
+    /* The kernel compares the whole winsize, pixels included: when
+     * the cached grid and cell size were right this is a no-op and the
+     * shell gets no SIGWINCH. */
+    pane->child_pid = g_early_shell.pid;
+    pane->master_fd = g_early_shell.master_fd;
+    g_early_shell.pid = g_early_shell.master_fd = -1;
+    if (ioctl(pane->master_fd, TIOCSWINSZ, &ws) < 0)
+      LOG_WARN("TIOCSWINSZ on pane %d failed: %s\n", pane->slot,
+               strerror(errno));
+  } else {
+    pane->child_pid = shell_fork(&pane->master_fd, &ws);
+  }
   if (pane->child_pid < 0) {
-    LOG_FATAL("forkpty failed.\n");
     vterm_free(pane->vt);
     pane->vt = NULL;
     pane->vtscreen = NULL;
     return -1;
   }
-  if (pane->child_pid == 0) {
-    execlp("/bin/bash", "bash", (char *)NULL);
-    _exit(EXIT_FAILURE);
-  }
 
-  int flags = fcntl(pane->master_fd, F_GETFL);
-  if (flags >= 0)
-    fcntl(pane->master_fd, F_SETFL, flags | O_NONBLOCK);
+  /* Registered once, here; pane_on_exit() removes it again. */
+  if (!g_io.running || io_attach(&g_io, pane->slot, pane, cfg) < 0)
+    pane_set_polled(pane, 1);
 
-  LOG_INFO("Pane spawned (PID %d), master_fd=%d, cols=%d, start_col=%dpx.\n",
-           pane->child_pid, pane->master_fd, cols, start_col_px);
+  LOG_INFO("Pane %d spawned (PID %d), master_fd=%d, %dx%d.\n", pane->slot,
+           pane->child_pid, pane->master_fd, cols, rows);
   return 0;
 }
 
+/* Cells on screen below the tab bar. */
+static void grid_size(const HardwareState *hw, int *cols, int *rows) {
+  *cols = (int)hw->drm.width / hw->font->cell_w;
+  *rows = ((int)hw->drm.height / hw->font->cell_h) - 1;
+}
+
 static int tab_session_init(TabSession *tab, const HardwareState *hw,
                             const AppConfig *cfg) {
   memset(tab, 0, sizeof(*tab));
 
-  int total_cols = (int)hw->drm.width / hw->font.cell_w;
-  int rows = ((int)hw->drm.height / hw->font.cell_h) - 1;
+  int total_cols, rows;
+  grid_size(hw, &total_cols, &rows);
 
   if (total_cols < 1 || rows < 1) {
     LOG_FATAL("Grid too small: %dx%d\n", total_cols, rows);
     return -1;
   }
 
-  tab->term_rows = rows;
-  tab->num_panes = 1;
-  tab->active_pane = 0;
-
   LOG_INFO("Grid: %d cols x %d rows\n", total_cols, rows);
 
-  if (pane_spawn(&tab->panes[0], rows, total_cols, 0, hw, cfg) < 0)
+  PaneSession *pane = pane_alloc();
+  if (!pane)
     return -1;
-
-  tab->active = 1;
+  if (pane_spawn(pane, rows, total_cols, hw, cfg) < 0) {
+    pane_release(pane);
+    return -1;
+  }
+  if (node_init_root(tab, pane) < 0) {
+    io_detach(&g_io, pane->slot);
+    pane_set_polled(pane, 0);
+    pane_release(pane);
+    return -1;
+  }
+  node_layout(tab->root, 0, 0, total_cols, rows, hw);
   return 0;
 }
 
-static int split_pane_vertical(TabSession *tab, const HardwareState *hw,
-                               const AppConfig *cfg) {
-  if (tab->num_panes >= MAX_PANES) {
-    LOG_WARN("Already at max panes (%d).\n", MAX_PANES);
+static Output *tab_output(const TabSession *tab) {
+  return &g_app.outputs[tab->output];
+}
+
+static int tab_shown(const TabSession *tab) {
+  return tab_output(tab)->tab == tab;
+}
+
+static int tab_index(const TabSession *tab) {
+  int i = 0;
+  while (g_app.tabs[i] != tab)
+    i++;
+  return i;
+}
+
+/* The next (dir 1) or previous (dir -1) tab on the same output,
+ * wrapping around; tab itself when it is the only one there. */
+static TabSession *tab_step(const TabSession *tab, int dir) {
+  int i = tab_index(tab), n = g_app.num_tabs;
+  for (int k = 1; k < n; k++) {
+    TabSession *t = g_app.tabs[((i + dir * k) % n + n) % n];
+    if (t->output == tab->output)
+      return t;
+  }
+  return (TabSession *)tab;
+}
+
+/* Asks for a frame on out; now skips the frame interval. */
+static void output_damage(Output *out, int full, int now) {
+  out->need_render = 1;
+  out->full_redraw |= full;
+  out->render_now |= now;
+}
+
+static void outputs_damage_all(int full, int now) {
+  for (int o = 0; o < g_app.num_outputs; o++)
+    output_damage(&g_app.outputs[o], full, now);
+}
+
+/* Opens a tab on out, at the end of the tab list. */
+static TabSession *tab_open(Output *out, const AppConfig *cfg) {
+  if (g_app.num_tabs == g_app.tabs_cap) {
+    int cap = g_app.tabs_cap ? g_app.tabs_cap * 2 : 8;
+    TabSession **grown = realloc(g_app.tabs, (size_t)cap * sizeof(*grown));
+    if (!grown)
+      return NULL;
+    g_app.tabs = grown;
+    g_app.tabs_cap = cap;
+  }
+  TabSession *tab = malloc(sizeof(*tab));
+  if (!tab || tab_session_init(tab, &out->hw, cfg) < 0) {
+    free(tab);
+    return NULL;
+  }
+  tab->output = (int)(out - g_app.outputs);
+  g_app.tabs[g_app.num_tabs++] = tab;
+  return tab;
+}
+
+/* Gives every tab of output o the output's grid. */
+static void output_layout(int o) {
+  HardwareState *hw = &g_app.outputs[o].hw;
+  int cols, rows;
+  grid_size(hw, &cols, &rows);
+  for (int i = 0; i < g_app.num_tabs; i++)
+    if (g_app.tabs[i]->output == o)
+      node_layout(g_app.tabs[i]->root, 0, 0, cols, rows, hw);
+}
+
+/* Starts driving a monitor that was plugged in, with a tab of its
+ * own. */
+static int output_add(const drmModeConnector *conn, uint32_t crtc_id) {
+  if (g_app.num_outputs == DRM_MAX_OUTPUTS)
+    return -1;
+  Output *out = &g_app.outputs[g_app.num_outputs];
+  const DrmState *first = &g_app.outputs[0].hw.drm;
+  memset(out, 0, sizeof(*out));
+  out->hw.font = &g_app.font;
+  if (drm_output_init(&out->hw.drm, g_app.drm_fd, first->card, conn, crtc_id,
+                      g_app.cfg.drm_buffers) < 0)
     return -1;
+  g_app.num_outputs++;
+  out->tab = tab_open(out, &g_app.cfg);
+  return 0;
+}
+
+/* Stops driving output o, whose monitor is gone. Its tabs move to the
+ * first output left, in their order, so no shell is lost. */
+static void output_remove(int o) {
+  Output *gone = &g_app.outputs[o];
+  TabSession *shown = gone->tab;
+  /* A monitor plugged in as this one went may have been given its
+   * CRTC; switching that off would leave the new one black. */
+  int reused = 0;
+  for (int i = 0; i < g_app.num_outputs; i++)
+    reused |= i != o && g_app.outputs[i].hw.drm.crtc_id == gone->hw.drm.crtc_id;
+  drm_output_destroy(&gone->hw.drm, reused ? -1 : 0);
+  memmove(gone, gone + 1, (size_t)(g_app.num_outputs - o - 1) * sizeof(*gone));
+  g_app.num_outputs--;
+  if (g_app.focus >= o && g_app.focus > 0)
+    g_app.focus--;
+  if (o == 0 && g_capture) {
+    g_app.outputs[0].hw.drm.capture = g_capture; /* follows the first */
+    g_capture->full = 1;
   }
 
-  int cw = hw->font.cell_w;
-  int old_cols = tab->panes[0].term_cols;
-  int left_cols = old_cols / 2;
-  int right_cols = old_cols - left_cols;
+  for (int i = 0; i < g_app.num_tabs; i++) {
+    TabSession *tab = g_app.tabs[i];
+    if (tab->output == o)
+      tab->output = 0;
+    else if (tab->output > o)
+      tab->output--;
+  }
+  if (!g_app.outputs[0].tab)
+    g_app.outputs[0].tab = shown;
+  output_layout(0);
+  LOG_INFO("Output %d gone, its tabs now on the first output.\n", o);
+}
 
-  if (left_cols < 2 || right_cols < 2) {
-    LOG_WARN("Not enough columns to split (%d).\n", old_cols);
+/* Set while a rescan waits for a flip in flight; the main loop holds
+ * back new frames and retries once the flip event is in. */
+static int g_rescan_wanted;
+static uint64_t g_rescan_since;
+
+/* How long a rescan waits for a flip event before it gives the flip
+ * up, as a monitor being pulled may never send one. */
+#define RESCAN_FLIP_WAIT_NS 100000000u
+
+/* Follows a hotplug or a mode change. Every output rescans its
+ * monitor; outputs whose monitor is gone are dropped (unless none
+ * would be left) and newly connected monitors get an output each.
+ * New grids go to every tab of an output in one pass, each pane
+ * reflowed once at most, and every output is redrawn in full. While
+ * a flip is in flight no framebuffer may be replaced, so the rescan is
+ * deferred rather than waited for; it never blocks. While the VT is
+ * away nothing is touched; taking it back rescans. Returns 1 when
+ * outputs or modes changed, 0 when not or deferred, -1 when nothing
+ * is connected. */
+static int display_rescan(void) {
+  if (!g_vt_active) {
+    g_rescan_wanted = 0;
+    return 0;
+  }
+  if (!g_app.num_outputs || g_app.outputs[0].hw.drm.offscreen)
+    return -1;
+  int flipping = 0;
+  for (int o = 0; o < g_app.num_outputs; o++)
+    flipping |= g_app.outputs[o].hw.drm.pending >= 0;
+  if (flipping) {
+    uint64_t now = now_ns();
+    if (!g_rescan_wanted)
+      g_rescan_since = now;
+    g_rescan_wanted = 1;
+    if (now - g_rescan_since < RESCAN_FLIP_WAIT_NS) {
+      for (int o = 0; o < g_app.num_outputs; o++)
+        g_app.outputs[o].hw.drm.queued = -1; /* redrawn in full anyway */
+      return 0;
+    }
+    LOG_WARN("Flip event overdue, rescanning without it.\n");
+    for (int o = 0; o < g_app.num_outputs; o++)
+      g_app.outputs[o].hw.drm.pending = -1;
+  }
+  g_rescan_wanted = 0;
+  drmModeRes *res = drmModeGetResources(g_app.drm_fd);
+  if (!res)
     return -1;
+
+  int changed = 0, gone[DRM_MAX_OUTPUTS] = {0};
+  for (int o = 0; o < g_app.num_outputs; o++) {
+    int rc = drm_output_rescan(&g_app.outputs[o].hw.drm);
+    gone[o] = rc < 0;
+    if (rc > 0) {
+      output_layout(o);
+      changed = 1;
+    }
   }
+  for (int o = g_app.num_outputs - 1; o >= 0; o--)
+    if (gone[o] && g_app.num_outputs > 1) {
+      output_remove(o);
+      memmove(&gone[o], &gone[o + 1],
+              (size_t)(DRM_MAX_OUTPUTS - o - 1) * sizeof(*gone));
+      changed = 1;
+    }
 
-  tab->panes[0].term_cols = left_cols;
-  vterm_set_size(tab->panes[0].vt, tab->term_rows, left_cols);
+  for (int i = 0; i < res->count_connectors; i++) {
+    drmModeConnector *conn = drmModeGetConnector(g_app.drm_fd,
+                                                 res->connectors[i]);
+    int driven = 0;
+    uint32_t taken = 0;
+    for (int o = 0; o < g_app.num_outputs; o++) {
+      const DrmState *drm = &g_app.outputs[o].hw.drm;
+      driven |= conn && drm->conn_id == conn->connector_id && !gone[o];
+      for (int c = 0; c < res->count_crtcs && c < 32; c++)
+        if (res->crtcs[c] == drm->crtc_id && !gone[o])
+          taken |= 1u << c;
+    }
+    if (drm_conn_usable(conn) && !driven) {
+      int c = drm_pick_crtc(g_app.drm_fd, res, conn, taken);
+      if (c >= 0 && output_add(conn, res->crtcs[c]) == 0) {
+        LOG_INFO("Output %d added.\n", g_app.num_outputs - 1);
+        changed = 1;
+      }
+    }
+    drmModeFreeConnector(conn);
+  }
+  drmModeFreeResources(res);
 
-  struct winsize ws = {
-      .ws_row = (unsigned short)tab->term_rows,
-      .ws_col = (unsigned short)left_cols,
-      .ws_xpixel = (unsigned short)(left_cols * cw),
-      .ws_ypixel = (unsigned short)(tab->term_rows * hw->font.cell_h),
-  };
-  if (ioctl(tab->panes[0].master_fd, TIOCSWINSZ, &ws) < 0)
-    LOG_WARN("TIOCSWINSZ on pane 0 failed: %s\n", strerror(errno));
-  LOG_INFO("Pane 0 resized to %d cols.\n", left_cols);
+  /* The last monitor went away and none came: keep its output as it
+   * was, for when one is plugged in again. */
+  if (gone[0] && g_app.num_outputs > 1) {
+    output_remove(0);
+    gone[0] = 0;
+  }
+  outputs_damage_all(1, 1);
+  if (gone[0]) {
+    LOG_WARN("No connected monitor, keeping %ux%u.\n",
+             g_app.outputs[0].hw.drm.width, g_app.outputs[0].hw.drm.height);
+    return -1;
+  }
+  return changed;
+}
 
-  int right_start_px = left_cols * cw;
-  if (pane_spawn(&tab->panes[1], tab->term_rows, right_cols, right_start_px, hw,
-                 cfg) < 0) {
-    tab->panes[0].term_cols = old_cols;
-    vterm_set_size(tab->panes[0].vt, tab->term_rows, old_cols);
-    ws.ws_col = (unsigned short)old_cols;
-    ws.ws_xpixel = (unsigned short)(old_cols * cw);
-    ioctl(tab->panes[0].master_fd, TIOCSWINSZ, &ws);
+/* Halves the tab's active pane, side by side (SPLIT_V) or stacked
+ * (SPLIT_H); a new shell gets the right or bottom half and the focus. */
+static int pane_split(TabSession *tab, int split, const HardwareState *hw,
+                      const AppConfig *cfg) {
+  PaneNode *leaf = tab->active_pane->node;
+  int extent = split == SPLIT_V ? leaf->cols : leaf->rows;
+  int first = extent / 2, second = extent - first;
+
+  if (first < 2 || second < 2) {
+    LOG_WARN("Not enough %s to split (%d).\n",
+             split == SPLIT_V ? "columns" : "rows", extent);
     return -1;
   }
 
-  tab->num_panes = 2;
-  tab->active_pane = 1;
-  LOG_INFO("Vertical split: pane0=%dcols, pane1=%dcols.\n", left_cols,
-           right_cols);
+  PaneSession *pane = pane_alloc();
+  if (!pane)
+    return -1;
+  int cols = split == SPLIT_V ? second : leaf->cols;
+  int rows = split == SPLIT_H ? second : leaf->rows;
+  if (pane_spawn(pane, rows, cols, hw, cfg) < 0) {
+    pane_release(pane);
+    return -1;
+  }
+  if (node_split(tab, leaf, split, pane, hw) < 0) {
+    LOG_WARN("Pane layout allocation failed.\n");
+    io_detach(&g_io, pane->slot);
+    pane_set_polled(pane, 0);
+    pane_release(pane);
+    return -1;
+  }
+
+  tab->active_pane = pane;
+  LOG_INFO("%s split: pane %d=%dx%d, pane %d=%dx%d.\n",
+           split == SPLIT_V ? "Vertical" : "Horizontal", leaf->pane->slot,
+           leaf->cols, leaf->rows, pane->slot, cols, rows);
   return 0;
 }
 
-/* -- Glyph Blitting & Rendering ----------------------------------- */
+/* -- Pane Output -------------------------------------------------- */
 
-static void draw_glyph(const FT_Bitmap *bmp, uint8_t *fb, uint32_t stride,
-                       uint32_t scr_w, uint32_t scr_h, int pen_x, int pen_y,
-                       uint32_t fg_color, uint32_t bg_color) {
-  uint8_t fg_r = (fg_color >> 16) & 0xFF, fg_g = (fg_color >> 8) & 0xFF,
-          fg_b = fg_color & 0xFF;
-  uint8_t bg_r = (bg_color >> 16) & 0xFF, bg_g = (bg_color >> 8) & 0xFF,
-          bg_b = bg_color & 0xFF;
-  for (unsigned row = 0; row < bmp->rows; row++) {
-    int sy = pen_y + (int)row;
-    if (sy < 0 || (uint32_t)sy >= scr_h)
-      continue;
-    uint32_t *fb_row = (uint32_t *)(fb + (uint32_t)sy * stride);
-    for (unsigned col = 0; col < bmp->width; col++) {
-      int sx = pen_x + (int)col;
-      if (sx < 0 || (uint32_t)sx >= scr_w)
-        continue;
-      uint8_t a = bmp->buffer[row * (unsigned)bmp->pitch + col];
-      if (a == 0)
-        continue;
-      fb_row[sx] = rgb_pack((uint8_t)((fg_r * a + bg_r * (255 - a)) / 255),
-                            (uint8_t)((fg_g * a + bg_g * (255 - a)) / 255),
-                            (uint8_t)((fg_b * a + bg_b * (255 - a)) / 255));
-    }
+/* Whether a pane can take more PTY output right now. Background panes
+ * stop being polled once their backlog ring is full, which leaves the
+ * data in the kernel and backpressures the child. */
+static int pane_wants_input(const PaneSession *pane) {
+  return pane->input.cap == 0 || ring_len(&pane->input) < pane->input.cap;
+}
+
+/* After a pane's ring shrank: restarts reading a PTY that was left
+ * alone, by the I/O thread or the main loop, while the ring was full. */
+static void pane_resume_input(PaneSession *pane) {
+  if (io_attached(&g_io, pane->slot))
+    io_consumed(&g_io, pane->slot);
+  else if (!pane->polled && pane_wants_input(pane))
+    pane_set_polled(pane, 1);
+}
+
+/* Feeds libvterm, timing it for --stats. */
+static void pane_parse(PaneSession *pane, const char *buf, size_t n) {
+  uint64_t t0 = now_ns();
+  vterm_input_write(pane->vt, buf, n);
+  pane->parse_ns += now_ns() - t0;
+  pane->parsed += n;
+}
+
+/* Parses up to max bytes of a pane's backlog. Returns bytes parsed. */
+static size_t pane_parse_backlog(PaneSession *pane, size_t max) {
+  size_t done = 0;
+  while (done < max && ring_len(&pane->input) > 0) {
+    size_t n;
+    const char *span = ring_read_span(&pane->input, &n);
+    if (n > max - done)
+      n = max - done;
+    pane_parse(pane, span, n);
+    ring_consume(&pane->input, n);
+    done += n;
   }
+  if (done && pane->vtscreen)
+    vterm_screen_flush_damage(pane->vtscreen);
+  if (done)
+    pane_resume_input(pane);
+  return done;
 }
 
-static uint32_t vterm_color_to_rgb(VTermScreen *vts, VTermColor *c,
-                                   uint32_t fb) {
-  vterm_screen_convert_color_to_rgb(vts, c);
-  if (VTERM_COLOR_IS_RGB(c))
-    return rgb_pack(c->rgb.red, c->rgb.green, c->rgb.blue);
-  return fb;
+/* Brings every pane of a tab fully up to date, e.g. on becoming active. */
+static void tab_catch_up(TabSession *tab) {
+  for (PaneNode *n = node_first_leaf(tab->root); n; n = node_next_leaf(n))
+    pane_parse_backlog(n->pane, SIZE_MAX);
 }
 
-static void fill_cell_bg(uint8_t *fb, uint32_t stride, uint32_t sw, uint32_t sh,
-                         int x, int y, int w, int h, uint32_t color) {
-  for (int r = 0; r < h; r++) {
-    int sy = y + r;
-    if (sy < 0 || (uint32_t)sy >= sh)
-      continue;
-    uint32_t *row = (uint32_t *)(fb + (uint32_t)sy * stride);
-    for (int c = 0; c < w; c++) {
-      int sx = x + c;
-      if (sx >= 0 && (uint32_t)sx < sw)
-        row[sx] = color;
+/* Sizes the pane's read buffer to its recent output: doubled whenever a
+ * read fills it, halved after a run of mostly-empty reads. */
+static void pane_rbuf_adapt(PaneSession *pane, size_t last_read) {
+  size_t want = pane->rbuf_cap;
+  if (last_read == pane->rbuf_cap && want < PTY_RBUF_MAX) {
+    want *= 2;
+    pane->rbuf_idle = 0;
+  } else if (last_read < pane->rbuf_cap / 4 && want > PTY_RBUF_MIN) {
+    if (++pane->rbuf_idle >= PTY_RBUF_SHRINK_AFTER) {
+      want /= 2;
+      pane->rbuf_idle = 0;
     }
+  } else {
+    pane->rbuf_idle = 0;
+  }
+  if (want == pane->rbuf_cap)
+    return;
+  char *nb = realloc(pane->rbuf, want);
+  if (nb) {
+    pane->rbuf = nb;
+    pane->rbuf_cap = want;
   }
 }
 
-static void render_cell_bg(const HardwareState *hw, const AppConfig *cfg,
-                           VTermScreen *vts, int row, int col, int is_cursor,
-                           int px_offset) {
-  const DrmState *drm = &hw->drm;
-  int cw = hw->font.cell_w, ch = hw->font.cell_h;
-  VTermScreenCell cell;
-  VTermPos pos = {.row = row, .col = col};
-  vterm_screen_get_cell(vts, pos, &cell);
+/* Reads a pane's PTY until EAGAIN or until pty_read_budget_kb has been
+ * consumed this iteration, so one flooding pane cannot starve stdin,
+ * IPC or its siblings; leftover data keeps the fd readable for the next
+ * poll. In the foreground (or with lazy parsing off) output goes
+ * straight to libvterm, after any backlog; in the background it is only
+ * queued. Returns bytes read, or -1 once the PTY hit EOF/EIO. */
+static ssize_t pane_read_output(PaneSession *pane, int foreground,
+                                const AppConfig *cfg) {
+  ssize_t total = 0;
+  size_t budget = cfg->pty_read_budget_kb > 0
+                      ? (size_t)cfg->pty_read_budget_kb * 1024
+                      : SIZE_MAX;
+  if (foreground && ring_len(&pane->input))
+    pane_parse_backlog(pane, SIZE_MAX);
+  if (!foreground && !pane->input.cap &&
+      (cfg->bg_ring_kb <= 0 ||
+       ring_alloc(&pane->input, (size_t)cfg->bg_ring_kb * 1024) < 0))
+    foreground = 1;
+  if (foreground && !pane->rbuf) {
+    pane->rbuf = malloc(PTY_RBUF_MIN);
+    if (!pane->rbuf)
+      return 0;
+    pane->rbuf_cap = PTY_RBUF_MIN;
+    pane->rbuf_idle = 0;
+  }
 
-  if (cell.width == 0)
-    return;
+  while ((size_t)total < budget) {
+    char *dst = pane->rbuf;
+    size_t room = pane->rbuf_cap;
+    if (!foreground) {
+      dst = ring_write_span(&pane->input, &room);
+      if (room == 0)
+        break;
+    }
+    if (room > budget - (size_t)total)
+      room = budget - (size_t)total;
+    ssize_t n = read(pane->master_fd, dst, room);
+    if (n > 0) {
+      if (foreground) {
+        pane_parse(pane, dst, (size_t)n);
+        pane_rbuf_adapt(pane, (size_t)n);
+      } else {
+        ring_commit(&pane->input, (size_t)n);
+      }
+      total += n;
+      continue;
+    }
+    if (n == 0 || (n < 0 && errno == EIO))
+      return -1;
+    if (errno == EINTR)
+      continue;
+    break;
+  }
+  if (foreground && total && pane->vtscreen)
+    vterm_screen_flush_damage(pane->vtscreen);
+  return total;
+}
 
-  int px = px_offset + col * cw, py = row * ch;
-  uint32_t bg = vterm_color_to_rgb(vts, &cell.bg, cfg->default_bg);
-  uint32_t fg = vterm_color_to_rgb(vts, &cell.fg, cfg->default_fg);
-  if (cell.attrs.reverse) {
-    uint32_t t = bg;
-    bg = fg;
-    fg = t;
+/* Drops a tab whose last pane is gone. If its output showed it, the
+ * output goes on to its next tab, or the one before at the end of the
+ * list, or to none. Sets g_shutdown when no tab is left anywhere. */
+static void tab_close(TabSession *tab) {
+  Output *out = tab_output(tab);
+  int i = tab_index(tab), shown = out->tab == tab;
+  TabSession *next = NULL;
+  for (int j = i + 1; j < g_app.num_tabs && !next; j++)
+    if (g_app.tabs[j]->output == tab->output)
+      next = g_app.tabs[j];
+  for (int j = i - 1; j >= 0 && !next; j--)
+    if (g_app.tabs[j]->output == tab->output)
+      next = g_app.tabs[j];
+  memmove(&g_app.tabs[i], &g_app.tabs[i + 1],
+          (size_t)(g_app.num_tabs - i - 1) * sizeof(*g_app.tabs));
+  g_app.num_tabs--;
+  free(tab);
+  LOG_INFO("Tab %d closed.\n", i);
+  if (!g_app.num_tabs) {
+    g_shutdown = 1;
+    return;
   }
-  if (is_cursor)
-    bg = cfg->cursor_bg;
+  if (shown) {
+    out->tab = next;
+    if (next)
+      tab_catch_up(next);
+  }
+}
 
-  int full_px_w = cell.width * cw;
-  fill_cell_bg(drm->back_buffer, drm->stride, drm->width, drm->height, px, py,
-               full_px_w, ch, bg);
+/* A pane's shell exited: releases its PTY and the pane, whose sibling
+ * takes over its space, and the tab along with its last pane. */
+static void pane_on_exit(PaneSession *pane) {
+  TabSession *tab = pane->tab;
+  LOG_INFO("Pane %d shell exited.\n", pane->slot);
+  io_detach(&g_io, pane->slot);
+  pane_set_polled(pane, 0);
+  node_remove(tab, pane, &tab_output(tab)->hw);
+  pane_release(pane);
+  if (!tab->root)
+    tab_close(tab);
 }
 
-static void render_cell_fg(const HardwareState *hw, const AppConfig *cfg,
-                           VTermScreen *vts, int row, int col, int is_cursor,
-                           int px_offset) {
-  const DrmState *drm = &hw->drm;
-  int cw = hw->font.cell_w, ch = hw->font.cell_h, asc = hw->font.ascender;
-  VTermScreenCell cell;
-  VTermPos pos = {.row = row, .col = col};
-  vterm_screen_get_cell(vts, pos, &cell);
+/* Passes held-back keystrokes on as the output ring drains. */
+static void pane_flush_tx(PaneSession *pane) {
+  size_t n = io_write(&g_io, pane->slot, pane->tx_pend, pane->tx_pend_len);
+  pane->tx_pend_len -= n;
+  memmove(pane->tx_pend, pane->tx_pend + n, pane->tx_pend_len);
+}
 
-  if (cell.width == 0)
+/* Sends keystrokes to the pane's child. With the I/O thread, what its
+ * ring cannot take yet waits in tx_pend rather than stalling the loop,
+ * up to PTY_TX_PEND_MAX; beyond that input is dropped. */
+static void pane_write(PaneSession *pane, const char *buf, size_t len) {
+  if (!io_attached(&g_io, pane->slot)) {
+    write_all(pane->master_fd, buf, len);
     return;
-  if (cell.chars[0] == 0 || cell.chars[0] == ' ')
+  }
+  if (pane->tx_pend_len)
+    pane_flush_tx(pane);
+  if (!pane->tx_pend_len) {
+    size_t n = io_write(&g_io, pane->slot, buf, len);
+    buf += n;
+    len -= n;
+  }
+  if (len == 0)
     return;
+  size_t need = pane->tx_pend_len + len;
+  if (need > pane->tx_pend_cap) {
+    size_t cap = pane->tx_pend_cap ? pane->tx_pend_cap : IO_TX_RING_BYTES;
+    while (cap < need && cap < PTY_TX_PEND_MAX)
+      cap *= 2;
+    if (cap > PTY_TX_PEND_MAX)
+      cap = PTY_TX_PEND_MAX;
+    char *grown = cap > pane->tx_pend_cap ? realloc(pane->tx_pend, cap) : NULL;
+    if (grown) {
+      pane->tx_pend = grown;
+      pane->tx_pend_cap = cap;
+    }
+  }
+  size_t keep = pane->tx_pend_cap - pane->tx_pend_len;
+  if (keep > len)
+    keep = len;
+  if (keep < len)
+    LOG_WARN("Pane %d is not reading input, dropped %zu bytes.\n",
+             pane->slot, len - keep);
+  memcpy(pane->tx_pend + pane->tx_pend_len, buf, keep);
+  pane->tx_pend_len += keep;
+}
 
-  int px = px_offset + col * cw, py = row * ch;
-  uint32_t bg = vterm_color_to_rgb(vts, &cell.bg, cfg->default_bg);
-  uint32_t fg = vterm_color_to_rgb(vts, &cell.fg, cfg->default_fg);
-  if (cell.attrs.reverse) {
-    uint32_t t = bg;
-    bg = fg;
-    fg = t;
+/* Serves a pane the event loop flagged: parses what the I/O thread
+ * queued, or reads the PTY when the main loop polls it itself (only if
+ * readable). Background rings are left to the lazy parser. Returns
+ * bytes taken in, or -1 once the shell is gone. */
+static ssize_t pane_service(PaneSession *pane, int foreground, int readable,
+                            const AppConfig *cfg) {
+  if (io_attached(&g_io, pane->slot)) {
+    ssize_t n = 0;
+    if (pane->tx_pend_len)
+      pane_flush_tx(pane);
+    if (foreground && ring_len(&pane->input)) {
+      size_t budget = cfg->pty_read_budget_kb > 0
+                          ? (size_t)cfg->pty_read_budget_kb * 1024
+                          : SIZE_MAX;
+      n = (ssize_t)pane_parse_backlog(pane, budget);
+    }
+    return atomic_load(&io_slot(&g_io, pane->slot)->eof) ? -1 : n;
   }
-  if (is_cursor) {
-    bg = cfg->cursor_bg;
-    fg = cfg->cursor_fg;
+  if (!readable)
+    return 0;
+  ssize_t n = pane_read_output(pane, foreground, cfg);
+  if (n >= 0 && !pane_wants_input(pane))
+    pane_set_polled(pane, 0);
+  return n;
+}
+
+/* -- Glyph Blitting & Rendering ----------------------------------- */
+
+/* Solid fill into the render target. Off-screen dumb buffers are
+ * write-combined, so long spans there use streaming stores. */
+static void fill_cell_bg(const DrmState *drm, int x, int y, int w, int h,
+                         uint32_t color) {
+  blit_fill(drm->back_buffer, drm->stride, drm->width, drm->height, x, y, w, h,
+            color, drm->num_bufs > 1);
+}
+
+/* -- Row Snapshots ------------------------------------------------ */
+
+static void snapshot_row(const AppConfig *cfg, const PaneSession *pane,
+                         int row, int c0, int c1, int cursor_col,
+                         RowCell *out) {
+  for (int c = c0; c < c1; c++, out++) {
+    VTermScreenCell cell;
+    vterm_screen_get_cell(pane->vtscreen, (VTermPos){.row = row, .col = c},
+                          &cell);
+    /* The right half of a wide char is painted by its left half; a
+     * half at the rect's left edge must keep the glyph already there. */
+    out->width = cell.chars[0] == (uint32_t)-1 ? 0 : (uint8_t)cell.width;
+    if (out->width == 0)
+      continue;
+
+    uint32_t cp = cell.chars[0];
+    out->cp = (cp == ' ' || cp > 0x10FFFF) ? 0 : cp;
+    out->attrs = (uint8_t)((cell.attrs.bold ? CELL_BOLD : 0) |
+                           (cell.attrs.italic ? CELL_ITALIC : 0) |
+                           (cell.attrs.underline ? CELL_UNDERLINE : 0));
+
+    pane_cell_colors(pane, cfg, &cell, c == cursor_col, &out->fg, &out->bg);
   }
+}
 
-  FontState *font = (FontState *)&hw->font;
-  if (FT_Load_Char(font->face, cell.chars[0], FT_LOAD_RENDER))
-    return;
-  FT_GlyphSlot g = font->face->glyph;
+/* Background pass: neighbouring cells sharing a color become one fill. */
+static void render_row_bg(const HardwareState *hw, const RowCell *cells,
+                          int c0, int c1, int px_off, int py) {
+  int cw = hw->font->cell_w, ch = hw->font->cell_h;
+  int c = c0;
+  while (c < c1) {
+    if (cells[c - c0].width == 0) {
+      c++;
+      continue;
+    }
+    uint32_t bg = cells[c - c0].bg;
+    int x0 = c * cw, x1 = (c + cells[c - c0].width) * cw;
+    for (c++; c < c1; c++) {
+      const RowCell *rc = &cells[c - c0];
+      if (rc->width == 0)
+        continue;
+      if (rc->bg != bg)
+        break;
+      int end = (c + rc->width) * cw;
+      if (end > x1)
+        x1 = end;
+    }
+    fill_cell_bg(&hw->drm, px_off + x0, py, x1 - x0, ch, bg);
+  }
+}
 
-  int full_px_w = cell.width * cw;
-  int advance_px = (int)(g->advance.x >> 6);
-  int x_offset = (full_px_w - advance_px) / 2;
-  if (x_offset < 0)
-    x_offset = 0;
+/* Foreground pass, clipped to the pixel rect clip. */
+static void render_row_fg(HardwareState *hw, const RowCell *cells, int c0,
+                          int c1, int px_off, int py, PixelRect clip) {
+  const DrmState *drm = &hw->drm;
+  FontState *font = hw->font;
+  int cw = font->cell_w, asc = font->ascender;
+  uint8_t *fb = drm->back_buffer + (size_t)clip.y * drm->stride +
+                (size_t)clip.x * 4;
+  uint32_t fb_w = (uint32_t)clip.w, fb_h = (uint32_t)clip.h;
+  for (int c = c0; c < c1; c++) {
+    const RowCell *rc = &cells[c - c0];
+    if (rc->width == 0 || rc->cp == 0)
+      continue;
+    const GlyphEntry *g = glyph_cache_get(font, rc->cp, CELL_STYLE(rc->attrs));
+    if (g->width == 0)
+      continue;
 
-  draw_glyph(&g->bitmap, drm->back_buffer, drm->stride, drm->width, drm->height,
-             px + x_offset + g->bitmap_left, py + asc - g->bitmap_top, fg, bg);
+    int full_px_w = rc->width * cw;
+    int x_offset = (full_px_w - g->advance) / 2;
+    if (x_offset < 0)
+      x_offset = 0;
+
+    int gx = px_off + c * cw + x_offset + g->left - clip.x;
+    int gy = py + asc - g->top - clip.y;
+    const uint32_t *pre =
+        blend_cache_get(&font->blend, &font->cache, g, rc->fg, rc->bg);
+    if (pre)
+      blit_copy_glyph(pre, g->width, g->rows, fb, drm->stride, fb_w, fb_h, gx,
+                      gy);
+    else
+      blit_glyph(glyph_bitmap(&font->cache, g), g->width, g->rows,
+                 (int)font->cache.slot_w, fb, drm->stride, fb_w, fb_h, gx, gy,
+                 rc->fg, rc->bg);
+  }
 }
 
 /* -- Tab Bar ------------------------------------------------------ */
 
 static void draw_ui_string(const HardwareState *hw, int px, int py,
                            const char *str, uint32_t fg, uint32_t bg) {
-  FontState *font = (FontState *)&hw->font;
+  FontState *font = hw->font;
   const DrmState *drm = &hw->drm;
   int pen_x = px;
 
   for (size_t i = 0; str[i] != '\0'; i++) {
-    if (FT_Load_Char(font->face, (FT_ULong)str[i], FT_LOAD_RENDER))
-      continue;
-    FT_GlyphSlot g = font->face->glyph;
-    int gx = pen_x + g->bitmap_left;
-    int gy = py + hw->font.ascender - g->bitmap_top;
-    draw_glyph(&g->bitmap, drm->back_buffer, drm->stride, drm->width,
-               drm->height, gx, gy, fg, bg);
-    pen_x += (int)(g->advance.x >> 6);
+    const GlyphEntry *g = glyph_cache_get(font, (unsigned char)str[i], 0);
+    int gx = pen_x + g->left;
+    int gy = py + hw->font->ascender - g->top;
+    blit_glyph(glyph_bitmap(&font->cache, g), g->width, g->rows,
+               (int)font->cache.slot_w, drm->back_buffer, drm->stride,
+               drm->width, drm->height, gx, gy, fg, bg);
+    pen_x += g->advance;
   }
 }
 
-static void render_tab_bar(const AppCtx *ctx) {
-  const HardwareState *hw = &ctx->hw;
+/* An output's bar lists its own tabs. The one it shows is marked in
+ * the accent color on the focused output and in plain inverse on the
+ * others. */
+static void render_tab_bar(const AppCtx *ctx, const Output *out) {
+  const HardwareState *hw = &out->hw;
   const DrmState *drm = &hw->drm;
-  int cw = hw->font.cell_w, ch = hw->font.cell_h;
+  int cw = hw->font->cell_w, ch = hw->font->cell_h;
   int bar_y = (int)drm->height - ch;
+  int o = (int)(out - ctx->outputs), num = 0;
 
-  fill_cell_bg(drm->back_buffer, drm->stride, drm->width, drm->height, 0, bar_y,
-               (int)drm->width, ch, ctx->cfg.tabbar_bg);
+  fill_cell_bg(drm, 0, bar_y, (int)drm->width, ch, ctx->cfg.tabbar_bg);
 
   int pen_x = cw / 2;
   for (int i = 0; i < ctx->num_tabs; i++) {
+    if (ctx->tabs[i]->output != o)
+      continue;
     char label[16];
-    snprintf(label, sizeof(label), " %d ", i + 1);
+    snprintf(label, sizeof(label), " %d ", ++num);
 
     uint32_t fg, bg;
-    if (i == ctx->active_tab) {
+    if (ctx->tabs[i] == out->tab && o == ctx->focus) {
       fg = ctx->cfg.cursor_fg;
       bg = ctx->cfg.tabbar_active;
+    } else if (ctx->tabs[i] == out->tab) {
+      fg = ctx->cfg.tabbar_bg;
+      bg = ctx->cfg.tabbar_fg;
     } else {
       fg = ctx->cfg.tabbar_fg;
       bg = ctx->cfg.tabbar_bg;
     }
 
     int label_px_w = (int)strlen(label) * cw;
-    fill_cell_bg(drm->back_buffer, drm->stride, drm->width, drm->height, pen_x,
-                 bar_y, label_px_w, ch, bg);
+    fill_cell_bg(drm, pen_x, bar_y, label_px_w, ch, bg);
 
     draw_ui_string(hw, pen_x, bar_y, label, fg, bg);
     pen_x += label_px_w + cw / 2;
   }
 }
 
-/* Two-pass multi-pane renderer with shadow buffer swap. */
-static void render_screen(const HardwareState *hw, const TabSession *tab,
-                          const AppConfig *cfg) {
-  int rows = tab->term_rows;
+/* Two-pass render of one cell rectangle from a single snapshot. The
+ * rect is widened by one column on each side so wide glyphs and
+ * overhanging bitmaps that straddle the damage edge are repainted
+ * whole. */
+static void render_pane_rect(HardwareState *hw, const AppConfig *cfg,
+                             const PaneSession *pane, VTermRect rect,
+                             VTermPos cursor_pos, int show_cursor,
+                             int present) {
+  int cols = pane->term_cols;
+  int c0 = rect.start_col > 0 ? rect.start_col - 1 : 0;
+  int c1 = rect.end_col < cols ? rect.end_col + 1 : cols;
+  int ncols = c1 - c0, nrows = rect.end_row - rect.start_row;
+  int cw = hw->font->cell_w, ch = hw->font->cell_h;
+  if (ncols <= 0 || nrows <= 0)
+    return;
+
+  size_t need = (size_t)ncols * (size_t)nrows;
+  if (need > g_row_cells_cap) {
+    RowCell *grown = realloc(g_row_cells, need * sizeof(RowCell));
+    if (!grown) {
+      LOG_WARN("Row snapshot allocation failed (%zu cells).\n", need);
+      return;
+    }
+    g_row_cells = grown;
+    g_row_cells_cap = need;
+  }
+
+  for (int r = 0; r < nrows; r++) {
+    int row = rect.start_row + r;
+    RowCell *cells = &g_row_cells[(size_t)r * (size_t)ncols];
+    int view = pane->sb.view;
+    if (row < view) {
+      sb_unpack_row(sb_line_at(&pane->sb, pane->sb.count - (size_t)view +
+                                              (size_t)row),
+                    cfg, c0, c1, cells);
+    } else {
+      int cursor_col =
+          (show_cursor && row - view == cursor_pos.row) ? cursor_pos.col : -1;
+      snapshot_row(cfg, pane, row - view, c0, c1, cursor_col, cells);
+    }
+  }
+
+  /* Glyphs may overhang their cell but not the pane, so a neighbour
+   * never needs repainting after this one. */
+  PixelRect bounds = {pane->start_col, pane->start_row, pane->term_cols * cw,
+                      pane->term_rows * ch};
+  int top = pane->start_row + rect.start_row * ch;
+  for (int r = 0; r < nrows; r++)
+    render_row_bg(hw, &g_row_cells[(size_t)r * (size_t)ncols], c0, c1,
+                  pane->start_col, top + r * ch);
+  for (int r = 0; r < nrows; r++)
+    render_row_fg(hw, &g_row_cells[(size_t)r * (size_t)ncols], c0, c1,
+                  pane->start_col, top + r * ch, bounds);
+
+  if (present)
+    present_rect(&hw->drm, pane->start_col + c0 * cw, top, ncols * cw,
+                 nrows * ch);
+}
 
-  for (int p = 0; p < tab->num_panes; p++) {
-    const PaneSession *pane = &tab->panes[p];
-    if (!pane->vt)
+/* Replays queued scrolls as memmoves of the pane's pixels; the cells
+ * they expose are already in the dirty list. A pane with a neighbour
+ * below or to the right has a border over its last pixel row or
+ * column, and a move carries that into the cells it lands on, so those
+ * are queued for repainting as well. */
+static void pane_apply_moves(HardwareState *hw, PaneSession *pane) {
+  int cw = hw->font->cell_w, ch = hw->font->cell_h;
+  VTermRect bounds = {0, pane->term_rows, 0, pane->term_cols};
+  /* A page-flip back buffer is a dumb buffer, far too slow to read
+   * from: the moved cells are repainted instead. */
+  if (hw->drm.num_bufs > 1) {
+    for (int i = 0; i < pane->num_moves; i++)
+      dirty_add(&pane->dirty, rect_clip(pane->moves[i].dest, bounds));
+    return;
+  }
+  const PaneNode *n = pane->node, *root = pane->tab->root;
+  int border_below = n->row + n->rows < root->row + root->rows;
+  int border_right = n->col + n->cols < root->col + root->cols;
+  for (int i = 0; i < pane->num_moves; i++) {
+    VTermRect src = rect_clip(pane->moves[i].src, bounds);
+    VTermRect dest = rect_clip(pane->moves[i].dest, bounds);
+    if (src.end_row - src.start_row != dest.end_row - dest.start_row ||
+        src.end_col - src.start_col != dest.end_col - dest.start_col)
       continue;
+    PixelRect px = {pane->start_col + src.start_col * cw,
+                    pane->start_row + src.start_row * ch,
+                    (src.end_col - src.start_col) * cw,
+                    (src.end_row - src.start_row) * ch};
+    int dx = (dest.start_col - src.start_col) * cw;
+    int dy = (dest.start_row - src.start_row) * ch;
+    drm_move_rect(&hw->drm, px, dx, dy);
+    present_rect(&hw->drm, px.x + dx, px.y + dy, px.w, px.h);
+    if (border_below && dy && src.end_row == pane->term_rows)
+      dirty_add(&pane->dirty, (VTermRect){dest.end_row - 1, dest.end_row,
+                                          dest.start_col, dest.end_col});
+    if (border_right && dx && src.end_col == pane->term_cols)
+      dirty_add(&pane->dirty, (VTermRect){dest.start_row, dest.end_row,
+                                          dest.end_col - 1, dest.end_col});
+  }
+}
+
+/* Split borders over the first half's last pixel column or row.
+ * Partial redraws of that column or row would erase them, so they are
+ * repainted every frame. */
+static void render_borders(HardwareState *hw, const AppConfig *cfg,
+                           const PaneNode *n, int full) {
+  if (!n || n->pane)
+    return;
+  DrmState *drm = &hw->drm;
+  int cw = hw->font->cell_w, ch = hw->font->cell_h;
+  const PaneNode *second = n->child[1];
+  int x, y, w, h;
+  if (n->split == SPLIT_V) {
+    x = second->col * cw - 1;
+    y = n->row * ch;
+    w = 1;
+    h = n->rows * ch;
+  } else {
+    x = n->col * cw;
+    y = second->row * ch - 1;
+    w = n->cols * cw;
+    h = 1;
+  }
+  fill_cell_bg(drm, x, y, w, h, cfg->tabbar_fg);
+  if (!full)
+    present_rect(drm, x, y, w, h);
+  render_borders(hw, cfg, n->child[0], full);
+  render_borders(hw, cfg, second, full);
+}
+
+/* Multi-pane renderer for one output: walks the layout of the tab it
+ * shows, so the work follows the panes on screen. On a full redraw
+ * every cell, the borders and the tab bar are repainted; otherwise
+ * only each pane's damaged rects are. An output without a tab is
+ * cleared. drm_frame_end() then either copies the shadow buffer out
+ * or flips. */
+static void render_screen(Output *out, const AppConfig *cfg, int full) {
+  HardwareState *hw = &out->hw;
+  TabSession *tab = out->tab;
+  uint64_t t0 = now_ns();
+  full |= !tab;
+  drm_frame_begin(&hw->drm, full);
+
+  if (!tab)
+    fill_cell_bg(&hw->drm, 0, 0, (int)hw->drm.width, (int)hw->drm.height,
+                 cfg->default_bg);
+  for (PaneNode *n = tab ? node_first_leaf(tab->root) : NULL; n;
+       n = node_next_leaf(n)) {
+    PaneSession *pane = n->pane;
+    int rows = pane->term_rows;
 
-    int cols = pane->term_cols;
-    int px_off = pane->start_col;
     VTermPos cursor_pos;
     VTermState *vtstate = vterm_obtain_state(pane->vt);
     vterm_state_get_cursorpos(vtstate, &cursor_pos);
 
-    int is_active_pane = (p == tab->active_pane);
-
-    for (int r = 0; r < rows; r++)
-      for (int c = 0; c < cols; c++)
-        render_cell_bg(
-            hw, cfg, pane->vtscreen, r, c,
-            (is_active_pane && r == cursor_pos.row && c == cursor_pos.col),
-            px_off);
-
-    for (int r = 0; r < rows; r++)
-      for (int c = 0; c < cols; c++)
-        render_cell_fg(
-            hw, cfg, pane->vtscreen, r, c,
-            (is_active_pane && r == cursor_pos.row && c == cursor_pos.col),
-            px_off);
+    int is_active_pane = (pane == tab->active_pane);
+
+    if (full || pane->sb.view > 0) {
+      /* A scrolled-back view does not line up with libvterm's damage,
+       * so any change repaints the whole pane. */
+      VTermRect all = {0, rows, 0, pane->term_cols};
+      if (full || pane->dirty.count || pane->num_moves)
+        render_pane_rect(hw, cfg, pane, all, cursor_pos, is_active_pane,
+                         !full);
+      pane->cursor_drawn = is_active_pane && !pane->sb.view
+                               ? cursor_pos
+                               : (VTermPos){-1, 0};
+    } else {
+      pane_apply_moves(hw, pane);
+      for (int i = 0; i < pane->dirty.count; i++) {
+        VTermRect r = pane->dirty.rects[i];
+        render_pane_rect(hw, cfg, pane, r, cursor_pos, is_active_pane, 1);
+        if (is_active_pane && cursor_pos.row >= r.start_row &&
+            cursor_pos.row < r.end_row && cursor_pos.col >= r.start_col - 1 &&
+            cursor_pos.col <= r.end_col)
+          pane->cursor_drawn = cursor_pos;
+      }
+    }
+    pane->dirty.count = 0;
+    pane->num_moves = 0;
   }
 
-  if (tab->num_panes == 2) {
-    const DrmState *drm = &hw->drm;
-    int border_x = tab->panes[1].start_col;
-    if (border_x > 0)
-      border_x -= 1;
-    int border_h = rows * hw->font.cell_h;
-    fill_cell_bg(drm->back_buffer, drm->stride, drm->width, drm->height,
-                 border_x, 0, 1, border_h, cfg->tabbar_fg);
-  }
+  render_borders(hw, cfg, tab ? tab->root : NULL, full);
 
-  render_tab_bar(&g_app);
+  if (full)
+    render_tab_bar(&g_app, out);
 
-  /* Swap: copy completed frame to DRM framebuffer */
-  memcpy(hw->drm.framebuffer, hw->drm.back_buffer, hw->drm.size);
+  drm_frame_end(&hw->drm, full);
+
+  uint64_t ns = now_ns() - t0;
+  int b = 0;
+  for (uint64_t lim = STATS_HIST_FIRST_US * 1000u;
+       b < STATS_HIST_BUCKETS - 1 && ns >= lim; lim *= 2)
+    b++;
+  g_stats.frame_hist[b]++;
+  g_stats.frame_ns += ns;
+  g_stats.frames++;
+  g_stats.full_frames += full != 0;
+  out->frames++;
 }
 
 /* -- IPC ---------------------------------------------------------- */
@@ -985,14 +5516,24 @@ static void print_help(void) {
           "Usage:\n"
           "  sudo ./opalterm              Start the terminal (server mode)\n"
           "  ./opalterm <command>         Send IPC command to running server\n"
+          "  ./opalterm --bench [--offscreen[=WxH]] [--capture=PATH]\n"
+          "                               Run the render/throughput benchmark\n"
           "\n"
           "IPC Commands:\n"
           "  --new-tab, -nt                Open a new tab\n"
           "  --next,    -n                 Switch to the next tab\n"
           "  --prev,    -p                 Switch to the previous tab\n"
-          "  --split-v, -s                 Split active tab vertically\n"
-          "  --left,    -l                 Focus left pane\n"
-          "  --right,   -r                 Focus right pane\n"
+          "  --split-v, -s                 Split the active pane side by side\n"
+          "  --split-h, -sh                Split the active pane top/bottom\n"
+          "  --left,    -l                 Focus the previous pane\n"
+          "  --right,   -r                 Focus the next pane\n"
+          "  --scroll-up,   -su            Scroll back half a page\n"
+          "  --scroll-down, -sd            Scroll forward half a page\n"
+          "  --stats,   -st                Print render and I/O counters\n"
+          "  --next-output, -no            Move the focus to the next output\n"
+          "  --rescan,  -rs                Re-read the monitors and modes\n"
+          "  --log-level[=LEVEL]           Show or set the log level\n"
+          "                                (debug, info, warn, fatal)\n"
           "  --help,    -h                 Show this help message\n"
           "\n"
           "Log: /tmp/opalterm.log\n"
@@ -1009,10 +5550,25 @@ static const char *ipc_normalize_cmd(const char *arg) {
     return "--prev";
   if (strcmp(arg, "--split-v") == 0 || strcmp(arg, "-s") == 0)
     return "--split-v";
+  if (strcmp(arg, "--split-h") == 0 || strcmp(arg, "-sh") == 0)
+    return "--split-h";
   if (strcmp(arg, "--left") == 0 || strcmp(arg, "-l") == 0)
     return "--left";
   if (strcmp(arg, "--right") == 0 || strcmp(arg, "-r") == 0)
     return "--right";
+  if (strcmp(arg, "--scroll-up") == 0 || strcmp(arg, "-su") == 0)
+    return "--scroll-up";
+  if (strcmp(arg, "--scroll-down") == 0 || strcmp(arg, "-sd") == 0)
+    return "--scroll-down";
+  if (strcmp(arg, "--stats") == 0 || strcmp(arg, "-st") == 0)
+    return "--stats";
+  if (strcmp(arg, "--next-output") == 0 || strcmp(arg, "-no") == 0)
+    return "--next-output";
+  if (strcmp(arg, "--rescan") == 0 || strcmp(arg, "-rs") == 0)
+    return "--rescan";
+  if (strncmp(arg, "--log-level", 11) == 0 &&
+      (arg[11] == '\0' || arg[11] == '='))
+    return arg;
   return NULL;
 }
 
@@ -1044,25 +5600,93 @@ static int ipc_try_client(int argc, char **argv) {
     fprintf(stderr, "opalterm: server already running.\n"
                     "Use --new-tab (-nt), --next (-n), --prev (-p),\n"
                     "    --left (-l), --right (-r),\n"
-                    "    --split-v (-s), or --help (-h).\n");
+                    "    --split-v (-s), --split-h (-sh), or --help (-h).\n");
+    close(sock);
+    return 1;
+  }
+
+  /* Every argument is one command; all of them go in one request. */
+  char msg[4 + IPC_MSG_MAX];
+  uint32_t len = 0;
+  for (int i = 1; i < argc; i++) {
+    const char *cmd = ipc_normalize_cmd(argv[i]);
+    if (!cmd) {
+      fprintf(stderr,
+              "opalterm: unknown command '%s'\n"
+              "Use --help (-h) to see available commands.\n",
+              argv[i]);
+      close(sock);
+      return 1;
+    }
+    size_t n = strlen(cmd);
+    if (len + n + 1 > IPC_MSG_MAX) {
+      fprintf(stderr, "opalterm: too many commands\n");
+      close(sock);
+      return 1;
+    }
+    memcpy(msg + 4 + len, cmd, n);
+    msg[4 + len + n] = '\n';
+    len += (uint32_t)n + 1;
+  }
+  memcpy(msg, &len, 4);
+  if (write_all(sock, msg, 4 + (size_t)len) < 0) {
+    fprintf(stderr, "opalterm: IPC send failed: %s\n", strerror(errno));
     close(sock);
     return 1;
   }
-
-  const char *cmd = ipc_normalize_cmd(argv[1]);
-  if (cmd) {
-    write(sock, cmd, strlen(cmd));
-  } else {
-    fprintf(stderr,
-            "opalterm: unknown command '%s'\n"
-            "Use --help (-h) to see available commands.\n",
-            argv[1]);
-    close(sock);
+
+  /* The reply: a status line per command, in order, each followed by
+   * the command's output lines, which go to stdout. */
+  char hdr[4];
+  char *reply = hdr;
+  size_t got = 0, want = 4;
+  while (got < want) {
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    ssize_t n = -1;
+    if (poll(&pfd, 1, IPC_REPLY_TIMEOUT_MS) > 0)
+      n = read(sock, reply + got, want - got);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      fprintf(stderr, "opalterm: no reply from server\n");
+      break;
+    }
+    got += (size_t)n;
+    if (reply == hdr && got == 4) {
+      uint32_t rlen;
+      memcpy(&rlen, hdr, 4);
+      if (rlen > IPC_REPLY_MAX || !(reply = malloc(rlen + 4))) {
+        fprintf(stderr, "opalterm: bad reply from server\n");
+        reply = hdr;
+        break;
+      }
+      memcpy(reply, hdr, 4);
+      want = 4 + rlen;
+    }
+  }
+  close(sock);
+  if (got < want) {
+    if (reply != hdr)
+      free(reply);
     return 1;
   }
 
-  close(sock);
-  return 0;
+  int failed = 0, i = 0;
+  for (char *line = reply + 4; line < reply + want;) {
+    char *end = memchr(line, '\n', (size_t)(reply + want - line));
+    if (!end)
+      break;
+    if (line[0] == ' ') {
+      fwrite(line + 2, 1, (size_t)(end + 1 - (line + 2)), stdout);
+    } else if (++i < argc && strncmp(line, "ok", 2) != 0) {
+      fprintf(stderr, "opalterm: '%s' failed\n", argv[i]);
+      failed = 1;
+    }
+    line = end + 1;
+  }
+  if (reply != hdr)
+    free(reply);
+  return failed;
 }
 
 static int ipc_server_init(void) {
@@ -1104,265 +5728,1220 @@ static int ipc_server_init(void) {
   return 0;
 }
 
+/* The reply being built: a 4-byte length slot, then status and output
+ * lines. Output lines are indented by two spaces and follow the status
+ * line of their command. */
+static char *g_ipc_reply;
+static size_t g_ipc_reply_len, g_ipc_reply_cap;
+static int g_ipc_reply_lost; /* over IPC_REPLY_MAX or out of memory */
+
+static void ipc_reply_put(const char *data, size_t n) {
+  if (g_ipc_reply_len + n > g_ipc_reply_cap) {
+    size_t cap = g_ipc_reply_cap ? g_ipc_reply_cap : 4096;
+    while (cap < g_ipc_reply_len + n)
+      cap *= 2;
+    char *grown = cap <= IPC_REPLY_MAX ? realloc(g_ipc_reply, cap) : NULL;
+    if (!grown) {
+      g_ipc_reply_lost = 1;
+      return;
+    }
+    g_ipc_reply = grown;
+    g_ipc_reply_cap = cap;
+  }
+  memcpy(g_ipc_reply + g_ipc_reply_len, data, n);
+  g_ipc_reply_len += n;
+}
+
+__attribute__((format(printf, 1, 2))) static void
+ipc_printf(const char *fmt, ...) {
+  char line[256] = "  ";
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(line + 2, sizeof(line) - 3, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  size_t len = 2 + ((size_t)n < sizeof(line) - 3 ? (size_t)n : sizeof(line) - 4);
+  line[len++] = '\n';
+  ipc_reply_put(line, len);
+}
+
+/* --stats: one line per counter group, then one per pane. Counters
+ * are totals since startup; rates are left to the scraper. */
+static void ipc_report_stats(void) {
+  const Stats *st = &g_stats;
+  const FontState *font = &g_app.font;
+  uint64_t now = now_ns();
+  ipc_printf("uptime_ms=%" PRIu64, (now - st->start_ns) / 1000000u);
+  ipc_printf("wakeups=%" PRIu64 " timeouts=%" PRIu64, st->wakeups,
+             st->timeouts);
+  ipc_printf("frames=%" PRIu64 " full=%" PRIu64 " coalesced=%" PRIu64
+             " flip_waits=%" PRIu64 " render_us=%" PRIu64,
+             st->frames, st->full_frames, st->frames_coalesced,
+             st->flip_waits, st->frame_ns / 1000u);
+
+  char hist[256];
+  size_t off = 0;
+  for (int b = 0; b < STATS_HIST_BUCKETS && off < sizeof(hist); b++) {
+    unsigned lim = STATS_HIST_FIRST_US << b;
+    int n = b < STATS_HIST_BUCKETS - 1
+                ? snprintf(hist + off, sizeof(hist) - off, " lt%uus=%" PRIu64,
+                           lim, st->frame_hist[b])
+                : snprintf(hist + off, sizeof(hist) - off, " ge%uus=%" PRIu64,
+                           lim / 2, st->frame_hist[b]);
+    if (n < 0)
+      break;
+    off += (size_t)n;
+  }
+  ipc_printf("frame_hist%s", off ? hist : "");
+
+  ipc_printf("glyph_hits=%" PRIu64 " glyph_misses=%" PRIu64
+             " glyph_evictions=%u blend_hits=%" PRIu64
+             " blend_misses=%" PRIu64,
+             font->cache.hits, font->cache.misses, font->cache.evictions,
+             font->blend.hits, font->blend.misses);
+  ipc_printf("log_records=%" PRIu64 " log_dropped=%" PRIu64,
+             atomic_load(&g_log.records), atomic_load(&g_log.dropped));
+  if (g_capture)
+    ipc_printf("capture_frames=%" PRIu64 " capture_bytes=%" PRIu64
+               " capture_deferred=%" PRIu64 " capture_open=%d",
+               g_capture->frames, g_capture->bytes, g_capture->deferred,
+               g_capture->fd >= 0);
+
+  for (int o = 0; o < g_app.num_outputs; o++) {
+    const Output *out = &g_app.outputs[o];
+    ipc_printf("output=%d conn=%u mode=%ux%u@%u tab=%d frames=%" PRIu64, o,
+               out->hw.drm.conn_id, out->hw.drm.width, out->hw.drm.height,
+               out->hw.drm.mode.vrefresh, out->tab ? tab_index(out->tab) : -1,
+               out->frames);
+  }
+
+  for (int t = 0; t < g_app.num_tabs; t++)
+    for (PaneNode *n = node_first_leaf(g_app.tabs[t]->root); n;
+         n = node_next_leaf(n)) {
+      const PaneSession *pane = n->pane;
+      size_t queued = ring_len(&pane->input);
+      ipc_printf("pane=%d tab=%d rx=%" PRIu64 " parsed=%" PRIu64
+                 " queued=%zu parse_us=%" PRIu64,
+                 pane->slot, t, pane->parsed + queued, pane->parsed, queued,
+                 pane->parse_ns / 1000u);
+    }
+}
+
+/* Runs one command. Returns 1 when what is shown changed, 0 when
+ * there was nothing to do, -1 for an unknown or failed command. */
 static int ipc_handle_command(const char *cmd) {
+  Output *out = &g_app.outputs[g_app.focus];
   if (strcmp(cmd, "--new-tab") == 0) {
-    if (g_app.num_tabs < MAX_TABS) {
-      int idx = g_app.num_tabs;
-      if (tab_session_init(&g_app.tabs[idx], &g_app.hw, &g_app.cfg) == 0) {
-        g_app.num_tabs++;
-        g_app.active_tab = idx;
-        LOG_INFO("IPC: New tab %d created.\n", idx);
-      }
-    } else {
-      LOG_WARN("IPC: Max tabs (%d) reached.\n", MAX_TABS);
-    }
+    TabSession *tab = tab_open(out, &g_app.cfg);
+    if (!tab)
+      return -1;
+    out->tab = tab;
+    LOG_INFO("IPC: New tab %d created on output %d.\n", tab_index(tab),
+             g_app.focus);
     return 1;
   }
 
-  if (strcmp(cmd, "--next") == 0) {
-    if (g_app.num_tabs > 0) {
-      g_app.active_tab = (g_app.active_tab + 1) % g_app.num_tabs;
-      LOG_INFO("IPC: Switched to tab %d.\n", g_app.active_tab);
+  if (strcmp(cmd, "--next") == 0 || strcmp(cmd, "--prev") == 0) {
+    if (out->tab) {
+      out->tab = tab_step(out->tab, strcmp(cmd, "--next") == 0 ? 1 : -1);
+      tab_catch_up(out->tab);
+      LOG_INFO("IPC: Switched to tab %d.\n", tab_index(out->tab));
     }
     return 1;
   }
 
-  if (strcmp(cmd, "--prev") == 0) {
-    if (g_app.num_tabs > 0) {
-      g_app.active_tab =
-          (g_app.active_tab - 1 + g_app.num_tabs) % g_app.num_tabs;
-      LOG_INFO("IPC: Switched to tab %d.\n", g_app.active_tab);
-    }
+  if (strcmp(cmd, "--next-output") == 0) {
+    g_app.focus = (g_app.focus + 1) % g_app.num_outputs;
+    LOG_INFO("IPC: Focus output %d.\n", g_app.focus);
     return 1;
   }
 
-  if (strcmp(cmd, "--split-v") == 0) {
-    TabSession *tab = &g_app.tabs[g_app.active_tab];
-    if (tab->active) {
-      if (split_pane_vertical(tab, &g_app.hw, &g_app.cfg) == 0)
-        LOG_INFO("IPC: Split tab %d vertically.\n", g_app.active_tab);
+  if (strcmp(cmd, "--stats") == 0) {
+    ipc_report_stats();
+    return 0;
+  }
+
+  if (strcmp(cmd, "--rescan") == 0) {
+    if (display_rescan() < 0)
+      return -1;
+    if (g_rescan_wanted)
+      ipc_printf("rescan=deferred");
+    for (int o = 0; o < g_app.num_outputs; o++) {
+      const DrmState *drm = &g_app.outputs[o].hw.drm;
+      ipc_printf("output=%d mode=%ux%u@%u", o, drm->width, drm->height,
+                 drm->mode.vrefresh);
     }
     return 1;
   }
 
-  if (strcmp(cmd, "--left") == 0) {
-    TabSession *tab = &g_app.tabs[g_app.active_tab];
-    if (tab->active && tab->num_panes == 2) {
-      tab->active_pane = 0;
-      LOG_INFO("IPC: Focus left pane (tab %d).\n", g_app.active_tab);
+  if (strncmp(cmd, "--log-level", 11) == 0 &&
+      (cmd[11] == '\0' || cmd[11] == '=')) {
+    if (cmd[11] == '=') {
+      int level = log_level_parse(cmd + 12);
+      if (level < 0)
+        return -1;
+      atomic_store(&g_log_level, level);
     }
+    ipc_printf("log_level=%s", log_level_names[atomic_load(&g_log_level)]);
+    return 0;
+  }
+
+  TabSession *tab = out->tab;
+  if (!tab)
+    return 0;
+
+  if (strcmp(cmd, "--split-v") == 0 || strcmp(cmd, "--split-h") == 0) {
+    int split = strcmp(cmd, "--split-v") == 0 ? SPLIT_V : SPLIT_H;
+    if (pane_split(tab, split, &out->hw, &g_app.cfg) < 0)
+      return -1;
+    LOG_INFO("IPC: Split tab %d %s.\n", tab_index(tab),
+             split == SPLIT_V ? "vertically" : "horizontally");
     return 1;
   }
 
-  if (strcmp(cmd, "--right") == 0) {
-    TabSession *tab = &g_app.tabs[g_app.active_tab];
-    if (tab->active && tab->num_panes == 2) {
-      tab->active_pane = 1;
-      LOG_INFO("IPC: Focus right pane (tab %d).\n", g_app.active_tab);
+  if (strcmp(cmd, "--left") == 0 || strcmp(cmd, "--right") == 0) {
+    PaneNode *n = strcmp(cmd, "--left") == 0
+                      ? node_prev_leaf(tab->active_pane->node)
+                      : node_next_leaf(tab->active_pane->node);
+    if (n) {
+      tab->active_pane = n->pane;
+      LOG_INFO("IPC: Focus pane %d (tab %d).\n", n->pane->slot,
+               tab_index(tab));
     }
     return 1;
   }
 
+  if (strcmp(cmd, "--scroll-up") == 0 || strcmp(cmd, "--scroll-down") == 0) {
+    PaneSession *pane = tab->active_pane;
+    Scrollback *sb = &pane->sb;
+    int step = pane->term_rows / 2 > 0 ? pane->term_rows / 2 : 1;
+    int view = sb->view + (strcmp(cmd, "--scroll-up") == 0 ? step : -step);
+    if (view > (int)sb->count)
+      view = (int)sb->count;
+    sb->view = view > 0 ? view : 0;
+    LOG_INFO("IPC: Scrollback view %d/%zu lines.\n", sb->view, sb->count);
+    return 1;
+  }
+
   LOG_WARN("IPC: Unknown command '%s'\n", cmd);
+  return -1;
+}
+
+/* Wire format, both ways: a native-endian uint32 byte count, then that
+ * many bytes of newline-separated lines. A request carries up to
+ * IPC_MSG_MAX bytes of commands; its reply holds one "ok" or "error"
+ * line per command, in order, each followed by that command's output
+ * lines, indented by two spaces. Connections are non-blocking and may
+ * carry any number of requests, so nothing here ever waits on a
+ * client. */
+
+static void ipc_client_close(IpcClient *c) {
+  ep_watch(c->fd, c, 0);
+  close(c->fd);
+  free(c->out);
+  c->out = NULL;
+  c->out_len = 0;
+  c->used = 0;
+}
+
+/* Sends what the socket takes now and keeps the rest. While anything
+ * is kept the client is watched for room to write only, so it is not
+ * read from until it has taken its replies. */
+static int ipc_client_send(IpcClient *c, const char *data, size_t n) {
+  if (c->out_len) {
+    if (n) {
+      char *grown = c->out_len + n <= IPC_REPLY_MAX
+                        ? realloc(c->out, c->out_len + n)
+                        : NULL;
+      if (!grown)
+        return -1;
+      memcpy(grown + c->out_len, data, n);
+      c->out = grown;
+      c->out_len += n;
+    }
+    data = c->out;
+    n = c->out_len;
+  }
+  ssize_t w = 0;
+  while ((size_t)w < n) {
+    ssize_t k = send(c->fd, data + w, n - (size_t)w,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k < 0 && errno == EAGAIN)
+      break;
+    if (k < 0)
+      return -1;
+    w += k;
+  }
+  int was_waiting = c->out_len != 0;
+  size_t left = n - (size_t)w;
+  if (left && !c->out_len) {
+    c->out = malloc(left);
+    if (!c->out)
+      return -1;
+    memcpy(c->out, data + w, left);
+  } else if (left) {
+    memmove(c->out, c->out + w, left);
+  } else {
+    free(c->out);
+    c->out = NULL;
+  }
+  c->out_len = left;
+  if (was_waiting != (left != 0))
+    ep_rewatch(c->fd, c, left ? EPOLLOUT : EPOLLIN);
+  return 0;
+}
+
+/* Runs one request's commands and sends the reply. */
+static int ipc_run_request(IpcClient *c, const char *body, uint32_t len,
+                           int *redraw) {
+  g_ipc_reply_len = 0;
+  g_ipc_reply_lost = 0;
+  ipc_reply_put("\0\0\0\0", 4);
+  const char *end = body + len;
+  while (body < end) {
+    const char *line = body;
+    const char *nl = memchr(line, '\n', (size_t)(end - line));
+    size_t n = (size_t)((nl ? nl : end) - line);
+    body = nl ? nl + 1 : end;
+    if (n == 0)
+      continue;
+    char cmd[IPC_CMD_MAX];
+    int rc = -1;
+    size_t mark = g_ipc_reply_len;
+    if (n < sizeof(cmd)) {
+      memcpy(cmd, line, n);
+      cmd[n] = '\0';
+      rc = ipc_handle_command(cmd);
+      LOG_DEBUG("IPC: '%s' -> %d\n", cmd, rc);
+    }
+    if (rc > 0)
+      *redraw = 1;
+    /* The status goes ahead of whatever the command printed. */
+    const char *res = rc < 0 ? "error\n" : "ok\n";
+    size_t rlen = strlen(res), out = g_ipc_reply_len - mark;
+    ipc_reply_put(res, rlen);
+    if (g_ipc_reply_lost)
+      break;
+    memmove(g_ipc_reply + mark + rlen, g_ipc_reply + mark, out);
+    memcpy(g_ipc_reply + mark, res, rlen);
+  }
+  if (g_ipc_reply_lost) {
+    LOG_WARN("IPC: Reply over %d bytes, dropping client.\n", IPC_REPLY_MAX);
+    return -1;
+  }
+  uint32_t rlen = (uint32_t)(g_ipc_reply_len - 4);
+  memcpy(g_ipc_reply, &rlen, 4);
+  return ipc_client_send(c, g_ipc_reply, g_ipc_reply_len);
+}
+
+/* Runs every whole request buffered for a client, stopping early
+ * while a reply is held back. Returns -1 if the client must go. */
+static int ipc_client_run(IpcClient *c, int *redraw) {
+  size_t off = 0;
+  int rc = 0;
+  while (c->len - off >= 4 && !c->out_len) {
+    uint32_t len;
+    memcpy(&len, c->buf + off, 4);
+    if (len > IPC_MSG_MAX) {
+      LOG_WARN("IPC: %u-byte request over the %d-byte limit, dropping "
+               "client.\n",
+               len, IPC_MSG_MAX);
+      return -1;
+    }
+    if (c->len - off - 4 < len)
+      break;
+    rc = ipc_run_request(c, c->buf + off + 4, len, redraw);
+    off += 4 + (size_t)len;
+    if (rc < 0) {
+      LOG_WARN("IPC: Client not taking replies, dropping it.\n");
+      return -1;
+    }
+  }
+  memmove(c->buf, c->buf + off, c->len - off);
+  c->len -= off;
   return 0;
 }
 
-static int ipc_accept_and_handle(void) {
-  int client_fd = accept(g_ipc_fd, NULL, NULL);
-  if (client_fd < 0)
+/* Flushes held-back replies, then runs the client's requests as they
+ * arrive. A bounded number of reads per wakeup keeps one busy client
+ * from starving the loop; epoll reports it again. Returns 1 when a
+ * command changed what is shown. */
+static int ipc_client_service(IpcClient *c) {
+  int redraw = 0;
+  if (c->out_len && ipc_client_send(c, NULL, 0) < 0) {
+    ipc_client_close(c);
     return 0;
+  }
+  for (int r = 0;; r++) {
+    if (ipc_client_run(c, &redraw) < 0) {
+      ipc_client_close(c);
+      break;
+    }
+    if (c->out_len || r == IPC_READS_PER_WAKE)
+      break;
+    ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      break;
+    if (n <= 0) {
+      ipc_client_close(c);
+      break;
+    }
+    c->len += (size_t)n;
+  }
+  return redraw;
+}
 
-  int flags = fcntl(client_fd, F_GETFL);
-  if (flags >= 0)
-    fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
+static void ipc_accept_clients(void) {
+  for (;;) {
+    int fd = accept4(g_ipc_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        LOG_WARN("IPC: accept failed: %s\n", strerror(errno));
+      return;
+    }
+    IpcClient *c = NULL;
+    for (int i = 0; i < IPC_MAX_CLIENTS && !c; i++)
+      if (!g_ipc_clients[i].used)
+        c = &g_ipc_clients[i];
+    if (!c) {
+      LOG_WARN("IPC: %d clients connected, refusing another.\n",
+               IPC_MAX_CLIENTS);
+      close(fd);
+      continue;
+    }
+    *c = (IpcClient){.used = 1, .fd = fd};
+    ep_watch(fd, c, 1);
+  }
+}
+
+/* The client an epoll tag belongs to, or NULL. */
+static IpcClient *ipc_client_of(void *tag) {
+  uintptr_t p = (uintptr_t)tag, base = (uintptr_t)g_ipc_clients;
+  if (p < base || p >= base + sizeof(g_ipc_clients))
+    return NULL;
+  return tag;
+}
 
-  struct pollfd pfd = {.fd = client_fd, .events = POLLIN};
-  int pret = poll(&pfd, 1, IPC_READ_TIMEOUT_MS);
+/* -- Keyboard Input ----------------------------------------------- */
 
-  int result = 0;
-  if (pret > 0 && (pfd.revents & POLLIN)) {
-    char cmd_buf[64];
-    memset(cmd_buf, 0, sizeof(cmd_buf));
-    ssize_t n = read(client_fd, cmd_buf, sizeof(cmd_buf) - 1);
-    if (n > 0) {
-      cmd_buf[n] = '\0';
-      result = ipc_handle_command(cmd_buf);
+#define INPUT_SENT 1   /* bytes went to a pane: its echo is due soon */
+#define INPUT_REDRAW 2 /* what is shown changed: redraw in full now */
+
+/* Hands keyboard bytes to the active pane and leaves scrollback view. */
+static int input_send(const char *buf, size_t n) {
+  const TabSession *tab = g_app.outputs[g_app.focus].tab;
+  if (!tab)
+    return 0;
+  int res = 0;
+  PaneSession *pane = tab->active_pane;
+  if (pane->master_fd >= 0) {
+    pane_write(pane, buf, n);
+    res |= INPUT_SENT;
+  }
+  if (pane->sb.view) {
+    pane->sb.view = 0;
+    res |= INPUT_REDRAW;
+  }
+  return res;
+}
+
+#ifdef OPALTERM_EVDEV
+
+/* Alt+key actions, run in-process through the IPC command handler. */
+static const struct {
+  unsigned int code;
+  const char *cmd;
+} evdev_hotkeys[] = {
+    {KEY_TAB, "--next"},          {KEY_UP, "--prev"},
+    {KEY_DOWN, "--next"},         {KEY_LEFT, "--left"},
+    {KEY_RIGHT, "--right"},       {KEY_PAGEUP, "--scroll-up"},
+    {KEY_PAGEDOWN, "--scroll-down"}, {KEY_GRAVE, "--next-output"},
+};
+
+/* One key event. xkb state sees every press and release (never
+ * repeats) so modifiers stay right; only presses and repeats produce
+ * input, and only when @deliver is set. */
+static int evdev_key(EvdevInput *in, unsigned int code, int value,
+                     int deliver) {
+  if (value != 2)
+    xkb_state_update_key(in->state, EVDEV_TO_XKB(code),
+                         value ? XKB_KEY_DOWN : XKB_KEY_UP);
+  if (value == 0 || !deliver)
+    return 0;
+
+  int ctrl = xkb_state_mod_name_is_active(in->state, XKB_MOD_NAME_CTRL,
+                                          XKB_STATE_MODS_EFFECTIVE) > 0;
+  int alt = xkb_state_mod_name_is_active(in->state, XKB_MOD_NAME_ALT,
+                                         XKB_STATE_MODS_EFFECTIVE) > 0;
+  if (ctrl && alt && evdev_vt_key(code)) {
+    if (g_tty_fd >= 0 && ioctl(g_tty_fd, VT_ACTIVATE, evdev_vt_key(code)) < 0)
+      LOG_WARN("VT_ACTIVATE failed: %s\n", strerror(errno));
+    return 0;
+  }
+  if (alt && !ctrl)
+    for (size_t i = 0; i < sizeof(evdev_hotkeys) / sizeof(evdev_hotkeys[0]);
+         i++)
+      if (evdev_hotkeys[i].code == code)
+        return ipc_handle_command(evdev_hotkeys[i].cmd) > 0 ? INPUT_REDRAW
+                                                            : 0;
+
+  /* Alt sends ESC ahead of the key, as a meta prefix. */
+  char buf[64];
+  size_t n = 0;
+  if (alt)
+    buf[n++] = '\x1b';
+  const char *seq = evdev_key_sequence(code);
+  if (seq) {
+    size_t len = strlen(seq);
+    memcpy(buf + n, seq, len);
+    n += len;
+  } else {
+    int len = xkb_state_key_get_utf8(in->state, EVDEV_TO_XKB(code), buf + n,
+                                     sizeof(buf) - n);
+    if (len <= 0 || (size_t)len >= sizeof(buf) - n)
+      return 0;
+    n += (size_t)len;
+  }
+  return input_send(buf, n);
+}
+
+/* Reads every queued event; INPUT_* flags of what they did. While the
+ * VT is away events are only tracked, never delivered. A device that
+ * goes away is closed, and the TTY carries input from then on. */
+static int evdev_dispatch(EvdevInput *in, int deliver) {
+  int res = 0;
+  struct input_event ev;
+  for (;;) {
+    int rc = libevdev_next_event(in->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+    if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+      /* The kernel dropped events; the sync replays key state only. */
+      while (rc == LIBEVDEV_READ_STATUS_SYNC) {
+        if (ev.type == EV_KEY)
+          evdev_key(in, ev.code, ev.value, 0);
+        rc = libevdev_next_event(in->dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+      }
+      continue;
+    }
+    if (rc == -EAGAIN)
+      break;
+    if (rc != LIBEVDEV_READ_STATUS_SUCCESS) {
+      LOG_WARN("Keyboard read failed: %s, using the TTY.\n", strerror(-rc));
+      evdev_close(in);
+      break;
+    }
+    if (ev.type == EV_KEY)
+      res |= evdev_key(in, ev.code, ev.value, deliver);
+  }
+  return res;
+}
+
+#endif /* OPALTERM_EVDEV */
+
+/* -- Benchmark ---------------------------------------------------- */
+
+/* --bench replays canned output through the same vterm_input_write ->
+ * render_screen path the main loop uses, feeding one chunk per frame,
+ * and reports parse throughput and per-frame render time. */
+
+typedef struct {
+  char *data;
+  size_t len, cap;
+} BenchBuf;
+
+static void bench_append(BenchBuf *b, const char *s, size_t n) {
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 65536;
+    while (cap < b->len + n)
+      cap *= 2;
+    char *nd = realloc(b->data, cap);
+    if (!nd) {
+      perror("bench realloc");
+      exit(EXIT_FAILURE);
+    }
+    b->data = nd;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+#define BENCH_FLOOD_BYTES (16u << 20)
+#define BENCH_SCROLL_LINES 3000
+#define BENCH_CHUNK 65536
+
+static void bench_gen_ascii(BenchBuf *b, int cols) {
+  char line[1024];
+  int n = cols - 1 < (int)sizeof(line) - 2 ? cols - 1 : (int)sizeof(line) - 2;
+  for (unsigned k = 0; b->len < BENCH_FLOOD_BYTES; k++) {
+    for (int c = 0; c < n; c++)
+      line[c] = (char)(0x21 + (k + (unsigned)c) % 94);
+    line[n] = '\r';
+    line[n + 1] = '\n';
+    bench_append(b, line, (size_t)n + 2);
+  }
+}
+
+static void bench_gen_sgr(BenchBuf *b, int cols) {
+  char esc[48];
+  for (unsigned k = 0; b->len < BENCH_FLOOD_BYTES; k++) {
+    for (int c = 0; c < cols - 1; c++) {
+      int n = snprintf(esc, sizeof(esc), "\033[38;5;%u;48;5;%u%sm%c",
+                       (k + (unsigned)c) % 256, (k * 7 + (unsigned)c) % 256,
+                       c % 5 == 0 ? ";1" : "", (char)(0x41 + c % 26));
+      bench_append(b, esc, (size_t)n);
+    }
+    bench_append(b, "\033[0m\r\n", 6);
+  }
+}
+
+static void bench_gen_scroll(BenchBuf *b, int cols) {
+  char line[64];
+  (void)cols;
+  for (int k = 0; k < BENCH_SCROLL_LINES; k++) {
+    int n = snprintf(line, sizeof(line), "scroll line %d\r\n", k);
+    bench_append(b, line, (size_t)n);
+  }
+}
+
+static void bench_gen_cjk(BenchBuf *b, int cols) {
+  for (unsigned k = 0; b->len < BENCH_FLOOD_BYTES; k++) {
+    for (int c = 0; c < (cols - 1) / 2; c++) {
+      uint32_t cp = 0x4E00 + (k * 31 + (unsigned)c) % 0x5000;
+      char u[3] = {(char)(0xE0 | (cp >> 12)), (char)(0x80 | ((cp >> 6) & 0x3F)),
+                   (char)(0x80 | (cp & 0x3F))};
+      bench_append(b, u, 3);
+    }
+    bench_append(b, "\r\n", 2);
+  }
+}
+
+typedef struct {
+  const char *name;
+  void (*gen)(BenchBuf *b, int cols);
+  int split;
+  size_t chunk; /* bytes per frame; 0 = one line per frame */
+} BenchWorkload;
+
+static const BenchWorkload bench_workloads[] = {
+    {"ascii", bench_gen_ascii, 0, BENCH_CHUNK},
+    {"sgr", bench_gen_sgr, 0, BENCH_CHUNK},
+    {"scroll", bench_gen_scroll, 0, 0},
+    {"cjk", bench_gen_cjk, 0, BENCH_CHUNK},
+    {"split", bench_gen_ascii, 1, BENCH_CHUNK},
+};
+
+static int bench_cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void bench_tab_free(TabSession *tab) {
+  for (PaneNode *n = node_first_leaf(tab->root); n; n = node_next_leaf(n))
+    pane_release(n->pane);
+  node_free(tab->root);
+  memset(tab, 0, sizeof(*tab));
+}
+
+static int bench_tab_init(TabSession *tab, const HardwareState *hw,
+                          const AppConfig *cfg, int split) {
+  memset(tab, 0, sizeof(*tab));
+  int cols = (int)hw->drm.width / hw->font->cell_w;
+  int rows = ((int)hw->drm.height / hw->font->cell_h) - 1;
+  if (cols < 4 || rows < 1) {
+    LOG_FATAL("Grid too small: %dx%d\n", cols, rows);
+    return -1;
+  }
+  PaneSession *pane = pane_alloc();
+  if (!pane)
+    return -1;
+  if (pane_vterm_init(pane, rows, cols, cfg) < 0 ||
+      node_init_root(tab, pane) < 0) {
+    pane_release(pane);
+    return -1;
+  }
+  node_layout(tab->root, 0, 0, cols, rows, hw);
+  if (split) {
+    PaneSession *right = pane_alloc();
+    if (!right)
+      return -1;
+    if (pane_vterm_init(right, rows, cols - cols / 2, cfg) < 0 ||
+        node_split(tab, tab->root, SPLIT_V, right, hw) < 0) {
+      pane_release(right);
+      return -1;
+    }
+    tab->active_pane = right;
+  }
+  return 0;
+}
+
+static int bench_run_workload(const BenchWorkload *w) {
+  Output *out = &g_app.outputs[0];
+  TabSession *tab = g_app.tabs[0];
+  if (bench_tab_init(tab, &out->hw, &g_app.cfg, w->split) < 0)
+    return -1;
+  out->tab = tab;
+
+  BenchBuf data = {0};
+  w->gen(&data, node_first_leaf(tab->root)->pane->term_cols);
+
+  size_t max_frames = w->chunk ? data.len / w->chunk + 1 : BENCH_SCROLL_LINES;
+  uint64_t *frame_ns = malloc(max_frames * sizeof(*frame_ns));
+  if (!frame_ns) {
+    free(data.data);
+    return -1;
+  }
+
+  render_screen(out, &g_app.cfg, 1);
+
+  uint64_t parse_ns = 0, render_ns = 0;
+  size_t frames = 0, off = 0;
+  while (off < data.len && frames < max_frames) {
+    size_t n = w->chunk;
+    if (!n) {
+      const char *nl = memchr(data.data + off, '\n', data.len - off);
+      n = nl ? (size_t)(nl - (data.data + off)) + 1 : data.len - off;
+    }
+    if (n > data.len - off)
+      n = data.len - off;
+
+    uint64_t t0 = now_ns();
+    for (PaneNode *l = node_first_leaf(tab->root); l; l = node_next_leaf(l)) {
+      vterm_input_write(l->pane->vt, data.data + off, n);
+      vterm_screen_flush_damage(l->pane->vtscreen);
+    }
+    uint64_t t1 = now_ns();
+    render_screen(out, &g_app.cfg, 0);
+    uint64_t t2 = now_ns();
+
+    parse_ns += t1 - t0;
+    render_ns += t2 - t1;
+    frame_ns[frames++] = t2 - t1;
+    off += n;
+  }
+
+  qsort(frame_ns, frames, sizeof(*frame_ns), bench_cmp_u64);
+  double mb = (double)off * tab->num_panes / (1024.0 * 1024.0);
+  double p50 = frames ? frame_ns[frames / 2] / 1e6 : 0;
+  double p99 = frames ? frame_ns[(frames * 99) / 100] / 1e6 : 0;
+  printf("%-8s %8.1f %10.1f %8zu %9.1f %8.3f %8.3f\n", w->name, mb,
+         parse_ns ? mb / (parse_ns / 1e9) : 0.0, frames,
+         render_ns ? frames / (render_ns / 1e9) : 0.0, p50, p99);
+  fflush(stdout);
+
+  free(frame_ns);
+  free(data.data);
+  bench_tab_free(tab);
+  return 0;
+}
+
+/* Usage: opalterm --bench [--offscreen[=WxH]] [--capture=PATH]. Without
+ * --offscreen the real display is used (DRM master required) in
+ * shadow-copy mode so frame times are not paced by vblank; --capture
+ * records the frames as capture_path would. */
+static int bench_main(int argc, char **argv) {
+  int offscreen = 0;
+  unsigned w = 1920, h = 1080;
+  for (int i = 2; i < argc; i++) {
+    if (strncmp(argv[i], "--offscreen", 11) == 0) {
+      offscreen = 1;
+      if (argv[i][11] == '=' && sscanf(argv[i] + 12, "%ux%u", &w, &h) != 2) {
+        fprintf(stderr, "opalterm: bad size '%s'\n", argv[i] + 12);
+        return EXIT_FAILURE;
+      }
+    } else if (strncmp(argv[i], "--capture=", 10) == 0) {
+      g_app.cfg.capture_path = argv[i] + 10;
+    } else {
+      fprintf(stderr, "opalterm: unknown bench option '%s'\n", argv[i]);
+      return EXIT_FAILURE;
     }
-  } else if (pret == 0) {
-    LOG_WARN("IPC: Client sent no data within %dms, closing.\n",
-             IPC_READ_TIMEOUT_MS);
   }
 
-  close(client_fd);
-  return result;
+  atomic_store(&g_log_level, g_app.cfg.log_level);
+  log_init();
+  LOG_INFO("opalterm starting (bench mode)...\n");
+  atexit(full_cleanup);
+
+  HardwareState *hw = &g_app.outputs[0].hw;
+  hw->font = &g_app.font;
+  int rc = offscreen ? drm_init_offscreen(&hw->drm, w, h)
+                     : drm_init(&hw->drm, 1, 1, -1);
+  if (rc >= 0) {
+    g_app.num_outputs = 1;
+    g_app.drm_fd = hw->drm.fd;
+  }
+  if (rc < 0 || font_init(&g_app.font, &g_app.cfg, NULL) < 0) {
+    fprintf(stderr, "opalterm: bench setup failed, see %s\n", LOG_PATH);
+    return EXIT_FAILURE;
+  }
+  g_app.tabs = calloc(1, sizeof(*g_app.tabs));
+  if (!g_app.tabs || !(g_app.tabs[0] = calloc(1, sizeof(TabSession)))) {
+    fprintf(stderr, "opalterm: bench setup failed, out of memory\n");
+    return EXIT_FAILURE;
+  }
+  g_app.num_tabs = g_app.tabs_cap = 1;
+  g_app.initialized = 1;
+  const char *capture = g_app.cfg.capture_path;
+  if (capture && !(hw->drm.capture = g_capture = capture_open(capture))) {
+    fprintf(stderr, "opalterm: cannot capture to %s\n", capture);
+    return EXIT_FAILURE;
+  }
+
+  printf("opalterm bench: %ux%u %s, cell %dx%d\n", hw->drm.width,
+         hw->drm.height, offscreen ? "offscreen" : "drm", g_app.font.cell_w,
+         g_app.font.cell_h);
+  printf("%-8s %8s %10s %8s %9s %8s %8s\n", "workload", "MB", "parse MB/s",
+         "frames", "frames/s", "p50 ms", "p99 ms");
+  for (size_t i = 0; i < sizeof(bench_workloads) / sizeof(bench_workloads[0]);
+       i++)
+    if (bench_run_workload(&bench_workloads[i]) < 0)
+      return EXIT_FAILURE;
+
+  /* Nothing polls the capture here: give its reader a second per
+   * write to take the last frame. */
+  while (g_capture && g_capture->fd >= 0) {
+    capture_pump(g_capture, &hw->drm);
+    struct pollfd pfd = {.fd = g_capture->fd, .events = POLLOUT};
+    if (g_capture->out_off == g_capture->out_len || poll(&pfd, 1, 1000) <= 0)
+      break;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* -- Startup Cache ------------------------------------------------ */
+
+/* What the last start found, so the next one can skip the probing:
+ * the DRM card, the font, its cell size and the grid they make. Any
+ * entry that no longer holds is just probed for again. */
+typedef struct {
+  int card;
+  char font[256];
+  int cols, rows;
+  int cell_w, cell_h;
+} StartupCache;
+
+static void startup_cache_load(StartupCache *sc) {
+  char path[512], line[300];
+  if (cache_path(path, sizeof(path), "startup", 0) < 0)
+    return;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "card=%d", &sc->card) != 1 &&
+        sscanf(line, "grid=%dx%d", &sc->cols, &sc->rows) != 2 &&
+        sscanf(line, "cell=%dx%d", &sc->cell_w, &sc->cell_h) != 2)
+      sscanf(line, "font=%255[^\n]", sc->font);
+  }
+  fclose(f);
+  LOG_INFO("Startup cache: card %d, font %s, cell %dx%d, grid %dx%d.\n",
+           sc->card, sc->font[0] ? sc->font : "-", sc->cell_w, sc->cell_h,
+           sc->cols, sc->rows);
+}
+
+/* Rewrites the cache when this start found something else. */
+static void startup_cache_save(const StartupCache *old,
+                               const HardwareState *hw) {
+  StartupCache sc = {.card = hw->drm.card,
+                     .cell_w = hw->font->cell_w,
+                     .cell_h = hw->font->cell_h};
+  snprintf(sc.font, sizeof(sc.font), "%s", hw->font->path);
+  grid_size(hw, &sc.cols, &sc.rows);
+  if (sc.card == old->card && strcmp(sc.font, old->font) == 0 &&
+      sc.cols == old->cols && sc.rows == old->rows &&
+      sc.cell_w == old->cell_w && sc.cell_h == old->cell_h)
+    return;
+
+  char path[512], tmp[520];
+  if (cache_path(path, sizeof(path), "startup", 1) < 0)
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "w");
+  if (!f) {
+    LOG_WARN("Startup cache %s: %s\n", tmp, strerror(errno));
+    return;
+  }
+  fprintf(f, "card=%d\nfont=%s\ncell=%dx%d\ngrid=%dx%d\n", sc.card, sc.font,
+          sc.cell_w, sc.cell_h, sc.cols, sc.rows);
+  if (fclose(f) != 0 || rename(tmp, path) < 0) {
+    LOG_WARN("Startup cache %s: %s\n", path, strerror(errno));
+    unlink(tmp);
+    return;
+  }
+  LOG_INFO("Startup cache updated: %s\n", path);
+}
+
+typedef struct {
+  FontState *font;
+  const AppConfig *cfg;
+  const char *path_hint;
+  int rc;
+} FontJob;
+
+static void *font_job_main(void *arg) {
+  FontJob *job = arg;
+  job->rc = font_init(job->font, job->cfg, job->path_hint);
+  return NULL;
+}
+
+/* Modesets on this thread while FreeType loads the face and warms the
+ * glyph cache on another; the two share no state. */
+static int display_init(const StartupCache *sc) {
+  FontJob job = {&g_app.font, &g_app.cfg, sc->font[0] ? sc->font : NULL, -1};
+  pthread_t thread;
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int threaded = pthread_create(&thread, NULL, font_job_main, &job) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  DrmState found[DRM_MAX_OUTPUTS];
+  const AppConfig *cfg = &g_app.cfg;
+  int n;
+  if (cfg->offscreen_width && cfg->offscreen_height)
+    n = drm_init_offscreen(found, cfg->offscreen_width,
+                           cfg->offscreen_height) < 0 ? -1 : 1;
+  else
+    n = drm_init(found, DRM_MAX_OUTPUTS, cfg->drm_buffers, sc->card);
+  for (int o = 0; o < n; o++) {
+    g_app.outputs[o].hw.drm = found[o];
+    g_app.outputs[o].hw.font = &g_app.font;
+  }
+  if (n > 0) {
+    g_app.num_outputs = n;
+    g_app.drm_fd = found[0].fd;
+  }
+  if (threaded)
+    pthread_join(thread, NULL);
+  else
+    font_job_main(&job);
+  return n < 0 || job.rc < 0 ? -1 : 0;
 }
 
 /* -- Main --------------------------------------------------------- */
 
 int main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+    return bench_main(argc, argv);
+
   int client_rc = ipc_try_client(argc, argv);
   if (client_rc == 0)
     return EXIT_SUCCESS;
   if (client_rc == 1)
     return EXIT_FAILURE;
 
+  atomic_store(&g_log_level, g_app.cfg.log_level);
   log_init();
   LOG_INFO("opalterm starting (server mode)...\n");
   atexit(full_cleanup);
+  g_stats.start_ns = now_ns();
   install_signal_handlers();
 
   if (ipc_server_init() < 0)
     return EXIT_FAILURE;
-  if (drm_init(&g_app.hw.drm) < 0)
-    return EXIT_FAILURE;
-  if (font_init(&g_app.hw.font, &g_app.cfg) < 0)
-    return EXIT_FAILURE;
-
-  vt_setup();
 
-  if (enable_raw_mode() < 0)
+  /* The first shell starts on its prompt while the display comes up. */
+  StartupCache cache = {.card = -1};
+  if (g_app.cfg.startup_cache)
+    startup_cache_load(&cache);
+  if (cache.cols > 0 && cache.rows > 0)
+    early_shell_start(cache.cols, cache.rows, cache.cell_w, cache.cell_h);
+  else
+    early_shell_start(80, 24, 0, 0);
+  if (display_init(&cache) < 0)
     return EXIT_FAILURE;
+  if (g_app.cfg.io_thread)
+    io_thread_start(&g_io, &g_app.cfg);
 
-  if (tab_session_init(&g_app.tabs[0], &g_app.hw, &g_app.cfg) < 0)
+  g_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (g_epfd < 0) {
+    LOG_FATAL("epoll_create1 failed: %s\n", strerror(errno));
     return EXIT_FAILURE;
-  g_app.active_tab = 0;
-  g_app.num_tabs = 1;
+  }
+  ep_watch(STDIN_FILENO, &g_ep_stdin, 1);
+  ep_watch(g_ipc_fd, &g_ep_ipc, 1);
+  if (g_app.outputs[0].hw.drm.num_bufs > 1)
+    ep_watch(g_app.drm_fd, &g_ep_drm, 1);
+  ep_watch(g_io.notify_fd, &g_ep_io, 1);
+  const char *capture = g_app.cfg.capture_path;
+  if (capture && (g_capture = capture_open(capture)))
+    g_app.outputs[0].hw.drm.capture = g_capture;
+
+  /* Offscreen there is no display to follow or hand over, and maybe
+   * no terminal either (CI). */
+  int offscreen = g_app.outputs[0].hw.drm.offscreen;
+  if (!offscreen) {
+    g_uevent_fd = uevent_open();
+    ep_watch(g_uevent_fd, &g_ep_uevent, 1);
+    vt_setup();
+  }
+  if ((!offscreen || isatty(STDIN_FILENO)) && enable_raw_mode() < 0)
+    return EXIT_FAILURE;
+
+#ifdef OPALTERM_EVDEV
+  if (g_app.cfg.input_evdev && evdev_init(&g_evdev) == 0)
+    ep_watch(g_evdev.fd, &g_ep_evdev, 1);
+  LOG_INFO("Keyboard input: %s.\n", g_evdev.dev ? "evdev" : "tty");
+#endif
+
+  /* The first output's tab adopts the early shell. */
+  for (int o = 0; o < g_app.num_outputs; o++) {
+    Output *out = &g_app.outputs[o];
+    if (!(out->tab = tab_open(out, &g_app.cfg)))
+      return EXIT_FAILURE;
+  }
   g_app.initialized = 1;
+  if (g_app.cfg.startup_cache && !offscreen)
+    startup_cache_save(&cache, &g_app.outputs[0].hw);
 
   LOG_INFO("Interactive. IPC: --new-tab (-nt), --next (-n), --prev (-p), "
-           "--split-v (-s), --left (-l), --right (-r)\n");
+           "--split-v (-s), --split-h (-sh), --left (-l), --right (-r)\n");
 
-#define PFD_PTY_SLOTS (MAX_TABS * MAX_PANES)
-#define PFD_STDIN_IDX (PFD_PTY_SLOTS)
-#define PFD_IPC_IDX (PFD_PTY_SLOTS + 1)
-#define PFD_TOTAL (PFD_PTY_SLOTS + 2)
+#define EP_MAX_EVENTS 32
 
-  struct pollfd pfds[PFD_TOTAL];
+  struct epoll_event evs[EP_MAX_EVENTS];
   char buf[4096];
 
-  render_screen(&g_app.hw, &g_app.tabs[g_app.active_tab], &g_app.cfg);
+  /* Frame scheduler: output only marks a frame pending, and pending
+   * frames are drawn at most once per refresh interval. Output that
+   * follows a keystroke within ECHO_FASTPATH_MS, and IPC actions, skip
+   * the wait so typing latency is not quantized to the refresh. Each
+   * output is scheduled on its own, at its own refresh, which is
+   * re-read every iteration as a rescan may change it. */
+  uint64_t echo_until_ns = 0;
+
+  /* Panes to serve, by slot bit: readable PTYs polled here, and panes
+   * with output still queued in their ring. Lazy parsing: background
+   * tabs only queue their output and parse at most bg_parse_budget
+   * bytes per pane per loop iteration, after the active tab, stdin and
+   * IPC have been served. */
+  SlotMask pty_ready = {0};
+  SlotMask pending = {0};
+
+  /* Flagged panes are serviced round-robin, starting after the first
+   * one served last iteration, so budget-limited panes share the loop
+   * fairly. */
+  int rr_first = 0;
+
+  /* Headless while the VT is switched away: PTYs are still drained so
+   * children never block, but every tab is treated as a background
+   * one and queued output is parsed once per HEADLESS_PARSE_MS at
+   * most. Nothing is drawn until the VT comes back. */
+  int headless = 0;
+
+  for (int o = 0; o < g_app.num_outputs; o++)
+    render_screen(&g_app.outputs[o], &g_app.cfg, 1);
 
   while (!g_shutdown) {
-    for (int i = 0; i < MAX_TABS; i++) {
-      TabSession *tab = &g_app.tabs[i];
-      for (int p = 0; p < MAX_PANES; p++) {
-        int slot = i * MAX_PANES + p;
-        if (tab->active && p < tab->num_panes && tab->panes[p].master_fd >= 0)
-          pfds[slot] =
-              (struct pollfd){.fd = tab->panes[p].master_fd, .events = POLLIN};
-        else
-          pfds[slot] = (struct pollfd){.fd = -1, .events = 0};
-      }
+    int timeout = -1;
+    for (int o = 0; o < g_app.num_outputs && !headless; o++) {
+      const Output *out = &g_app.outputs[o];
+      if (!out->render_pending || !drm_can_render(&out->hw.drm))
+        continue;
+      uint64_t now = now_ns();
+      uint64_t due = out->last_frame_ns + drm_frame_ns(&out->hw.drm);
+      int t = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+      if (timeout < 0 || t < timeout)
+        timeout = t;
     }
+    if (pending.any)
+      timeout = headless ? HEADLESS_PARSE_MS : 0;
+    if (g_rescan_wanted && (timeout < 0 || timeout > 10))
+      timeout = 10; /* see that an overdue flip is given up */
 
-    pfds[PFD_STDIN_IDX] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
-    pfds[PFD_IPC_IDX] = (struct pollfd){.fd = g_ipc_fd, .events = POLLIN};
-
-    int ret = poll(pfds, PFD_TOTAL, -1);
-    if (ret < 0) {
+    int nev = epoll_wait(g_epfd, evs, EP_MAX_EVENTS, timeout);
+    if (nev < 0) {
       if (errno == EINTR)
         continue;
       break;
     }
+    log_tick();
+    g_stats.wakeups++;
+    g_stats.timeouts += nev == 0;
+
+    int stdin_ready = 0, ipc_ready = 0, uevent_ready = 0;
+    uint32_t ipc_clients_ready = 0;
+#ifdef OPALTERM_EVDEV
+    int evdev_ready = 0;
+#endif
+    for (int j = 0; j < nev; j++) {
+      void *src = evs[j].data.ptr;
+#ifdef OPALTERM_EVDEV
+      if (src == &g_ep_evdev) {
+        evdev_ready = 1;
+        continue;
+      }
+#endif
+      if (src == &g_ep_drm)
+        drm_handle_events(&g_app.outputs[0].hw.drm);
+      else if (src == &g_ep_io)
+        io_drain(g_io.notify_fd);
+      else if (src == &g_ep_stdin)
+        stdin_ready = 1;
+      else if (src == &g_ep_ipc)
+        ipc_ready = 1;
+      else if (src == &g_ep_uevent)
+        uevent_ready = 1;
+      else if (src == &g_ep_capture && evs[j].events & (EPOLLERR | EPOLLHUP))
+        capture_stop(g_capture, "reader gone");
+      else if (src == &g_ep_capture)
+        capture_pump(g_capture, &g_app.outputs[0].hw.drm);
+      else if (ipc_client_of(src))
+        ipc_clients_ready |= 1u << (ipc_client_of(src) - g_ipc_clients);
+      else
+        mask_set(&pty_ready, ((PaneSession *)src)->slot);
+    }
 
-    if (!g_vt_active)
-      continue;
-
-    int need_render = 0;
+    uint64_t now = now_ns();
 
-    for (int i = 0; i < MAX_TABS; i++) {
-      TabSession *tab = &g_app.tabs[i];
-      if (!tab->active)
-        continue;
+    if (!g_vt_active && !headless) {
+      headless = 1;
+      LOG_INFO("VT released, running headless.\n");
+#ifdef OPALTERM_EVDEV
+      evdev_set_grab(&g_evdev, 0);
+#endif
+    }
+    if (g_vt_acquired) {
+      g_vt_acquired = 0;
+      headless = !g_vt_active;
+      if (!headless) {
+        LOG_INFO("VT acquired, redrawing.\n");
+#ifdef OPALTERM_EVDEV
+        evdev_set_grab(&g_evdev, 1);
+#endif
+        for (int o = 0; o < g_app.num_outputs; o++)
+          drm_vt_resume(&g_app.outputs[o].hw.drm);
+        display_rescan();
+        outputs_damage_all(1, 1);
+      }
+    }
 
-      for (int p = 0; p < tab->num_panes; p++) {
-        int slot = i * MAX_PANES + p;
-        if (pfds[slot].fd < 0)
+    /* A burst of hotplug events costs one rescan. */
+    if ((uevent_ready &&
+         uevent_drain(g_uevent_fd, g_app.outputs[0].hw.drm.card)) ||
+        g_rescan_wanted)
+      display_rescan();
+
+    SlotMask work = pending;
+    mask_merge(&work, &pty_ready);
+    slotset_take(&g_io.ready, &work);
+    int first_served = -1;
+    for (int pass = 0; pass < 2 && !g_shutdown; pass++) {
+      int slot = mask_next(&work, pass == 0 ? rr_first : 0);
+      for (; slot >= 0 && !g_shutdown; slot = mask_next(&work, slot + 1)) {
+        if (pass == 1 && slot >= rr_first)
+          break;
+        PaneSession *pane = pane_at(slot);
+        if (!pane || pane->master_fd < 0) {
+          mask_clear(&pending, slot);
           continue;
-        PaneSession *pane = &tab->panes[p];
-
-        if (pfds[slot].revents & (POLLIN | POLLHUP)) {
-          for (;;) {
-            ssize_t n = read(pane->master_fd, buf, sizeof(buf));
-            if (n > 0) {
-              vterm_input_write(pane->vt, buf, (size_t)n);
-              if (i == g_app.active_tab)
-                need_render = 1;
-              continue;
-            }
-            if (n == 0 || (n < 0 && errno == EIO)) {
-              LOG_INFO("Tab %d pane %d shell exited.\n", i, p);
-              close(pane->master_fd);
-              pane->master_fd = -1;
-              if (pane->child_pid > 0) {
-                waitpid(pane->child_pid, NULL, WNOHANG);
-                pane->child_pid = -1;
-              }
-              int any_pane_alive = 0;
-              for (int q = 0; q < tab->num_panes; q++)
-                if (tab->panes[q].master_fd >= 0)
-                  any_pane_alive = 1;
-              if (!any_pane_alive) {
-                tab->active = 0;
-                int any_tab_active = 0;
-                for (int j = 0; j < g_app.num_tabs; j++)
-                  if (g_app.tabs[j].active)
-                    any_tab_active = 1;
-                if (!any_tab_active) {
-                  g_shutdown = 1;
-                  break;
-                }
-                if (i == g_app.active_tab) {
-                  for (int j = 0; j < g_app.num_tabs; j++)
-                    if (g_app.tabs[j].active) {
-                      g_app.active_tab = j;
-                      break;
-                    }
-                }
-              }
-              need_render = 1;
-              break;
-            }
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-              break;
-            if (errno == EINTR)
-              continue;
-            break;
-          }
-          if (pane->vtscreen)
-            vterm_screen_flush_damage(pane->vtscreen);
         }
-        if (pfds[slot].revents & POLLERR) {
-          pane->master_fd = -1;
-          need_render = 1;
+        if (first_served < 0)
+          first_served = slot;
+        Output *out = tab_output(pane->tab);
+        int active = !headless && tab_shown(pane->tab);
+        int foreground = active || g_app.cfg.bg_parse_budget <= 0;
+        ssize_t n = pane_service(pane, foreground,
+                                 mask_test(&pty_ready, slot), &g_app.cfg);
+        if (n > 0 && active) {
+          int echo = now < echo_until_ns;
+          output_damage(out, 0, echo);
+          if (echo)
+            echo_until_ns = 0;
+        }
+        if (n < 0) {
+          pane_on_exit(pane);
+          output_damage(out, 1, 0);
+          mask_clear(&pending, slot);
+        } else if (ring_len(&pane->input)) {
+          mask_set(&pending, slot);
+        } else {
+          mask_clear(&pending, slot);
         }
       }
     }
+    mask_reset(&pty_ready);
+    rr_first = first_served + 1;
 
     if (g_shutdown)
       break;
 
-    if (pfds[PFD_STDIN_IDX].revents & POLLIN) {
+    /* Input and commands act on the focused output; moving the focus
+     * also redraws the output it left. */
+    int focus = g_app.focus;
+    int input = 0;
+    if (stdin_ready) {
       ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
-      if (n > 0) {
-        TabSession *tab = &g_app.tabs[g_app.active_tab];
-        if (tab->active) {
-          PaneSession *pane = &tab->panes[tab->active_pane];
-          if (pane->master_fd >= 0)
-            write_all(pane->master_fd, buf, (size_t)n);
-        }
-      }
+      if (n > 0)
+        input |= input_send(buf, (size_t)n);
+      else if (n == 0) /* EOF would wake every iteration */
+        ep_watch(STDIN_FILENO, &g_ep_stdin, 0);
     }
+#ifdef OPALTERM_EVDEV
+    if (evdev_ready && g_evdev.dev)
+      input |= evdev_dispatch(&g_evdev, !headless);
+#endif
+    if (input & INPUT_SENT)
+      echo_until_ns = now + ECHO_FASTPATH_MS * 1000000u;
+    if (input & INPUT_REDRAW)
+      output_damage(&g_app.outputs[g_app.focus], 1, 1);
+
+    /* A batch of commands costs one redraw, after all of them ran. */
+    if (ipc_ready)
+      ipc_accept_clients();
+    for (int i = 0; i < IPC_MAX_CLIENTS; i++) {
+      if (!(ipc_clients_ready & (1u << i)) || !g_ipc_clients[i].used)
+        continue;
+      if (ipc_client_service(&g_ipc_clients[i]))
+        output_damage(&g_app.outputs[g_app.focus], 1, 1);
+    }
+    if (focus != g_app.focus && focus < g_app.num_outputs)
+      output_damage(&g_app.outputs[focus], 1, 1);
 
-    if (pfds[PFD_IPC_IDX].revents & POLLIN) {
-      if (ipc_accept_and_handle())
-        need_render = 1;
+    for (int slot = mask_next(&pending, 0); slot >= 0 && g_app.num_tabs;
+         slot = mask_next(&pending, slot + 1)) {
+      PaneSession *pane = pane_at(slot);
+      if (pane && !headless && tab_shown(pane->tab))
+        continue;
+      if (pane)
+        pane_parse_backlog(pane, (size_t)g_app.cfg.bg_parse_budget);
+      if (!pane || !ring_len(&pane->input))
+        mask_clear(&pending, slot);
     }
 
-    if (need_render && !g_shutdown) {
-      TabSession *active = &g_app.tabs[g_app.active_tab];
-      if (active->active)
-        render_screen(&g_app.hw, active, &g_app.cfg);
+    /* Damage keeps accumulating in the panes while a frame waits for
+     * its slot or, with page flipping, for the flip event. An output
+     * only draws when what it shows changed, and a flip still pending
+     * on one holds up no other. */
+    for (int o = 0; o < g_app.num_outputs; o++) {
+      Output *out = &g_app.outputs[o];
+      if (out->need_render) {
+        g_stats.frames_coalesced += out->render_pending;
+        out->render_pending = 1;
+        out->need_render = 0;
+      }
+      int render_now = out->render_now;
+      out->render_now = 0;
+      if (!out->render_pending || headless || g_shutdown || g_rescan_wanted)
+        continue;
+      if (!drm_can_render(&out->hw.drm)) {
+        g_stats.flip_waits++;
+        continue;
+      }
+      now = now_ns();
+      uint64_t frame_ns = drm_frame_ns(&out->hw.drm);
+      if (render_now || now - out->last_frame_ns >= frame_ns) {
+        render_screen(out, &g_app.cfg, out->full_redraw);
+        out->full_redraw = 0;
+        out->last_frame_ns = now;
+        out->render_pending = 0;
+      }
     }
   }
 